@@ -1,15 +1,35 @@
 #include <stdio.h>
 #include <math.h>
 #include "pico/stdlib.h"
+#include "pico/multicore.h"
 #include "hardware/timer.h"
+#include "hardware/sync.h"
 #include "tm1640.h"
+#include "frame_queue.h"
 #include "display.h"
 #include "rotary.h"
 #include "ds1302.h"
+#include "timekeeper.h"
 #include "ntp_client.h"
 #include "qrencode.h"
 #include "analog.h"
 
+// 1: core 1 が TM1640 への送信を受け持つ. 0: core 0 のタイマー割り込みで送信する
+#ifndef DUAL_CORE_PIPELINE
+#define DUAL_CORE_PIPELINE 1
+#endif
+// 1: QR のマスク評価の半分を core 1 で行う. core 1 が動いている DUAL_CORE_PIPELINE のときだけ使える
+#ifndef QR_PARALLEL_MASK
+#define QR_PARALLEL_MASK DUAL_CORE_PIPELINE
+#endif
+// 送信遅延と入力ポーリング間隔の計測結果を表示する間隔 (秒). 0 なら表示しない
+#define STATS_INTERVAL_S 60
+// QR コードは 32x32 の表示に収まる version 3 に固定する
+#define QR_VERSION 3
+#define QR_LEVEL QR_ECLEVEL_M
+#define QR_TEMPLATE_BYTES (11 * 1024) // QRtemplate_size(QR_VERSION, QR_LEVEL) 以上
+#define QR_FRAME_CACHE_BYTES (2 * 1024) // QRcode_frameCacheSize(QR_VERSION) 以上. 雛形と配置表 1 版分
+
 typedef enum
 {
     QR = 0,
@@ -21,7 +41,7 @@ typedef enum
 const char *weekday_japanese[7] = {"日", "月", "火", "水", "木", "金", "土"};
 
 // ピン
-const tm1640_t tm1640 = {
+tm1640_t tm1640 = {
     .pin_clk = 16,
     .pin_dios = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12},
     .brightness = 7,
@@ -39,68 +59,230 @@ ds1302_t ds1302 = {
     .pin_dio = 18,
     .pin_ce = 19,
 };
+void on_second();
+timekeeper_t timekeeper = {
+    .rtc = &ds1302,
+    .resync_interval_s = 60 * 60,
+    .on_second = on_second,
+};
 
 uint64_t display_array[TM1640_CHANNELS][2];
-Color_t display_matrix[32][32];
-bool f_update = false; // 画面更新フラグ
-struct repeating_timer timer;
+framebuffer_t display_matrix;
+volatile bool f_update = false; // 画面更新フラグ
+frame_queue_t frame_queue;
+uint8_t qr_template_buffer[QR_TEMPLATE_BYTES]; // QR テンプレートと更新の作業領域. ヒープは使わない
+QRtemplate *qr_template = NULL;
+uint8_t qr_frame_cache[QR_FRAME_CACHE_BYTES];
+
+// 計測値 (us). latency_* と frames は core 1 (または送信の割り込み) が書くので stats_lock で守る.
+// dropped と poll_gap_max は core 0 のメインループだけが書く
+typedef struct
+{
+    uint32_t latency_max; // フレームを渡してから送信し終わるまで
+    uint64_t latency_sum;
+    uint32_t frames;
+    uint32_t dropped; // キューが満杯で上書きされたフレーム
+    uint32_t poll_gap_max; // rotary_main_loop の呼び出し間隔
+} stats_t;
+stats_t stats;
+spin_lock_t *stats_lock;
+uint64_t submit_stamp;
 
-bool timer_callback(struct repeating_timer *t)
+// 秒の境界で呼ばれる
+void on_second()
 {
     f_update = true;
-    return true;
+}
+
+void record_latency(uint64_t stamp)
+{
+    uint32_t latency = time_us_64() - stamp;
+    uint32_t save = spin_lock_blocking(stats_lock);
+    if (latency > stats.latency_max)
+        stats.latency_max = latency;
+    stats.latency_sum += latency;
+    stats.frames++;
+    spin_unlock(stats_lock, save);
+}
+
+// タイマー割り込みでの送信が終わったとき
+void tm1640_done(tm1640_t *dev)
+{
+    record_latency(submit_stamp);
+}
+
+// core 1: キューに届いたフレームを送信し続ける
+void core1_main()
+{
+    uint64_t frame[TM1640_CHANNELS][2];
+    uint64_t stamp;
+
+    while (true)
+    {
+#if QR_PARALLEL_MASK
+        if (multicore_fifo_rvalid())
+        {
+            // core 0 から渡されたマスク評価のジョブ
+            void (*func)(void *) = (void (*)(void *))(uintptr_t)multicore_fifo_pop_blocking();
+            void *arg = (void *)(uintptr_t)multicore_fifo_pop_blocking();
+            func(arg);
+            multicore_fifo_push_blocking(0);
+            continue;
+        }
+#endif
+        if (frame_queue_pop_latest(&frame_queue, frame, &stamp))
+        {
+            tm1640_write_ints(&tm1640, frame);
+            record_latency(stamp);
+        }
+        else
+        {
+            tight_loop_contents();
+        }
+    }
+}
+
+#if QR_PARALLEL_MASK
+// QRcode_setParallel の runner. 奇数番目のジョブを core 1 に渡し, 偶数番目はこちらで評価する.
+// ジョブ数が QRcode_setParallel の指定と違っても (最大 QRPARALLEL_MAX_WORKERS) すべて実行される
+void qr_runner(void (*func)(void *), void **args, int n, void *data)
+{
+    int sent = 0;
+    for (int i = 1; i < n; i += 2)
+    {
+        multicore_fifo_push_blocking((uint32_t)(uintptr_t)func);
+        multicore_fifo_push_blocking((uint32_t)(uintptr_t)args[i]);
+        sent++;
+    }
+    for (int i = 0; i < n; i += 2)
+        func(args[i]);
+    while (sent-- > 0)
+        multicore_fifo_pop_blocking(); // core 1 の完了を待つ
+}
+#endif
+
+// display_array を TM1640 へ送る. 送信を待たずに戻る
+void send_frame()
+{
+#if DUAL_CORE_PIPELINE
+    if (!frame_queue_push(&frame_queue, display_array))
+        stats.dropped++;
+#else
+    submit_stamp = time_us_64();
+    tm1640_submit(&tm1640, display_array);
+#endif
+}
+
+void print_stats()
+{
+    // 表示用に写しを取り, 同じロックの中で最大値を戻す
+    uint32_t save = spin_lock_blocking(stats_lock);
+    stats_t s = stats;
+    stats.latency_max = 0;
+    stats.poll_gap_max = 0;
+    spin_unlock(stats_lock, save);
+
+    uint32_t frames = s.frames;
+    printf("%s: frames %lu, dropped %lu, latency avg %lu us / max %lu us, poll gap max %lu us, tm1640 bytes sent %lu / saved %lu\n",
+           DUAL_CORE_PIPELINE ? "core1" : "irq",
+           (unsigned long)frames, (unsigned long)s.dropped,
+           (unsigned long)(frames ? s.latency_sum / frames : 0), (unsigned long)s.latency_max,
+           (unsigned long)s.poll_gap_max, (unsigned long)tm1640.bytes_sent, (unsigned long)tm1640.bytes_saved);
+    printf("rtc phase error %ld us\n", (long)timekeeper.phase_error_us);
 }
 
 void init()
 {
     stdio_init_all();
+    stats_lock = spin_lock_init(spin_lock_claim_unused(true));
     for (int i = 0; i < TM1640_CHANNELS; i++)
         display_array[i][0] = display_array[i][1] = 0;
     tm1640_init(&tm1640, display_array);
-    display_init();
+#if DUAL_CORE_PIPELINE
+    frame_queue_init(&frame_queue);
+    multicore_launch_core1(core1_main);
+#else
+    tm1640.on_done = tm1640_done;
+#endif
     rotary_init(&rotary);
     ds1302_init(&ds1302);
+    timekeeper_init(&timekeeper);
     ntp_init();
-    add_repeating_timer_ms(-1000, timer_callback, NULL, &timer);
+#if QR_PARALLEL_MASK
+    QRcode_setParallel(2, 0, qr_runner, NULL);
+#endif
+    QRcode_setFrameCache(qr_frame_cache, sizeof(qr_frame_cache));
+    // 毎秒の QR コードは前回と同じマスクが選ばれやすいので, それから評価する
+    QRcode_setMaskSearch(QR_MASKSEARCH_PRUNE | QR_MASKSEARCH_ORDER);
+    if (QRtemplate_size(QR_VERSION, QR_LEVEL) > sizeof(qr_template_buffer))
+        printf("QR template buffer too small: %u bytes needed\n", (unsigned)QRtemplate_size(QR_VERSION, QR_LEVEL));
+    if (QRcode_frameCacheSize(QR_VERSION) > sizeof(qr_frame_cache))
+        printf("QR frame cache too small: %u bytes needed\n", (unsigned)QRcode_frameCacheSize(QR_VERSION));
+
+    // 前回の接続先と名前解決の結果
+    uint8_t cache[NTP_CACHE_BYTES];
+    ds1302_read_ram(&ds1302, cache, NTP_CACHE_BYTES);
+    ntp_cache_load(cache, timekeeper_get_time(&timekeeper));
+}
+
+void save_ntp_cache()
+{
+    uint8_t cache[NTP_CACHE_BYTES];
+    ntp_cache_save(cache, timekeeper_get_time(&timekeeper));
+    ds1302_write_ram(&ds1302, cache, NTP_CACHE_BYTES);
 }
 
 void show_menu(int cursor, char ntp_status)
 {
-    display_clear_matrix(display_matrix);
+    display_clear_matrix(&display_matrix);
 
-    display_print_string_to_matrix((cursor == 0 ? ">" : " "), 0, 0, RED, display_matrix);
-    display_print_string_to_matrix("QR", 0, 1, RED, display_matrix);
-    display_print_string_to_matrix((cursor == 1 ? ">" : " "), 1, 0, RED, display_matrix);
-    display_print_string_to_matrix("ANA", 1, 1, RED, display_matrix);
-    display_print_string_to_matrix((cursor == 2 ? ">" : " "), 2, 0, RED, display_matrix);
-    display_print_string_to_matrix("DIG", 2, 1, RED, display_matrix);
-    display_print_string_to_matrix((cursor == 3 ? ">" : " "), 3, 0, RED, display_matrix);
-    display_print_string_to_matrix("NTP", 3, 1, RED, display_matrix);
+    display_print_string_to_matrix((cursor == 0 ? ">" : " "), 0, 0, RED, &display_matrix);
+    display_print_string_to_matrix("QR", 0, 1, RED, &display_matrix);
+    display_print_string_to_matrix((cursor == 1 ? ">" : " "), 1, 0, RED, &display_matrix);
+    display_print_string_to_matrix("ANA", 1, 1, RED, &display_matrix);
+    display_print_string_to_matrix((cursor == 2 ? ">" : " "), 2, 0, RED, &display_matrix);
+    display_print_string_to_matrix("DIG", 2, 1, RED, &display_matrix);
+    display_print_string_to_matrix((cursor == 3 ? ">" : " "), 3, 0, RED, &display_matrix);
+    display_print_string_to_matrix("NTP", 3, 1, RED, &display_matrix);
     char s[2];
     s[0] = ntp_status;
     s[1] = '\0';
-    display_print_string_to_matrix(s, 3, 4, RED, display_matrix);
+    display_print_string_to_matrix(s, 3, 4, RED, &display_matrix);
 
-    display_convert_matrix_to_array(display_matrix, display_array);
-    tm1640_write_ints(&tm1640, display_array);
+    display_convert_matrix_to_array(&display_matrix, display_array);
+    send_frame();
 }
 
 void show_digital(datetime_t *dt)
 {
-    display_clear_matrix(display_matrix);
+    display_clear_matrix(&display_matrix);
     char s[21];
     snprintf(s, 21, "%d/%2d/%2d%2d:%02d  :%02d", dt->year, dt->month, dt->day, dt->hour, dt->min, dt->sec);
-    display_print_string_to_matrix(s, 0, 0, GREEN, display_matrix);
-    display_convert_matrix_to_array(display_matrix, display_array);
-    tm1640_write_ints(&tm1640, display_array);
+    display_print_string_to_matrix(s, 0, 0, GREEN, &display_matrix);
+    display_convert_matrix_to_array(&display_matrix, display_array);
+    send_frame();
+}
+
+// QRtemplate_writeRows の出力先. 上と左に 1 画素の余白を空けて橙で描く
+void qr_write_row(int y, const unsigned char *row, int width, void *data)
+{
+    uint32_t bits = 0;
+    for (int i = 0; i < (width + 7) / 8; i++)
+        bits |= (uint32_t)row[i] << (i * 8);
+    display_blit_row_to_array(display_array, 1, y + 1, bits, width, ORANGE);
 }
 
 void show_qr(datetime_t *dt)
 {
     char buf[50];
-    // UTF-8で保存すること.
-    sprintf(buf, "%d年%d月%d日 (%s) %d時%d分%d秒", dt->year, dt->month, dt->day, weekday_japanese[(dt->dotw) % 7], dt->hour, dt->min, dt->sec);
-    QRcode *qrcode = QRcode_encodeString(buf, 3, QR_ECLEVEL_M, QR_MODE_8, 1);
+    // UTF-8で保存すること. 桁数を固定して, 毎秒変わるのを数字のバイトだけにする
+    sprintf(buf, "%04d年%02d月%02d日 (%s) %02d時%02d分%02d秒", dt->year, dt->month, dt->day, weekday_japanese[(dt->dotw) % 7], dt->hour, dt->min, dt->sec);
+    if (!qr_template)
+        qr_template = QRtemplate_new(buf, QR_VERSION, QR_LEVEL, QR_MODE_8, 1, qr_template_buffer, sizeof(qr_template_buffer));
+    // 毎秒は変わったモジュールと ECC の差分だけ書き換え, マスクの選び直しは毎分 1 回にする
+    const QRcode *qrcode = NULL;
+    if (qr_template)
+        qrcode = QRtemplate_update(qr_template, buf, dt->sec == 0 ? QR_TEMPLATE_RECHECK : QR_TEMPLATE_PATCH);
 
     if (!qrcode)
     {
@@ -108,39 +290,27 @@ void show_qr(datetime_t *dt)
         return;
     }
 
-    display_clear_matrix(display_matrix);
-    for (int y = 0; y < qrcode->width; y++)
-    {
-        for (int x = 0; x < qrcode->width; x++)
-        {
-            int idx = y * qrcode->width + x;
-            if (qrcode->data[idx] & 1)
-            {
-                display_matrix[y + 1][x + 1] = ORANGE;
-            }
-        }
-    }
-
-    display_convert_matrix_to_array(display_matrix, display_array);
-    tm1640_write_ints(&tm1640, display_array);
-    QRcode_free(qrcode);
+    // テンプレートが持つビット詰めの行を, 画面バッファを通さずチャネルデータへ直接書く
+    display_clear_array(display_array);
+    QRtemplate_writeRows(qr_template, qr_write_row, NULL);
+    send_frame();
 }
 
 void show_analog(datetime_t *dt)
 {
-    draw_background(RED, display_matrix);
+    draw_background(RED, &display_matrix);
     // 秒針
     float t1 = M_PI * 2 * dt->sec / 60 - M_PI_2;
-    draw_hand(12, t1, GREEN, display_matrix);
+    draw_hand(12, t1, GREEN, &display_matrix);
     // 長針
     float t2 = M_PI * 2 * dt->min / 60 - M_PI_2;
-    draw_hand(10, t2, ORANGE, display_matrix);
+    draw_hand(10, t2, ORANGE, &display_matrix);
     // 短針
     float t3 = M_PI * 2 * (dt->hour % 12 * 5 + dt->min / 12) / 60 - M_PI_2;
-    draw_hand(8, t3, ORANGE, display_matrix);
+    draw_hand(8, t3, ORANGE, &display_matrix);
 
-    display_convert_matrix_to_array(display_matrix, display_array);
-    tm1640_write_ints(&tm1640, display_array);
+    display_convert_matrix_to_array(&display_matrix, display_array);
+    send_frame();
 }
 
 int main()
@@ -152,10 +322,39 @@ int main()
     char ntp_status = ' ';
     mode_t mode = QR;
     datetime_t dt;
+    ntp_result_t ntp_result;
+    uint64_t last_poll = time_us_64();
+    uint64_t last_stats = last_poll;
 
     while (true)
     {
+        uint64_t now = time_us_64();
+        if (now - last_poll > stats.poll_gap_max)
+            stats.poll_gap_max = now - last_poll;
+        last_poll = now;
         rotary_main_loop(&rotary);
+        timekeeper_poll(&timekeeper);
+
+        // NTP 同期を 1 段階進める
+        ntp_state_t ntp_state = ntp_sync_poll(&ntp_result);
+        if (ntp_state == NTP_DONE)
+        {
+            // DS1302 へは次の秒の境界で timekeeper_poll が書き込む
+            int64_t step = timekeeper_set_offset(&timekeeper, ntp_result.offset_us);
+            printf("ntp: corrected %lld us, delay %ld us (%d samples)\n",
+                   (long long)step, (long)ntp_result.delay_us, ntp_result.samples);
+            ntp_status = 'o';
+        }
+        else if (ntp_state == NTP_FAILED)
+        {
+            ntp_status = 'x';
+        }
+        if (ntp_state == NTP_DONE || ntp_state == NTP_FAILED)
+        {
+            save_ntp_cache();
+            if (mode == MENU)
+                show_menu(cursor, ntp_status);
+        }
 
         // イベント処理
         if (rotary.f_push)
@@ -165,19 +364,10 @@ int main()
             {
                 if (cursor == 3)
                 {
+                    // 同期はバックグラウンドで進む. 結果は下の ntp_sync_poll で反映する
+                    ntp_sync_start(10 * 1000);
                     ntp_status = '_';
                     show_menu(cursor, ntp_status);
-                    if (ntp_get_time(&dt, 10 * 1000))
-                    {
-                        ntp_status = 'o';
-                        show_menu(cursor, ntp_status);
-                        ds1302_set_datetime(&ds1302, dt);
-                    }
-                    else
-                    {
-                        ntp_status = 'x';
-                        show_menu(cursor, ntp_status);
-                    }
                 }
                 else
                 {
@@ -201,10 +391,15 @@ int main()
             }
             rotary.f_rotate = 0;
         }
+        if (STATS_INTERVAL_S > 0 && now - last_stats >= STATS_INTERVAL_S * 1000000ull)
+        {
+            last_stats = now;
+            print_stats();
+        }
         if (f_update && mode != MENU)
         {
             f_update = false;
-            dt = ds1302_get_datetime(&ds1302);
+            timekeeper_get_datetime(&timekeeper, &dt);
 
             if (mode == QR)
             {
@@ -38,16 +38,16 @@ const uint32_t background[32] = {
 };
 
 // 範囲内であれば色を塗る
-void draw_pixel(int x, int y, Color_t color, Color_t matrix[32][32])
+void draw_pixel(int x, int y, Color_t color, framebuffer_t *matrix)
 {
     if (-15 <= x && x <= 16 && -15 <= y && y <= 16)
     {
-        matrix[y + 15][x + 15] = color;
+        framebuffer_set_pixel(matrix, x + 15, y + 15, color);
     }
 }
 
 // 線分が通るマスを塗りつぶす
-void draw_line(float x0, float y0, float x1, float y1, Color_t color, Color_t matrix[32][32])
+void draw_line(float x0, float y0, float x1, float y1, Color_t color, framebuffer_t *matrix)
 {
     float dx = fabsf(x1 - x0);
     float dy = fabsf(y1 - y0);
@@ -63,23 +63,14 @@ void draw_line(float x0, float y0, float x1, float y1, Color_t color, Color_t ma
     }
 }
 
-void draw_hand(float r, float theta, Color_t color, Color_t matrix[32][32])
+void draw_hand(float r, float theta, Color_t color, framebuffer_t *matrix)
 {
     float x = cosf(theta) * r;
     float y = sinf(theta) * r;
     draw_line(0, 0, x, y, color, matrix);
 }
 
-void draw_background(Color_t color, Color_t matrix[32][32])
+void draw_background(Color_t color, framebuffer_t *matrix)
 {
-    for (int i = 0; i < 32; i++)
-    {
-        for (int j = 0; j < 32; j++)
-        {
-            if ((background[i] >> j) & 1)
-                matrix[i][j] = color;
-            else
-                matrix[i][j] = OFF;
-        }
-    }
+    framebuffer_fill(matrix, background, color);
 }
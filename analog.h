@@ -3,7 +3,7 @@
 
 #include "display.h"
 
-void draw_hand(float r, float theta, Color_t color, Color_t matrix[32][32]);
-void draw_background(Color_t color, Color_t matrix[32][32]);
+void draw_hand(float r, float theta, Color_t color, framebuffer_t *matrix);
+void draw_background(Color_t color, framebuffer_t *matrix);
 
 #endif
\ No newline at end of file
@@ -8,12 +8,6 @@ typedef struct
     uint8_t data[6];
 } font_t;
 
-typedef struct
-{
-    int ch;
-    uint64_t bit;
-} pos_t;
-
 const font_t font[] = {
     {'0', {0b0111110, 0b1000101, 0b1001001, 0b1010001, 0b0111110, 0}},
     {'1', {0b0000000, 0b0100001, 0b1111111, 0b0000001, 0b0000000, 0}},
@@ -43,8 +37,20 @@ const font_t font[] = {
     {'\0', {0, 0, 0, 0, 0, 0}},
 };
 
-// 32 x 32 のマトリクスから 16 ch x 64 bit のデータへの変換テーブル
-pos_t pos_table[32][32];
+// 32 x 32 のマトリクスと TM1640 の配線.
+// マトリクスは 8x8 のブロックに分かれ, ブロック (行 i/8, 列 j/8) が 1 チャネルに接続される.
+// ブロック内の行 i%8 がチャネルデータの下位から i%8 番目のバイトになり,
+// DISPLAY_COL_REVERSED が 1 のときは列 j%8 == 0 がそのバイトの MSB になる.
+#define DISPLAY_BLOCK_CH(bi, bj) ((bi) + (3 - (bj)) * 4)
+#define DISPLAY_COL_REVERSED 1
+
+#define DISPLAY_BLOCK_ROW(bi) {DISPLAY_BLOCK_CH(bi, 0), DISPLAY_BLOCK_CH(bi, 1), DISPLAY_BLOCK_CH(bi, 2), DISPLAY_BLOCK_CH(bi, 3)}
+const uint8_t block_ch[4][4] = {
+    DISPLAY_BLOCK_ROW(0),
+    DISPLAY_BLOCK_ROW(1),
+    DISPLAY_BLOCK_ROW(2),
+    DISPLAY_BLOCK_ROW(3),
+};
 
 const uint8_t *get_font(char c)
 {
@@ -55,58 +61,114 @@ const uint8_t *get_font(char c)
     }
 }
 
-void display_init()
+// 各バイト内のビット順を反転する
+uint32_t reverse_bits_in_bytes(uint32_t x)
+{
+    x = ((x >> 1) & 0x55555555) | ((x & 0x55555555) << 1);
+    x = ((x >> 2) & 0x33333333) | ((x & 0x33333333) << 2);
+    x = ((x >> 4) & 0x0F0F0F0F) | ((x & 0x0F0F0F0F) << 4);
+    return x;
+}
+
+// 4 行 x 4 バイトの転置. 入力 r[k] のバイト b が出力 w[b] のバイト k になる
+void transpose_4x4_bytes(const uint32_t r[4], uint32_t w[4])
 {
-    for (int i = 0; i < 32; i++)
+    uint32_t t0 = (r[0] & 0x00FF00FF) | ((r[1] & 0x00FF00FF) << 8);
+    uint32_t t1 = ((r[0] >> 8) & 0x00FF00FF) | (r[1] & 0xFF00FF00);
+    uint32_t t2 = (r[2] & 0x00FF00FF) | ((r[3] & 0x00FF00FF) << 8);
+    uint32_t t3 = ((r[2] >> 8) & 0x00FF00FF) | (r[3] & 0xFF00FF00);
+    w[0] = (t0 & 0x0000FFFF) | (t2 << 16);
+    w[1] = (t1 & 0x0000FFFF) | (t3 << 16);
+    w[2] = (t0 >> 16) | (t2 & 0xFFFF0000);
+    w[3] = (t1 >> 16) | (t3 & 0xFFFF0000);
+}
+
+// 色ごとのプレーン (1 行 32bit, bit j = 列 j) から 16 ch x 64 bit のデータへ変換する.
+// 8x8 ブロックの各行がそのままチャネルの 1 バイトになるので,
+// (必要ならバイト内のビット反転をして) 4x4 バイト転置で 4 ブロック分をまとめて処理する.
+void display_convert_matrix_to_array(const framebuffer_t *matrix, uint64_t array[TM1640_CHANNELS][2])
+{
+    for (int color = 0; color < 2; color++)
     {
-        for (int j = 0; j < 32; j++)
+        for (int bi = 0; bi < 4; bi++)
         {
-            int ch = (i / 8) + (3 - (j / 8)) * 4;
-            int row = i % 8;
-            int col = 7 - (j % 8);
-            pos_table[i][j] = (pos_t){ch, 1ull << (row * 8 + col)};
+            uint32_t r[4], lo[4], hi[4];
+            const uint32_t *rows = &matrix->planes[color][bi * 8];
+
+            for (int k = 0; k < 4; k++)
+                r[k] = DISPLAY_COL_REVERSED ? reverse_bits_in_bytes(rows[k]) : rows[k];
+            transpose_4x4_bytes(r, lo);
+            for (int k = 0; k < 4; k++)
+                r[k] = DISPLAY_COL_REVERSED ? reverse_bits_in_bytes(rows[4 + k]) : rows[4 + k];
+            transpose_4x4_bytes(r, hi);
+
+            for (int bj = 0; bj < 4; bj++)
+                array[block_ch[bi][bj]][color] = ((uint64_t)hi[bj] << 32) | lo[bj];
         }
     }
 }
 
-void display_convert_matrix_to_array(const Color_t matrix[32][32], uint64_t array[TM1640_CHANNELS][2])
+// (x, y) から右へ width 画素を, 画面バッファを通さずチャネルデータへ直接書き換える.
+// bits の bit k が立っていれば color, そうでなければ OFF. framebuffer_blit_row と同じ範囲の扱い
+void display_blit_row_to_array(uint64_t array[TM1640_CHANNELS][2], int x, int y, uint32_t bits, int width, Color_t color)
 {
-    for (int i = 0; i < TM1640_CHANNELS; i++)
+    if (y < 0 || y >= FRAMEBUFFER_HEIGHT || width <= 0)
+        return;
+
+    uint32_t mask = width >= 32 ? UINT32_MAX : (1u << width) - 1;
+    bits &= mask;
+    if (x < 0)
     {
-        array[i][0] = 0;
-        array[i][1] = 0;
+        if (x <= -32)
+            return;
+        mask >>= -x;
+        bits >>= -x;
     }
-
-    for (int i = 0; i < 32; i++)
+    else
     {
-        for (int j = 0; j < 32; j++)
-        {
-            int ch = pos_table[i][j].ch;
-            uint64_t bit = pos_table[i][j].bit;
+        if (x >= FRAMEBUFFER_WIDTH)
+            return;
+        mask <<= x;
+        bits <<= x;
+    }
+    if (DISPLAY_COL_REVERSED)
+    {
+        mask = reverse_bits_in_bytes(mask);
+        bits = reverse_bits_in_bytes(bits);
+    }
 
-            if (matrix[i][j] & RED)
-                array[ch][0] |= bit;
-            if (matrix[i][j] & GREEN)
-                array[ch][1] |= bit;
-        }
+    // 行 y はブロック行 y/8 の各チャネルの y%8 番目のバイト
+    int shift = (y % 8) * 8;
+    for (int bj = 0; bj < 4; bj++)
+    {
+        uint64_t m = (uint64_t)((mask >> (bj * 8)) & 0xFF) << shift;
+        if (!m)
+            continue;
+        uint64_t b = (uint64_t)((bits >> (bj * 8)) & 0xFF) << shift;
+        uint64_t *ch = array[block_ch[y / 8][bj]];
+        ch[0] = (ch[0] & ~m) | ((color & RED) ? b : 0);
+        ch[1] = (ch[1] & ~m) | ((color & GREEN) ? b : 0);
     }
 }
 
+void display_clear_array(uint64_t array[TM1640_CHANNELS][2])
+{
+    for (int i = 0; i < TM1640_CHANNELS; i++)
+        array[i][0] = array[i][1] = 0;
+}
+
 // line: 0-3, col: 0-4. 指定した位置から配置し自動で改行
-void display_print_string_to_matrix(char *s, int line, int col, Color_t color, Color_t matrix[32][32])
+void display_print_string_to_matrix(char *s, int line, int col, Color_t color, framebuffer_t *matrix)
 {
     for (int i = 0; s[i] != '\0'; i++)
     {
         const uint8_t *f = get_font(s[i]);
-        for (int j = 0; j < 6; j++)
+        for (int k = 0; k < 8; k++)
         {
-            for (int k = 0; k < 8; k++)
-            {
-                if ((f[j] >> (7 - k)) & 1)
-                    matrix[line * 8 + k][col * 6 + j + 1] = color;
-                else
-                    matrix[line * 8 + k][col * 6 + j + 1] = OFF;
-            }
+            uint32_t bits = 0;
+            for (int j = 0; j < 6; j++)
+                bits |= (uint32_t)((f[j] >> (7 - k)) & 1) << j;
+            framebuffer_blit_row(matrix, col * 6 + 1, line * 8 + k, bits, 6, color);
         }
 
         col++;
@@ -118,13 +180,7 @@ void display_print_string_to_matrix(char *s, int line, int col, Color_t color, C
     }
 }
 
-void display_clear_matrix(Color_t matrix[32][32])
+void display_clear_matrix(framebuffer_t *matrix)
 {
-    for (int i = 0; i < 32; i++)
-    {
-        for (int j = 0; j < 32; j++)
-        {
-            matrix[i][j] = OFF;
-        }
-    }
+    framebuffer_clear(matrix);
 }
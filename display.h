@@ -2,18 +2,12 @@
 #define DISPLAY
 #include <stdint.h>
 #include "tm1640.h"
+#include "framebuffer.h"
 
-typedef enum
-{
-    OFF = 0b00,
-    RED = 0b01,
-    GREEN = 0b10,
-    ORANGE = 0b11,
-} Color_t;
+void display_convert_matrix_to_array(const framebuffer_t *matrix, uint64_t array[TM1640_CHANNELS][2]);
+void display_blit_row_to_array(uint64_t array[TM1640_CHANNELS][2], int x, int y, uint32_t bits, int width, Color_t color);
+void display_clear_array(uint64_t array[TM1640_CHANNELS][2]);
+void display_print_string_to_matrix(char *s, int line, int col, Color_t color, framebuffer_t *matrix);
+void display_clear_matrix(framebuffer_t *matrix);
 
-void display_init();
-void display_convert_matrix_to_array(const Color_t matrix[32][32], uint64_t array[TM1640_CHANNELS][2]);
-void display_print_string_to_matrix(char *s, int line, int col, Color_t color, Color_t matrix[32][32]);
-void display_clear_matrix(Color_t matrix[32][32]);
-
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
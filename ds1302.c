@@ -13,6 +13,9 @@
 #define DS1302_REG_WP 0x8E
 #define DS1302_REG_CTRL 0x90
 #define DS1302_REG_RAM 0xC0
+#define DS1302_CLOCK_BURST 0xBE // 秒から WP までの 8 レジスタをまとめて読み書きする
+#define DS1302_CLOCK_BURST_LEN 8
+#define DS1302_RAM_BURST 0xFE // RAM 31 バイトを先頭から連続で読み書きする
 #define DS1302_DELAY_US 1
 
 void ds1302_delay()
@@ -83,29 +86,92 @@ int get_reg(ds1302_t *dev, int reg)
     return res;
 }
 
+// 時計レジスタ 8 バイトを 1 回の CE で書き込む
+void set_clock_burst(ds1302_t *dev, const int regs[DS1302_CLOCK_BURST_LEN])
+{
+    gpio_put(dev->pin_ce, 1);
+    ds1302_delay();
+    write_byte(dev, DS1302_CLOCK_BURST);
+    for (int i = 0; i < DS1302_CLOCK_BURST_LEN; i++)
+        write_byte(dev, regs[i]);
+    gpio_put(dev->pin_ce, 0);
+    ds1302_delay();
+}
+
+// 時計レジスタ 8 バイトを 1 回の CE で読み出す.
+// 読み出し開始時にまとめてラッチされるので, 途中で秒が繰り上がっても値が食い違わない
+void get_clock_burst(ds1302_t *dev, int regs[DS1302_CLOCK_BURST_LEN])
+{
+    gpio_put(dev->pin_ce, 1);
+    ds1302_delay();
+    write_byte(dev, DS1302_CLOCK_BURST | 1);
+    for (int i = 0; i < DS1302_CLOCK_BURST_LEN; i++)
+        regs[i] = read_byte(dev);
+    gpio_put(dev->pin_ce, 0);
+    ds1302_delay();
+}
+
+// RAM の先頭から len バイト (最大 DS1302_RAM_SIZE) を書き込む
+void ds1302_write_ram(ds1302_t *dev, const uint8_t *data, int len)
+{
+    set_reg(dev, DS1302_REG_WP, 0);
+    gpio_put(dev->pin_ce, 1);
+    ds1302_delay();
+    write_byte(dev, DS1302_RAM_BURST);
+    for (int i = 0; i < len && i < DS1302_RAM_SIZE; i++)
+        write_byte(dev, data[i]);
+    gpio_put(dev->pin_ce, 0);
+    ds1302_delay();
+}
+
+// RAM の先頭から len バイト (最大 DS1302_RAM_SIZE) を読み出す
+void ds1302_read_ram(ds1302_t *dev, uint8_t *data, int len)
+{
+    gpio_put(dev->pin_ce, 1);
+    ds1302_delay();
+    write_byte(dev, DS1302_RAM_BURST | 1);
+    for (int i = 0; i < len && i < DS1302_RAM_SIZE; i++)
+        data[i] = read_byte(dev);
+    gpio_put(dev->pin_ce, 0);
+    ds1302_delay();
+}
+
+// 秒レジスタだけを読む
+int ds1302_get_seconds(ds1302_t *dev)
+{
+    return bcd_to_int(get_reg(dev, DS1302_REG_SECOND) & 0x7F);
+}
+
 void ds1302_set_datetime(ds1302_t *dev, datetime_t datetime)
 {
-    set_reg(dev, DS1302_REG_WP, 0);                                 // Disable WriteProtect
-    set_reg(dev, DS1302_REG_SECOND, int_to_bcd(datetime.sec));      // 同時に ClockHalt = 0 も設定
-    set_reg(dev, DS1302_REG_MINUTE, int_to_bcd(datetime.min));      //
-    set_reg(dev, DS1302_REG_HOUR, int_to_bcd(datetime.hour));       // 24 hour モード
-    set_reg(dev, DS1302_REG_DATE, int_to_bcd(datetime.day));        //
-    set_reg(dev, DS1302_REG_MONTH, int_to_bcd(datetime.month));     //
-    set_reg(dev, DS1302_REG_DAY, int_to_bcd(datetime.dotw));        //
-    set_reg(dev, DS1302_REG_YEAR, int_to_bcd(datetime.year % 100)); //
-    set_reg(dev, DS1302_REG_CTRL, 0xA5);                            // Trickle Charge 1 Diode, 2k ohm
+    set_reg(dev, DS1302_REG_WP, 0); // Disable WriteProtect (バースト書き込みは WP = 0 のときだけ有効)
+    int regs[DS1302_CLOCK_BURST_LEN] = {
+        int_to_bcd(datetime.sec),        // 同時に ClockHalt = 0 も設定
+        int_to_bcd(datetime.min),        //
+        int_to_bcd(datetime.hour),       // 24 hour モード
+        int_to_bcd(datetime.day),        //
+        int_to_bcd(datetime.month),      //
+        int_to_bcd(datetime.dotw),       //
+        int_to_bcd(datetime.year % 100), //
+        0,                               // WP
+    };
+    set_clock_burst(dev, regs);
+    set_reg(dev, DS1302_REG_CTRL, 0xA5); // Trickle Charge 1 Diode, 2k ohm
 }
 
 datetime_t ds1302_get_datetime(ds1302_t *dev)
 {
+    int regs[DS1302_CLOCK_BURST_LEN];
+    get_clock_burst(dev, regs);
+
     datetime_t res;
-    res.sec = bcd_to_int(get_reg(dev, DS1302_REG_SECOND));
-    res.min = bcd_to_int(get_reg(dev, DS1302_REG_MINUTE));
-    res.hour = bcd_to_int(get_reg(dev, DS1302_REG_HOUR));
-    res.day = bcd_to_int(get_reg(dev, DS1302_REG_DATE));
-    res.month = bcd_to_int(get_reg(dev, DS1302_REG_MONTH));
-    res.dotw = bcd_to_int(get_reg(dev, DS1302_REG_DAY));
-    res.year = 2000 + bcd_to_int(get_reg(dev, DS1302_REG_YEAR));
+    res.sec = bcd_to_int(regs[0]);
+    res.min = bcd_to_int(regs[1]);
+    res.hour = bcd_to_int(regs[2]);
+    res.day = bcd_to_int(regs[3]);
+    res.month = bcd_to_int(regs[4]);
+    res.dotw = bcd_to_int(regs[5]);
+    res.year = 2000 + bcd_to_int(regs[6]);
 
     return res;
 }
@@ -7,8 +7,13 @@ typedef struct
     uint pin_clk, pin_dio, pin_ce;
 } ds1302_t;
 
+#define DS1302_RAM_SIZE 31 // 電池で保持される RAM (バイト)
+
 void ds1302_set_datetime(ds1302_t *dev, datetime_t datetime);
 datetime_t ds1302_get_datetime(ds1302_t *dev);
+int ds1302_get_seconds(ds1302_t *dev);
+void ds1302_write_ram(ds1302_t *dev, const uint8_t *data, int len);
+void ds1302_read_ram(ds1302_t *dev, uint8_t *data, int len);
 void ds1302_init(ds1302_t *dev);
 
 #endif
\ No newline at end of file
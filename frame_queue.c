@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "frame_queue.h"
+
+void frame_queue_init(frame_queue_t *q)
+{
+    q->head = 0;
+    q->tail = 0;
+}
+
+// 満杯のときは最も古いフレームを上書きして false を返す. consumer が欲しいのは最新のフレームなので,
+// 新しいフレームを捨てると最後の画面が表示されないままになる
+bool frame_queue_push(frame_queue_t *q, const uint64_t frame[TM1640_CHANNELS][2])
+{
+    uint32_t head = q->head;
+    bool room = head - q->tail < FRAME_QUEUE_LEN;
+
+    uint32_t i = head % FRAME_QUEUE_LEN;
+    memcpy(q->frames[i], frame, sizeof(q->frames[i]));
+    q->stamps[i] = time_us_64();
+
+    // フレームを書き終えてから head を進める
+    __mem_fence_release();
+    q->head = head + 1;
+    return room;
+}
+
+// 溜まっているうち最新のフレームを取り出し, それより古いフレームは捨てる. 空なら false を返す
+bool frame_queue_pop_latest(frame_queue_t *q, uint64_t frame[TM1640_CHANNELS][2], uint64_t *stamp)
+{
+    uint32_t head = q->head;
+    __mem_fence_acquire();
+    if (head == q->tail)
+        return false;
+
+    while (true)
+    {
+        uint32_t i = (head - 1) % FRAME_QUEUE_LEN;
+        memcpy(frame, q->frames[i], sizeof(q->frames[i]));
+        *stamp = q->stamps[i];
+
+        // 読んでいる間に producer が一周してこのスロットを上書きし始めていたら, 最新のフレームを読み直す
+        __mem_fence_acquire();
+        uint32_t now = q->head;
+        if (now - head < FRAME_QUEUE_LEN - 1)
+            break;
+        head = now;
+    }
+
+    // 読み終えてからスロットを解放する
+    __mem_fence_release();
+    q->tail = head;
+    return true;
+}
@@ -0,0 +1,21 @@
+#ifndef FRAME_QUEUE
+#define FRAME_QUEUE
+#include "pico/stdlib.h"
+#include "tm1640.h"
+
+#define FRAME_QUEUE_LEN 4
+
+// core 0 (描画) から core 1 (送信) へフレームを渡す single-producer / single-consumer のリングバッファ.
+// head は producer だけが, tail は consumer だけが書き換える. 満杯なら producer は最も古いフレームを上書きする.
+typedef struct
+{
+    uint64_t frames[FRAME_QUEUE_LEN][TM1640_CHANNELS][2];
+    uint64_t stamps[FRAME_QUEUE_LEN]; // push した時刻 (us)
+    volatile uint32_t head, tail;
+} frame_queue_t;
+
+void frame_queue_init(frame_queue_t *q);
+bool frame_queue_push(frame_queue_t *q, const uint64_t frame[TM1640_CHANNELS][2]);
+bool frame_queue_pop_latest(frame_queue_t *q, uint64_t frame[TM1640_CHANNELS][2], uint64_t *stamp);
+
+#endif
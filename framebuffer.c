@@ -0,0 +1,101 @@
+#include <stdint.h>
+#include "framebuffer.h"
+
+void framebuffer_clear(framebuffer_t *fb)
+{
+    for (int y = 0; y < FRAMEBUFFER_HEIGHT; y++)
+    {
+        fb->planes[0][y] = 0;
+        fb->planes[1][y] = 0;
+    }
+}
+
+// rows のビットが立っている画素を color, それ以外を OFF にする
+void framebuffer_fill(framebuffer_t *fb, const uint32_t rows[FRAMEBUFFER_HEIGHT], Color_t color)
+{
+    uint32_t red = (color & RED) ? UINT32_MAX : 0;
+    uint32_t green = (color & GREEN) ? UINT32_MAX : 0;
+    for (int y = 0; y < FRAMEBUFFER_HEIGHT; y++)
+    {
+        fb->planes[0][y] = rows[y] & red;
+        fb->planes[1][y] = rows[y] & green;
+    }
+}
+
+// 範囲外は無視する
+void framebuffer_set_pixel(framebuffer_t *fb, int x, int y, Color_t color)
+{
+    framebuffer_blit_row(fb, x, y, 1, 1, color);
+}
+
+Color_t framebuffer_get_pixel(const framebuffer_t *fb, int x, int y)
+{
+    if (x < 0 || x >= FRAMEBUFFER_WIDTH || y < 0 || y >= FRAMEBUFFER_HEIGHT)
+        return OFF;
+    return (Color_t)(((fb->planes[0][y] >> x) & 1) | (((fb->planes[1][y] >> x) & 1) << 1));
+}
+
+// (x, y) から右へ width 画素を書き換える. bits の bit k が立っていれば color, そうでなければ OFF.
+void framebuffer_blit_row(framebuffer_t *fb, int x, int y, uint32_t bits, int width, Color_t color)
+{
+    if (y < 0 || y >= FRAMEBUFFER_HEIGHT || width <= 0)
+        return;
+
+    uint32_t mask = width >= 32 ? UINT32_MAX : (1u << width) - 1;
+    bits &= mask;
+    if (x < 0)
+    {
+        if (x <= -32)
+            return;
+        mask >>= -x;
+        bits >>= -x;
+    }
+    else
+    {
+        if (x >= FRAMEBUFFER_WIDTH)
+            return;
+        mask <<= x;
+        bits <<= x;
+    }
+
+    fb->planes[0][y] = (fb->planes[0][y] & ~mask) | ((color & RED) ? bits : 0);
+    fb->planes[1][y] = (fb->planes[1][y] & ~mask) | ((color & GREEN) ? bits : 0);
+}
+
+// rows[0 .. height-1] を (x, y) を左上として書き込む
+void framebuffer_blit(framebuffer_t *fb, int x, int y, const uint32_t *rows, int width, int height, Color_t color)
+{
+    for (int i = 0; i < height; i++)
+        framebuffer_blit_row(fb, x, y + i, rows[i], width, color);
+}
+
+// 以下の行演算は color に含まれるプレーンだけに作用する
+void framebuffer_or_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color)
+{
+    if (y < 0 || y >= FRAMEBUFFER_HEIGHT)
+        return;
+    if (color & RED)
+        fb->planes[0][y] |= bits;
+    if (color & GREEN)
+        fb->planes[1][y] |= bits;
+}
+
+void framebuffer_and_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color)
+{
+    if (y < 0 || y >= FRAMEBUFFER_HEIGHT)
+        return;
+    if (color & RED)
+        fb->planes[0][y] &= bits;
+    if (color & GREEN)
+        fb->planes[1][y] &= bits;
+}
+
+void framebuffer_xor_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color)
+{
+    if (y < 0 || y >= FRAMEBUFFER_HEIGHT)
+        return;
+    if (color & RED)
+        fb->planes[0][y] ^= bits;
+    if (color & GREEN)
+        fb->planes[1][y] ^= bits;
+}
@@ -0,0 +1,32 @@
+#ifndef FRAMEBUFFER
+#define FRAMEBUFFER
+#include <stdint.h>
+
+#define FRAMEBUFFER_WIDTH 32
+#define FRAMEBUFFER_HEIGHT 32
+
+typedef enum
+{
+    OFF = 0b00,
+    RED = 0b01,
+    GREEN = 0b10,
+    ORANGE = 0b11,
+} Color_t;
+
+// 色ごとのビットプレーン. planes[0] が RED, planes[1] が GREEN. 各行の bit x が列 x.
+typedef struct
+{
+    uint32_t planes[2][FRAMEBUFFER_HEIGHT];
+} framebuffer_t;
+
+void framebuffer_clear(framebuffer_t *fb);
+void framebuffer_fill(framebuffer_t *fb, const uint32_t rows[FRAMEBUFFER_HEIGHT], Color_t color);
+void framebuffer_set_pixel(framebuffer_t *fb, int x, int y, Color_t color);
+Color_t framebuffer_get_pixel(const framebuffer_t *fb, int x, int y);
+void framebuffer_blit_row(framebuffer_t *fb, int x, int y, uint32_t bits, int width, Color_t color);
+void framebuffer_blit(framebuffer_t *fb, int x, int y, const uint32_t *rows, int width, int height, Color_t color);
+void framebuffer_or_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color);
+void framebuffer_and_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color);
+void framebuffer_xor_row(framebuffer_t *fb, int y, uint32_t bits, Color_t color);
+
+#endif
@@ -25,22 +25,26 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "bitstream.h"
+#include "qralloc.h"
 
+/* Bits are packed MSB first. Unused bits of the last byte are always zero. */
 #define DEFAULT_BUFSIZE (128)
+#define BYTES(__bits__) (((__bits__) + 7) / 8)
 
 BitStream *BitStream_new(void)
 {
 	BitStream *bstream;
 
-	bstream = (BitStream *)malloc(sizeof(BitStream));
+	bstream = (BitStream *)QRalloc_malloc(sizeof(BitStream));
 	if(bstream == NULL) return NULL;
 
 	bstream->length = 0;
-	bstream->data = (unsigned char *)malloc(DEFAULT_BUFSIZE);
+	bstream->data = (unsigned char *)QRalloc_malloc(DEFAULT_BUFSIZE);
 	if(bstream->data == NULL) {
-		free(bstream);
+		QRalloc_free(bstream);
 		return NULL;
 	}
 	bstream->datasize = DEFAULT_BUFSIZE;
@@ -52,84 +56,99 @@ BitStream *BitStream_new(void)
 BitStream *BitStream_newWithBits(size_t size, unsigned char *bits)
 {
 	BitStream *bstream;
+	size_t i;
 
 	if(size == 0) return BitStream_new();
 
-	bstream = (BitStream *)malloc(sizeof(BitStream));
+	bstream = (BitStream *)QRalloc_malloc(sizeof(BitStream));
 	if(bstream == NULL) return NULL;
 
-	bstream->data = (unsigned char *)malloc(size);
+	bstream->data = (unsigned char *)QRalloc_malloc(BYTES(size));
 	if(bstream->data == NULL) {
-		free(bstream);
+		QRalloc_free(bstream);
 		return NULL;
 	}
 
 	bstream->length = size;
-	bstream->datasize = size;
-	memcpy(bstream->data, bits, size);
+	bstream->datasize = BYTES(size);
+	memset(bstream->data, 0, BYTES(size));
+	for(i = 0; i < size; i++) {
+		if(bits[i]) bstream->data[i / 8] |= (unsigned char)(0x80 >> (i & 7));
+	}
 
 	return bstream;
 }
 #endif
 
-static int BitStream_expand(BitStream *bstream)
+static int BitStream_reserve(BitStream *bstream, size_t bits)
 {
 	unsigned char *data;
+	size_t size;
+
+	size = bstream->datasize;
+	if(size == 0) size = DEFAULT_BUFSIZE;
+	while(BYTES(bstream->length + bits) > size) {
+		size *= 2;
+	}
+	if(size == bstream->datasize && bstream->data != NULL) return 0;
 
-	data = (unsigned char *)realloc(bstream->data, bstream->datasize * 2);
+	data = (unsigned char *)QRalloc_realloc(bstream->data, size);
 	if(data == NULL) {
 		return -1;
 	}
 
 	bstream->data = data;
-	bstream->datasize *= 2;
+	bstream->datasize = size;
 
 	return 0;
 }
 
-static void BitStream_writeNum(unsigned char *dest, size_t bits, unsigned int num)
+/* Append up to 32 bits through a 64-bit accumulator that also holds the
+ * pending bits of the last partial byte. */
+static void BitStream_writeNum(BitStream *bstream, size_t bits, unsigned int num)
 {
-	unsigned int mask;
-	size_t i;
 	unsigned char *p;
-
-	p = dest;
-	mask = 1U << (bits - 1);
-	for(i = 0; i < bits; i++) {
-		if(num & mask) {
-			*p = 1;
-		} else {
-			*p = 0;
-		}
-		p++;
-		mask = mask >> 1;
+	size_t used, total;
+	uint64_t acc;
+
+	p = bstream->data + bstream->length / 8;
+	used = bstream->length & 7;
+	acc = used ? (uint64_t)(*p >> (8 - used)) : 0;
+	acc = (acc << bits) | (num & (uint32_t)(0xffffffffU >> (32 - bits)));
+	total = used + bits;
+	while(total >= 8) {
+		total -= 8;
+		*p++ = (unsigned char)(acc >> total);
 	}
+	if(total > 0) {
+		*p = (unsigned char)(acc << (8 - total));
+	}
+	bstream->length += bits;
 }
 
-static void BitStream_writeBytes(unsigned char *dest, size_t size, unsigned char *data)
+static void BitStream_writeBytes(BitStream *bstream, size_t size, const unsigned char *data)
 {
-	unsigned char mask;
-	size_t i, j;
 	unsigned char *p;
-
-	p = dest;
-	for(i = 0; i < size; i++) {
-		mask = 0x80;
-		for(j = 0; j < 8; j++) {
-			if(data[i] & mask) {
-				*p = 1;
-			} else {
-				*p = 0;
-			}
+	size_t used, i;
+
+	p = bstream->data + bstream->length / 8;
+	used = bstream->length & 7;
+	if(used == 0) {
+		memcpy(p, data, size);
+	} else {
+		for(i = 0; i < size; i++) {
+			*p = (unsigned char)(*p | (data[i] >> used));
 			p++;
-			mask = mask >> 1;
+			*p = (unsigned char)(data[i] << (8 - used));
 		}
 	}
+	bstream->length += size * 8;
 }
 
 int BitStream_append(BitStream *bstream, BitStream *arg)
 {
 	int ret;
+	size_t bytes, oddbits;
 
 	if(arg == NULL) {
 		return -1;
@@ -138,13 +157,15 @@ int BitStream_append(BitStream *bstream, BitStream *arg)
 		return 0;
 	}
 
-	while(bstream->length + arg->length > bstream->datasize) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
-	}
+	ret = BitStream_reserve(bstream, arg->length);
+	if(ret < 0) return ret;
 
-	memcpy(bstream->data + bstream->length, arg->data, arg->length);
-	bstream->length += arg->length;
+	bytes = arg->length / 8;
+	oddbits = arg->length & 7;
+	BitStream_writeBytes(bstream, bytes, arg->data);
+	if(oddbits > 0) {
+		BitStream_writeNum(bstream, oddbits, (unsigned int)(arg->data[bytes] >> (8 - oddbits)));
+	}
 
 	return 0;
 }
@@ -155,12 +176,9 @@ int BitStream_appendNum(BitStream *bstream, size_t bits, unsigned int num)
 
 	if(bits == 0) return 0;
 
-	while(bstream->datasize - bstream->length < bits) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
-	}
-	BitStream_writeNum(bstream->data + bstream->length, bits, num);
-	bstream->length += bits;
+	ret = BitStream_reserve(bstream, bits);
+	if(ret < 0) return ret;
+	BitStream_writeNum(bstream, bits, num);
 
 	return 0;
 }
@@ -171,53 +189,42 @@ int BitStream_appendBytes(BitStream *bstream, size_t size, unsigned char *data)
 
 	if(size == 0) return 0;
 
-	while(bstream->datasize - bstream->length < size * 8) {
-		ret = BitStream_expand(bstream);
-		if(ret < 0) return ret;
-	}
-	BitStream_writeBytes(bstream->data + bstream->length, size, data);
-	bstream->length += size * 8;
+	ret = BitStream_reserve(bstream, size * 8);
+	if(ret < 0) return ret;
+	BitStream_writeBytes(bstream, size, data);
 
 	return 0;
 }
 
 unsigned char *BitStream_toByte(BitStream *bstream)
 {
-	size_t i, j, size, bytes, oddbits;
-	unsigned char *data, v;
-	unsigned char *p;
+	size_t size;
+	unsigned char *data;
 
 	size = BitStream_size(bstream);
 	if(size == 0) {
 		return NULL;
 	}
-	data = (unsigned char *)malloc((size + 7) / 8);
+	data = (unsigned char *)QRalloc_malloc(BYTES(size));
 	if(data == NULL) {
 		return NULL;
 	}
+	memcpy(data, bstream->data, BYTES(size));
+
+	return data;
+}
 
-	bytes = size  / 8;
+unsigned char *BitStream_detach(BitStream *bstream)
+{
+	unsigned char *data;
 
-	p = bstream->data;
-	for(i = 0; i < bytes; i++) {
-		v = 0;
-		for(j = 0; j < 8; j++) {
-			v = (unsigned char)(v << 1);
-			v |= *p;
-			p++;
-		}
-		data[i] = v;
-	}
-	oddbits = size & 7;
-	if(oddbits > 0) {
-		v = 0;
-		for(j = 0; j < oddbits; j++) {
-			v = (unsigned char)(v << 1);
-			v |= *p;
-			p++;
-		}
-		data[bytes] = (unsigned char)(v << (8 - oddbits));
+	if(BitStream_size(bstream) == 0) {
+		return NULL;
 	}
+	data = bstream->data;
+	bstream->data = NULL;
+	bstream->datasize = 0;
+	bstream->length = 0;
 
 	return data;
 }
@@ -225,7 +232,134 @@ unsigned char *BitStream_toByte(BitStream *bstream)
 void BitStream_free(BitStream *bstream)
 {
 	if(bstream != NULL) {
-		free(bstream->data);
-		free(bstream);
+		QRalloc_free(bstream->data);
+		QRalloc_free(bstream);
+	}
+}
+
+#ifdef WITH_TESTS
+/*
+ * Differential test against the previous bit-per-byte representation. The
+ * reference keeps one byte per bit, as BitStream did before it was packed.
+ */
+#define TEST_MAX_BITS (8192)
+
+static unsigned int BitStream_testRandom(unsigned int *seed)
+{
+	*seed = *seed * 1103515245U + 12345U;
+	return *seed >> 8;
+}
+
+static void BitStream_refAppendNum(unsigned char *ref, size_t *length, size_t bits, unsigned int num)
+{
+	size_t i;
+	unsigned int mask;
+
+	mask = 1U << (bits - 1);
+	for(i = 0; i < bits; i++) {
+		ref[(*length)++] = (num & mask) ? 1 : 0;
+		mask = mask >> 1;
+	}
+}
+
+/* Compare the bits, the length and the zero padding of the last byte. */
+static int BitStream_compare(BitStream *bstream, const unsigned char *ref, size_t length)
+{
+	size_t i;
+
+	if(bstream->length != length) return -1;
+	for(i = 0; i < length; i++) {
+		if(((bstream->data[i / 8] >> (7 - (i & 7))) & 1) != ref[i]) return -1;
+	}
+	if((length & 7) && (bstream->data[length / 8] & (0xff >> (length & 7)))) return -1;
+
+	return 0;
+}
+
+/*
+ * Run rounds of random appendNum(), appendBytes() and append() calls,
+ * checking the stream against the reference after each call.
+ * @return the number of mismatches, or -1 on allocation failure.
+ */
+int BitStream_test(unsigned int seed, int rounds)
+{
+	BitStream *bstream, *arg;
+	unsigned char *ref, *argRef, bytes[64];
+	size_t length, argLength, bits, size, i;
+	unsigned int num;
+	int round, errors = 0;
+
+	bstream = BitStream_new();
+	arg = BitStream_new();
+	ref = (unsigned char *)QRalloc_malloc(TEST_MAX_BITS * 2);
+	if(bstream == NULL || arg == NULL || ref == NULL) {
+		BitStream_free(bstream);
+		BitStream_free(arg);
+		QRalloc_free(ref);
+		return -1;
+	}
+	argRef = ref + TEST_MAX_BITS;
+
+	for(round = 0; round < rounds; round++) {
+		BitStream_reset(bstream);
+		length = 0;
+		while(length < TEST_MAX_BITS - 1024) {
+			switch(BitStream_testRandom(&seed) % 3) {
+			case 0:
+				bits = BitStream_testRandom(&seed) % 32 + 1;
+				num = BitStream_testRandom(&seed) ^ (BitStream_testRandom(&seed) << 16);
+				if(BitStream_appendNum(bstream, bits, num) < 0) {
+					errors = -1;
+					goto EXIT;
+				}
+				BitStream_refAppendNum(ref, &length, bits, num);
+				break;
+			case 1:
+				size = BitStream_testRandom(&seed) % sizeof(bytes);
+				for(i = 0; i < size; i++) {
+					bytes[i] = (unsigned char)BitStream_testRandom(&seed);
+				}
+				if(BitStream_appendBytes(bstream, size, bytes) < 0) {
+					errors = -1;
+					goto EXIT;
+				}
+				for(i = 0; i < size; i++) {
+					BitStream_refAppendNum(ref, &length, 8, bytes[i]);
+				}
+				break;
+			default:
+				BitStream_reset(arg);
+				argLength = 0;
+				bits = BitStream_testRandom(&seed) % (sizeof(bytes) * 8);
+				while(argLength < bits) {
+					size = BitStream_testRandom(&seed) % 16 + 1;
+					num = BitStream_testRandom(&seed);
+					if(BitStream_appendNum(arg, size, num) < 0) {
+						errors = -1;
+						goto EXIT;
+					}
+					BitStream_refAppendNum(argRef, &argLength, size, num);
+				}
+				if(BitStream_append(bstream, arg) < 0) {
+					errors = -1;
+					goto EXIT;
+				}
+				memcpy(ref + length, argRef, argLength);
+				length += argLength;
+				break;
+			}
+			if(BitStream_compare(bstream, ref, length) < 0) {
+				errors++;
+				break;
+			}
+		}
 	}
+
+EXIT:
+	BitStream_free(bstream);
+	BitStream_free(arg);
+	QRalloc_free(ref);
+
+	return errors;
 }
+#endif
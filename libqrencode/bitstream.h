@@ -23,21 +23,24 @@
 #define BITSTREAM_H
 
 typedef struct {
-	size_t length;
-	size_t datasize;
-	unsigned char *data;
+	size_t length;		///< number of bits
+	size_t datasize;	///< allocated bytes
+	unsigned char *data;	///< bits packed MSB first
 } BitStream;
 
 extern BitStream *BitStream_new(void);
 #ifdef WITH_TESTS
 extern BitStream *BitStream_newWithBits(size_t size, unsigned char *bits);
+extern int BitStream_test(unsigned int seed, int rounds);
 #endif
 extern int BitStream_append(BitStream *bstream, BitStream *arg);
 extern int BitStream_appendNum(BitStream *bstream, size_t bits, unsigned int num);
 extern int BitStream_appendBytes(BitStream *bstream, size_t size, unsigned char *data);
 #define BitStream_size(__bstream__) (__bstream__->length)
 #define BitStream_reset(__bstream__) (__bstream__->length = 0)
+#define BitStream_data(__bstream__) (__bstream__->data)
 extern unsigned char *BitStream_toByte(BitStream *bstream);
+extern unsigned char *BitStream_detach(BitStream *bstream);
 extern void BitStream_free(BitStream *bstream);
 
 #endif /* BITSTREAM_H */
@@ -25,11 +25,14 @@
 #include <stdlib.h>
 #include <string.h>
 #include <limits.h>
+#include <stdint.h>
 #include <errno.h>
 
 #include "qrencode.h"
 #include "qrspec.h"
 #include "mask.h"
+#include "qralloc.h"
+#include "qrparallel.h"
 
 STATIC_IN_RELEASE int Mask_writeFormatInformation(int width, unsigned char *frame, int mask, QRecLevel level)
 {
@@ -152,7 +155,7 @@ unsigned char *Mask_makeMaskedFrame(int width, unsigned char *frame, int mask)
 {
 	unsigned char *masked;
 
-	masked = (unsigned char *)malloc((size_t)(width * width));
+	masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(masked == NULL) return NULL;
 
 	maskMakers[mask](width, frame, masked);
@@ -170,7 +173,7 @@ unsigned char *Mask_makeMask(int width, unsigned char *frame, int mask, QRecLeve
 		return NULL;
 	}
 
-	masked = (unsigned char *)malloc((size_t)(width * width));
+	masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(masked == NULL) return NULL;
 
 	maskMakers[mask](width, frame, masked);
@@ -218,6 +221,9 @@ STATIC_IN_RELEASE int Mask_calcN1N3(int length, int *runLength)
 	return demerit;
 }
 
+#ifdef WITH_TESTS
+/* Byte-per-module scorer. Mask_mask() uses the bit-packed evaluator below;
+ * this one is kept as the reference for it. */
 STATIC_IN_RELEASE int Mask_calcN2(int width, unsigned char *frame)
 {
 	int x, y;
@@ -318,40 +324,609 @@ STATIC_IN_RELEASE int Mask_evaluateSymbol(int width, unsigned char *frame)
 
 	return demerit;
 }
+#endif
 
-unsigned char *Mask_mask(int width, unsigned char *frame, QRecLevel level)
+/******************************************************************************
+ * Bit-packed evaluation
+ *****************************************************************************/
+
+/* Symbols are evaluated on bit-packed rows and columns: bit x of word x / 64
+ * holds module x. The demerits are identical to Mask_evaluateSymbol(). */
+#define MASK_WORDS(__width__) (((__width__) + 63) / 64)
+#define MASK_PERIOD (12) /* every mask pattern repeats within 12 rows/columns */
+
+#if defined(__GNUC__)
+#define MASK_POPCOUNT(__v__) __builtin_popcountll(__v__)
+#define MASK_CTZ(__v__) __builtin_ctzll(__v__)
+#else
+static int Mask_popcount(uint64_t v)
+{
+	v = v - ((v >> 1) & 0x5555555555555555ULL);
+	v = (v & 0x3333333333333333ULL) + ((v >> 2) & 0x3333333333333333ULL);
+	v = (v + (v >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+	return (int)((v * 0x0101010101010101ULL) >> 56);
+}
+static int Mask_ctz(uint64_t v)
+{
+	int n = 0;
+	while((v & 1) == 0) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+}
+#define MASK_POPCOUNT(__v__) Mask_popcount(__v__)
+#define MASK_CTZ(__v__) Mask_ctz(__v__)
+#endif
+
+typedef struct {
+	int width;
+	int words;
+	uint64_t *rows;		///< dark modules of the unmasked frame, per row
+	uint64_t *cols;		///< same, per column
+	uint64_t *rowFunc;	///< function modules, per row
+	uint64_t *colFunc;
+	uint64_t *maskedRows;
+	uint64_t *maskedCols;
+	int *lowerBound;	///< lowerBound[i]: least demerit of the lines i.. (rows, then columns)
+} MaskPlanes;
+
+/* One share of the mask search. Every job has its own masked planes and
+ * evaluates the masks first, first + step, ... */
+typedef struct {
+	MaskPlanes planes;
+	QRecLevel level;
+	int first;
+	int step;
+	int prune;
+	int hint;	///< mask to try first, or -1
+	int *demerits;
+	long lines;	///< rows and columns scored
+} MaskJob;
+
+/* Mask patterns over a 12x12 tile: bit x of maskTile[mask][y] is set if the
+ * module (x, y) is flipped. Generated from the expressions of maskMakers. */
+static const unsigned short maskTile[maskNum][MASK_PERIOD] = {
+	{0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa, 0x555, 0xaaa},
+	{0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000, 0xfff, 0x000},
+	{0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249, 0x249},
+	{0x249, 0x924, 0x492, 0x249, 0x924, 0x492, 0x249, 0x924, 0x492, 0x249, 0x924, 0x492},
+	{0x1c7, 0x1c7, 0xe38, 0xe38, 0x1c7, 0x1c7, 0xe38, 0xe38, 0x1c7, 0x1c7, 0xe38, 0xe38},
+	{0xfff, 0x041, 0x249, 0x555, 0x249, 0x041, 0xfff, 0x041, 0x249, 0x555, 0x249, 0x041},
+	{0xfff, 0x1c7, 0x6db, 0x555, 0xb6d, 0xc71, 0xfff, 0x1c7, 0x6db, 0x555, 0xb6d, 0xc71},
+	{0x555, 0xe38, 0xc71, 0xaaa, 0x1c7, 0x38e, 0x555, 0xe38, 0xc71, 0xaaa, 0x1c7, 0x38e}
+};
+
+static void Mask_setBit(uint64_t *row, int x)
+{
+	row[x / 64] |= 1ULL << (x % 64);
+}
+
+static void Mask_putBit(uint64_t *row, int x, int v)
+{
+	if(v) {
+		row[x / 64] |= 1ULL << (x % 64);
+	} else {
+		row[x / 64] &= ~(1ULL << (x % 64));
+	}
+}
+
+/* Set the module (x, y) of the masked rows, or of the masked columns. */
+static void Mask_putModule(MaskPlanes *planes, int x, int y, int v, int cols)
+{
+	if(cols) {
+		Mask_putBit(planes->maskedCols + x * planes->words, y, v);
+	} else {
+		Mask_putBit(planes->maskedRows + y * planes->words, x, v);
+	}
+}
+
+/* Function modules other than the format information look the same under
+ * every mask. */
+#define MASK_FIXED(__v__) (((__v__) & 0x84) == 0x80)
+
+/* Lower bound of Mask_calcN1N3() for a line, whatever the mask: N1 of the
+ * runs of fixed modules, and N3 of finder-like patterns made of fixed runs
+ * whose surroundings are fixed too. A run of the symbol may join several
+ * fixed runs, but its N1 is never smaller than their sum. */
+static int Mask_lineBound(int width, const unsigned char *p, int stride)
+{
+	int start[QRSPEC_WIDTH_MAX];
+	int length[QRSPEC_WIDTH_MAX];
+	int dark[QRSPEC_WIDTH_MAX];
+	int count = 0;
+	int i, j, x, fact, end;
+	int closed, counted;
+	int demerit = 0;
+
+	for(x = 0; x < width; x++) {
+		if(!MASK_FIXED(p[x * stride])) continue;
+		if(count > 0 && start[count - 1] + length[count - 1] == x && dark[count - 1] == (p[x * stride] & 1)) {
+			length[count - 1]++;
+		} else {
+			start[count] = x;
+			length[count] = 1;
+			dark[count] = p[x * stride] & 1;
+			count++;
+		}
+	}
+
+	for(i = 0; i < count; i++) {
+		if(length[i] >= 5) {
+			demerit += N1 + (length[i] - 5);
+		}
+	}
+	/* dark:light:dark:light:dark = 1:1:3:1:1 over adjacent fixed runs */
+	for(i = 0; i + 4 < count; i++) {
+		if(!dark[i] || length[i + 2] % 3 != 0) continue;
+		fact = length[i + 2] / 3;
+		for(j = i; j < i + 4; j++) {
+			if(start[j] + length[j] != start[j + 1]) break;
+		}
+		if(j < i + 4) continue;
+		if(length[i] != fact || length[i + 1] != fact || length[i + 3] != fact || length[i + 4] != fact) continue;
+
+		/* both ends must be the edge or an adjacent fixed light run */
+		closed = 1;
+		counted = 0;
+		if(start[i] == 0) {
+			counted = 1;
+		} else if(i > 0 && start[i - 1] + length[i - 1] == start[i]) {
+			if(start[i - 1] == 0 || length[i - 1] >= 4 * fact) counted = 1;
+		} else {
+			closed = 0;
+		}
+		end = start[i + 4] + length[i + 4];
+		if(end == width) {
+			counted = 1;
+		} else if(i + 5 < count && start[i + 5] == end) {
+			if(end + length[i + 5] == width || length[i + 5] >= 4 * fact) counted = 1;
+		} else {
+			closed = 0;
+		}
+		if(closed && counted) {
+			demerit += N3;
+		}
+	}
+
+	return demerit;
+}
+
+/* Fill planes->lowerBound from the fixed modules of the frame. Row y also
+ * carries the 2x2 blocks of fixed modules between the rows y-1 and y. */
+static void Mask_initBound(MaskPlanes *planes, const unsigned char *frame)
+{
+	int width = planes->width;
+	int x, y;
+	int *bound = planes->lowerBound;
+	const unsigned char *p;
+
+	for(y = 0; y < width; y++) {
+		bound[y] = Mask_lineBound(width, frame + y * width, 1);
+		if(y == 0) continue;
+		p = frame + (y - 1) * width;
+		for(x = 0; x < width - 1; x++) {
+			if(MASK_FIXED(p[x]) && MASK_FIXED(p[x + 1]) && MASK_FIXED(p[x + width]) && MASK_FIXED(p[x + width + 1])) {
+				if(((p[x] | p[x + 1] | p[x + width] | p[x + width + 1]) & 1) == ((p[x] & p[x + 1] & p[x + width] & p[x + width + 1]) & 1)) {
+					bound[y] += N2;
+				}
+			}
+		}
+	}
+	for(x = 0; x < width; x++) {
+		bound[width + x] = Mask_lineBound(width, frame + x, width);
+	}
+	bound[width * 2] = 0;
+	for(x = width * 2 - 1; x >= 0; x--) {
+		bound[x] += bound[x + 1];
+	}
+}
+
+/* The masked planes of all the jobs follow the shared ones, then the bound. */
+static int Mask_initPlanes(MaskPlanes *planes, int width, const unsigned char *frame, int jobs)
+{
+	int x, y, words;
+	size_t n, planeWords;
+	const unsigned char *p = frame;
+
+	words = MASK_WORDS(width);
+	n = (size_t)(width * words);
+	planes->width = width;
+	planes->words = words;
+	planeWords = n * (size_t)(4 + jobs * 2);
+	planes->rows = (uint64_t *)QRalloc_calloc(planeWords + ((size_t)(width * 2 + 1) * sizeof(int) + 7) / 8, sizeof(uint64_t));
+	if(planes->rows == NULL) return -1;
+	planes->cols = planes->rows + n;
+	planes->rowFunc = planes->cols + n;
+	planes->colFunc = planes->rowFunc + n;
+	planes->maskedRows = planes->colFunc + n;
+	planes->maskedCols = planes->maskedRows + n;
+	planes->lowerBound = (int *)(planes->rows + planeWords);
+
+	for(y = 0; y < width; y++) {
+		for(x = 0; x < width; x++) {
+			if(frame[0] & 1) {
+				Mask_setBit(planes->rows + y * words, x);
+				Mask_setBit(planes->cols + x * words, y);
+			}
+			if(frame[0] & 0x80) {
+				Mask_setBit(planes->rowFunc + y * words, x);
+				Mask_setBit(planes->colFunc + x * words, y);
+			}
+			frame++;
+		}
+	}
+	Mask_initBound(planes, p);
+
+	return 0;
+}
+
+/* 64 modules of a line whose 12-module tile is tile, starting at phase. */
+static uint64_t Mask_repeatTile(unsigned int tile, int phase)
+{
+	uint64_t w = 0;
+	int b;
+
+	tile = ((tile >> phase) | (tile << (MASK_PERIOD - phase))) & 0xfff;
+	for(b = 0; b < 64; b += MASK_PERIOD) {
+		w |= (uint64_t)tile << b;
+	}
+
+	return w;
+}
+
+/* Apply the mask to the rows, or to the columns, with whole-word XORs. */
+static void Mask_applyPacked(MaskPlanes *planes, int mask, int cols)
+{
+	uint64_t pattern[MASK_PERIOD][MASK_WORDS(QRSPEC_WIDTH_MAX)];
+	const unsigned short *tile = maskTile[mask];
+	const uint64_t *src, *func;
+	uint64_t *dst;
+	int width = planes->width;
+	int words = planes->words;
+	int i, k, y;
+	unsigned int lineTile;
+	uint64_t tail;
+	size_t o;
+
+	/* modules past the edge stay clear */
+	tail = (width % 64) ? (1ULL << (width % 64)) - 1 : ~0ULL;
+
+	for(i = 0; i < MASK_PERIOD; i++) {
+		if(cols) {
+			lineTile = 0;
+			for(y = 0; y < MASK_PERIOD; y++) {
+				lineTile |= ((tile[y] >> i) & 1U) << y;
+			}
+		} else {
+			lineTile = tile[i];
+		}
+		for(k = 0; k < words; k++) {
+			pattern[i][k] = Mask_repeatTile(lineTile, (k * 64) % MASK_PERIOD);
+		}
+		pattern[i][words - 1] &= tail;
+	}
+	src = cols ? planes->cols : planes->rows;
+	func = cols ? planes->colFunc : planes->rowFunc;
+	dst = cols ? planes->maskedCols : planes->maskedRows;
+	for(i = 0; i < width; i++) {
+		o = (size_t)(i * words);
+		for(k = 0; k < words; k++) {
+			dst[o + k] = src[o + k] ^ (pattern[i % MASK_PERIOD][k] & ~func[o + k]);
+		}
+	}
+}
+
+/* Same placement as Mask_writeFormatInformation(). */
+static void Mask_writeFormatInformationPacked(MaskPlanes *planes, int mask, QRecLevel level, int cols)
+{
+	unsigned int format;
+	int width = planes->width;
+	int i, v;
+
+	format = QRspec_getFormatInfo(mask, level);
+
+	for(i = 0; i < 8; i++) {
+		v = format & 1;
+		Mask_putModule(planes, width - 1 - i, 8, v, cols);
+		if(i < 6) {
+			Mask_putModule(planes, 8, i, v, cols);
+		} else {
+			Mask_putModule(planes, 8, i + 1, v, cols);
+		}
+		format = format >> 1;
+	}
+	for(i = 0; i < 7; i++) {
+		v = format & 1;
+		Mask_putModule(planes, 8, width - 7 + i, v, cols);
+		if(i == 0) {
+			Mask_putModule(planes, 7, 8, v, cols);
+		} else {
+			Mask_putModule(planes, 6 - i, 8, v, cols);
+		}
+		format = format >> 1;
+	}
+}
+
+/* Same run-length layout as Mask_calcRunLengthH(). Run boundaries are the set
+ * bits of line ^ (line << 1), visited with count-trailing-zeros. */
+static int Mask_calcRunLengthPacked(int width, int words, const uint64_t *line, int *runLength)
+{
+	int head = 0;
+	int k, pos, prev = 0;
+	uint64_t t, carry;
+
+	carry = line[0] & 1;
+	if(carry) {
+		runLength[0] = -1;
+		head = 1;
+	}
+	for(k = 0; k < words; k++) {
+		t = line[k] ^ ((line[k] << 1) | carry);
+		carry = line[k] >> 63;
+		if(k == words - 1 && (width % 64) != 0) {
+			t &= (1ULL << (width % 64)) - 1;
+		}
+		while(t != 0) {
+			pos = k * 64 + MASK_CTZ(t);
+			t &= t - 1;
+			runLength[head++] = pos - prev;
+			prev = pos;
+		}
+	}
+	runLength[head++] = width - prev;
+
+	return head;
+}
+
+/* 2x2 blocks of the same color between two adjacent rows. */
+static int Mask_calcN2Packed(int width, int words, const uint64_t *r0, const uint64_t *r1)
+{
+	uint64_t a, o, an, on, valid;
+	int k, count = 0;
+
+	for(k = 0; k < words; k++) {
+		a = r0[k] & r1[k];
+		o = r0[k] | r1[k];
+		an = a >> 1;
+		on = o >> 1;
+		if(k + 1 < words) {
+			an |= (r0[k + 1] & r1[k + 1]) << 63;
+			on |= (r0[k + 1] | r1[k + 1]) << 63;
+		}
+		/* bit x: the 2x2 block at columns x and x+1 */
+		if((k + 1) * 64 <= width - 1) {
+			valid = ~0ULL;
+		} else {
+			valid = (1ULL << ((width - 1) - k * 64)) - 1;
+		}
+		count += MASK_POPCOUNT(((a & an) | ~(o | on)) & valid);
+	}
+
+	return count * N2;
+}
+
+static int Mask_countBlacks(MaskPlanes *planes)
+{
+	size_t i, n = (size_t)(planes->width * planes->words);
+	int blacks = 0;
+
+	for(i = 0; i < n; i++) {
+		blacks += MASK_POPCOUNT(planes->maskedRows[i]);
+	}
+
+	return blacks;
+}
+
+/* A mask with the given partial demerit can no longer be chosen: every term
+ * only adds, and a tie goes to the smaller mask number. */
+#define MASK_LOSES(__demerit__, __mask__, __bound__, __boundMask__) \
+	((__demerit__) > (__bound__) || ((__demerit__) == (__bound__) && (__mask__) > (__boundMask__)))
+
+/* Demerit of the mask, scored line by line: N4 first, then the rows with
+ * N2 and N1/N3, then the columns. If prune is set, gives up and returns
+ * INT_MAX as soon as the demerit so far plus the lower bound of the lines
+ * left loses to boundMask whose demerit is bound. *lines counts the rows and
+ * columns scored. */
+static int Mask_evaluatePacked(MaskPlanes *planes, int mask, QRecLevel level, int prune, int bound, int boundMask, long *lines)
 {
 	int i;
-	unsigned char *mask, *bestMask;
-	int minDemerit = INT_MAX;
+	int demerit;
 	int blacks;
 	int bratio;
-	int demerit;
+	int runLength[QRSPEC_WIDTH_MAX + 1];
+	int length;
+	int width = planes->width;
+	int words = planes->words;
 	int w2 = width * width;
+	const uint64_t *line;
+
+	Mask_applyPacked(planes, mask, 0);
+	Mask_writeFormatInformationPacked(planes, mask, level, 0);
+	blacks = Mask_countBlacks(planes);
+	bratio = (200 * blacks + w2) / w2 / 2; /* (int)(100*blacks/w2+0.5) */
+	demerit = (abs(bratio - 50) / 5) * N4;
+	if(prune && MASK_LOSES(demerit + planes->lowerBound[0], mask, bound, boundMask)) return INT_MAX;
+
+	for(i = 0; i < width; i++) {
+		line = planes->maskedRows + i * words;
+		if(i > 0) {
+			demerit += Mask_calcN2Packed(width, words, line - words, line);
+		}
+		length = Mask_calcRunLengthPacked(width, words, line, runLength);
+		demerit += Mask_calcN1N3(length, runLength);
+		(*lines)++;
+		if(prune && MASK_LOSES(demerit + planes->lowerBound[i + 1], mask, bound, boundMask)) return INT_MAX;
+	}
 
-	mask = (unsigned char *)malloc((size_t)w2);
-	if(mask == NULL) return NULL;
-	bestMask = (unsigned char *)malloc((size_t)w2);
-	if(bestMask == NULL) {
-		free(mask);
-		return NULL;
+	Mask_applyPacked(planes, mask, 1);
+	Mask_writeFormatInformationPacked(planes, mask, level, 1);
+	for(i = 0; i < width; i++) {
+		length = Mask_calcRunLengthPacked(width, words, planes->maskedCols + i * words, runLength);
+		demerit += Mask_calcN1N3(length, runLength);
+		(*lines)++;
+		if(prune && MASK_LOSES(demerit + planes->lowerBound[width + i + 1], mask, bound, boundMask)) return INT_MAX;
+	}
+
+	return demerit;
+}
+
+static int maskSearch = QR_MASKSEARCH_PRUNE;
+#if HAVE_LIBPTHREAD
+static __thread int lastMask = 0;
+#else
+static int lastMask = 0;
+#endif
+
+#ifdef WITH_TESTS
+static int statMasks = 0;
+static long statLines = 0;
+
+void Mask_getSearchStats(int *masks, long *lines)
+{
+	*masks = statMasks;
+	*lines = statLines;
+}
+
+void Mask_resetSearchStats(void)
+{
+	statMasks = 0;
+	statLines = 0;
+}
+#endif
+
+void QRcode_setMaskSearch(int flags)
+{
+	maskSearch = flags;
+}
+
+static void Mask_evaluateJob(void *arg)
+{
+	MaskJob *job = (MaskJob *)arg;
+	int order[maskNum];
+	int count = 0;
+	int i, mask;
+	int demerit;
+	int bound = INT_MAX;
+	int boundMask = maskNum;
+
+	if(job->hint >= 0 && job->hint % job->step == job->first) {
+		order[count++] = job->hint;
+	}
+	for(i = job->first; i < maskNum; i += job->step) {
+		if(count == 0 || i != order[0]) {
+			order[count++] = i;
+		}
+	}
+
+	job->lines = 0;
+	for(i = 0; i < count; i++) {
+		mask = order[i];
+		demerit = Mask_evaluatePacked(&job->planes, mask, job->level, job->prune, bound, boundMask, &job->lines);
+		job->demerits[mask] = demerit;
+		if(demerit < bound || (demerit == bound && mask < boundMask)) {
+			bound = demerit;
+			boundMask = mask;
+		}
 	}
+}
 
+size_t Mask_jobSize(int width)
+{
+	return (size_t)(width * MASK_WORDS(width)) * 2 * sizeof(uint64_t);
+}
+
+int Mask_select(int width, unsigned char *frame, QRecLevel level, int hint)
+{
+	int i;
+	MaskPlanes planes;
+	MaskJob jobs[QRPARALLEL_MAX_WORKERS];
+	void *args[QRPARALLEL_MAX_WORKERS];
+	int demerits[maskNum];
+	int njobs;
+	int minDemerit = INT_MAX;
+	int bestMaskNum = 0;
+	size_t n;
+
+	njobs = QRparallel_workers(width);
+	if(Mask_initPlanes(&planes, width, frame, njobs) < 0) return -1;
+
+	n = (size_t)(width * planes.words);
+	for(i = 0; i < njobs; i++) {
+		jobs[i].planes = planes;
+		jobs[i].planes.maskedRows = planes.maskedRows + n * 2 * (size_t)i;
+		jobs[i].planes.maskedCols = jobs[i].planes.maskedRows + n;
+		jobs[i].level = level;
+		jobs[i].first = i;
+		jobs[i].step = njobs;
+		jobs[i].demerits = demerits;
+		jobs[i].prune = maskSearch & QR_MASKSEARCH_PRUNE;
+		jobs[i].hint = hint;
+		args[i] = &jobs[i];
+	}
+	QRparallel_run(Mask_evaluateJob, args, njobs);
+	QRalloc_free(planes.rows);
+
+	/* lowest demerit, the smaller mask number on a tie. Pruned masks are
+	 * INT_MAX and never win. */
 	for(i = 0; i < maskNum; i++) {
-//		n1 = n2 = n3 = n4 = 0;
-		demerit = 0;
-		blacks = maskMakers[i](width, frame, mask);
-		blacks += Mask_writeFormatInformation(width, mask, i, level);
-		bratio = (200 * blacks + w2) / w2 / 2; /* (int)(100*blacks/w2+0.5) */
-		demerit = (abs(bratio - 50) / 5) * N4;
-//		n4 = demerit;
-		demerit += Mask_evaluateSymbol(width, mask);
-//		printf("(%d,%d,%d,%d)=%d\n", n1, n2, n3 ,n4, demerit);
-		if(demerit < minDemerit) {
-			minDemerit = demerit;
-			memcpy(bestMask, mask, (size_t)w2);
+		if(demerits[i] < minDemerit) {
+			minDemerit = demerits[i];
+			bestMaskNum = i;
 		}
 	}
-	free(mask);
-	return bestMask;
+#ifdef WITH_TESTS
+	statMasks += maskNum;
+	for(i = 0; i < njobs; i++) {
+		statLines += jobs[i].lines;
+	}
+#endif
+
+	return bestMaskNum;
+}
+
+#ifdef WITH_TESTS
+/* Demerit of the mask by the byte-per-module reference scorer. */
+int Mask_demeritReference(int width, unsigned char *frame, int mask, QRecLevel level)
+{
+	unsigned char *masked;
+	int blacks, bratio, demerit;
+	int w2 = width * width;
+
+	masked = (unsigned char *)QRalloc_malloc((size_t)w2);
+	if(masked == NULL) return -1;
+	blacks = maskMakers[mask](width, frame, masked);
+	blacks += Mask_writeFormatInformation(width, masked, mask, level);
+	bratio = (200 * blacks + w2) / w2 / 2;
+	demerit = (abs(bratio - 50) / 5) * N4;
+	demerit += Mask_evaluateSymbol(width, masked);
+	QRalloc_free(masked);
+
+	return demerit;
+}
+
+/* Demerit of the mask by the bit-packed scorer, scored in full. */
+int Mask_demeritPacked(int width, unsigned char *frame, int mask, QRecLevel level)
+{
+	MaskPlanes planes;
+	long lines = 0;
+	int demerit;
+
+	if(Mask_initPlanes(&planes, width, frame, 1) < 0) return -1;
+	demerit = Mask_evaluatePacked(&planes, mask, level, 0, INT_MAX, maskNum, &lines);
+	QRalloc_free(planes.rows);
+
+	return demerit;
+}
+#endif
+
+unsigned char *Mask_mask(int width, unsigned char *frame, QRecLevel level)
+{
+	int mask;
+
+	mask = Mask_select(width, frame, level, (maskSearch & QR_MASKSEARCH_ORDER) ? lastMask : -1);
+	if(mask < 0) return NULL;
+	lastMask = mask;
+
+	return Mask_makeMask(width, frame, mask, level);
 }
@@ -25,6 +25,13 @@
 extern unsigned char *Mask_makeMask(int width, unsigned char *frame, int mask, QRecLevel level);
 extern unsigned char *Mask_mask(int width, unsigned char *frame, QRecLevel level);
 
+/**
+ * Return the mask with the lowest demerit, trying hint first (-1 for none),
+ * or -1 on error.
+ */
+extern int Mask_select(int width, unsigned char *frame, QRecLevel level, int hint);
+extern size_t Mask_jobSize(int width);
+
 #ifdef WITH_TESTS
 extern int Mask_calcN2(int width, unsigned char *frame);
 extern int Mask_calcN1N3(int length, int *runLength);
@@ -33,6 +40,10 @@ extern int Mask_calcRunLengthV(int width, unsigned char *frame, int *runLength);
 extern int Mask_evaluateSymbol(int width, unsigned char *frame);
 extern int Mask_writeFormatInformation(int width, unsigned char *frame, int mask, QRecLevel level);
 extern unsigned char *Mask_makeMaskedFrame(int width, unsigned char *frame, int mask);
+extern void Mask_getSearchStats(int *masks, long *lines);
+extern void Mask_resetSearchStats(void);
+extern int Mask_demeritReference(int width, unsigned char *frame, int mask, QRecLevel level);
+extern int Mask_demeritPacked(int width, unsigned char *frame, int mask, QRecLevel level);
 #endif
 
 #endif /* MASK_H */
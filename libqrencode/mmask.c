@@ -30,6 +30,8 @@
 #include "qrencode.h"
 #include "mqrspec.h"
 #include "mmask.h"
+#include "qralloc.h"
+#include "qrparallel.h"
 
 STATIC_IN_RELEASE void MMask_writeFormatInformation(int version, int width, unsigned char *frame, int mask, QRecLevel level)
 {
@@ -96,7 +98,7 @@ unsigned char *MMask_makeMaskedFrame(int width, unsigned char *frame, int mask)
 {
 	unsigned char *masked;
 
-	masked = (unsigned char *)malloc((size_t)(width * width));
+	masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(masked == NULL) return NULL;
 
 	maskMakers[mask](width, frame, masked);
@@ -116,7 +118,7 @@ unsigned char *MMask_makeMask(int version, unsigned char *frame, int mask, QRecL
 	}
 
 	width = MQRspec_getWidth(version);
-	masked = (unsigned char *)malloc((size_t)(width * width));
+	masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(masked == NULL) return NULL;
 
 	maskMakers[mask](width, frame, masked);
@@ -145,33 +147,71 @@ STATIC_IN_RELEASE int MMask_evaluateSymbol(int width, unsigned char *frame)
 	return (sum1 <= sum2)?(sum1 * 16 + sum2):(sum2 * 16 + sum1);
 }
 
+/* One share of the mask search, see Mask_mask(). */
+typedef struct {
+	int version;
+	int width;
+	unsigned char *frame;
+	unsigned char *mask;
+	QRecLevel level;
+	int first;
+	int step;
+	int *scores;
+} MMaskJob;
+
+static void MMask_evaluateJob(void *arg)
+{
+	MMaskJob *job = (MMaskJob *)arg;
+	int i;
+
+	for(i = job->first; i < maskNum; i += job->step) {
+		maskMakers[i](job->width, job->frame, job->mask);
+		MMask_writeFormatInformation(job->version, job->width, job->mask, i, job->level);
+		job->scores[i] = MMask_evaluateSymbol(job->width, job->mask);
+	}
+}
+
 unsigned char *MMask_mask(int version, unsigned char *frame, QRecLevel level)
 {
 	int i;
-	unsigned char *mask, *bestMask;
+	unsigned char *masks;
+	MMaskJob jobs[maskNum];
+	void *args[maskNum];
+	int scores[maskNum];
+	int njobs;
 	int maxScore = 0;
-	int score;
+	int best = -1;
 	int width;
 
 	width = MQRspec_getWidth(version);
+	njobs = QRparallel_workers(width);
+	if(njobs > maskNum) njobs = maskNum;
+
+	masks = (unsigned char *)QRalloc_malloc((size_t)(width * width * njobs));
+	if(masks == NULL) return NULL;
+
+	for(i = 0; i < njobs; i++) {
+		jobs[i].version = version;
+		jobs[i].width = width;
+		jobs[i].frame = frame;
+		jobs[i].mask = masks + width * width * i;
+		jobs[i].level = level;
+		jobs[i].first = i;
+		jobs[i].step = njobs;
+		jobs[i].scores = scores;
+		args[i] = &jobs[i];
+	}
+	QRparallel_run(MMask_evaluateJob, args, njobs);
+	QRalloc_free(masks);
 
-	mask = (unsigned char *)malloc((size_t)(width * width));
-	if(mask == NULL) return NULL;
-	bestMask = NULL;
-
+	/* highest score, the smaller mask number on a tie */
 	for(i = 0; i < maskNum; i++) {
-		score = 0;
-		maskMakers[i](width, frame, mask);
-		MMask_writeFormatInformation(version, width, mask, i, level);
-		score = MMask_evaluateSymbol(width, mask);
-		if(score > maxScore) {
-			maxScore = score;
-			free(bestMask);
-			bestMask = mask;
-			mask = (unsigned char *)malloc((size_t)(width * width));
-			if(mask == NULL) break;
+		if(scores[i] > maxScore) {
+			maxScore = scores[i];
+			best = i;
 		}
 	}
-	free(mask);
-	return bestMask;
+	if(best < 0) return NULL;
+
+	return MMask_makeMask(version, frame, best, level);
 }
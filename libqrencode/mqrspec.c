@@ -34,6 +34,7 @@
 #include <errno.h>
 
 #include "mqrspec.h"
+#include "qralloc.h"
 
 /******************************************************************************
  * Version and capacity
@@ -191,7 +192,7 @@ static unsigned char *MQRspec_createFrame(int version)
 	int x, y;
 
 	width = mqrspecCapacity[version].width;
-	frame = (unsigned char *)malloc((size_t)(width * width));
+	frame = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(frame == NULL) return NULL;
 
 	memset(frame, 0, (size_t)(width * width));
@@ -0,0 +1,190 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Memory allocator with an optional caller-provided arena.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "qralloc.h"
+
+#define ARENA_ALIGN (sizeof(size_t) < 8 ? 8 : sizeof(size_t))
+#define ARENA_HEADER ARENA_ALIGN
+#define ARENA_ROUND(__n__) (((__n__) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_NONE ((size_t)-1)
+
+#if HAVE_LIBPTHREAD
+static __thread QRalloc_Arena *current = NULL;
+#else
+static QRalloc_Arena *current = NULL;
+#endif
+
+#ifdef WITH_TESTS
+static long heapCount = 0;
+
+long QRalloc_getHeapCount(void)
+{
+	return heapCount;
+}
+
+void QRalloc_resetHeapCount(void)
+{
+	heapCount = 0;
+}
+#define HEAP_COUNT() (heapCount++)
+#else
+#define HEAP_COUNT()
+#endif
+
+void QRalloc_initArena(QRalloc_Arena *arena, void *buf, size_t size)
+{
+	size_t pad = (ARENA_ALIGN - (uintptr_t)buf % ARENA_ALIGN) % ARENA_ALIGN;
+
+	if(size < pad) pad = size;
+	arena->buf = (unsigned char *)buf + pad;
+	arena->size = size - pad;
+	arena->used = 0;
+	arena->peak = 0;
+	arena->last = ARENA_NONE;
+}
+
+QRalloc_Arena *QRalloc_setArena(QRalloc_Arena *arena)
+{
+	QRalloc_Arena *prev = current;
+
+	current = arena;
+	return prev;
+}
+
+/* Each block is preceded by a header holding its size. */
+static size_t *Arena_header(void *ptr)
+{
+	return (size_t *)((unsigned char *)ptr - ARENA_HEADER);
+}
+
+static int Arena_owns(QRalloc_Arena *arena, void *ptr)
+{
+	unsigned char *p = (unsigned char *)ptr;
+
+	return p >= arena->buf && p < arena->buf + arena->size;
+}
+
+static void *Arena_alloc(QRalloc_Arena *arena, size_t size)
+{
+	size_t need = ARENA_HEADER + ARENA_ROUND(size);
+	size_t *header;
+
+	if(size > arena->size || need > arena->size - arena->used) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	header = (size_t *)(arena->buf + arena->used);
+	*header = size;
+	arena->last = arena->used;
+	arena->used += need;
+	if(arena->used > arena->peak) arena->peak = arena->used;
+
+	return (unsigned char *)header + ARENA_HEADER;
+}
+
+static void Arena_free(QRalloc_Arena *arena, void *ptr)
+{
+	size_t offset = (size_t)((unsigned char *)Arena_header(ptr) - arena->buf);
+
+	/* Only the most recent block can be given back. */
+	if(offset == arena->last) {
+		arena->used = offset;
+		arena->last = ARENA_NONE;
+	}
+}
+
+static void *Arena_realloc(QRalloc_Arena *arena, void *ptr, size_t size)
+{
+	size_t *header = Arena_header(ptr);
+	size_t offset = (size_t)((unsigned char *)header - arena->buf);
+	size_t need = ARENA_HEADER + ARENA_ROUND(size);
+	void *newptr;
+
+	if(offset == arena->last) {
+		/* Grow or shrink the most recent block in place. */
+		if(need > arena->size - offset) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		*header = size;
+		arena->used = offset + need;
+		if(arena->used > arena->peak) arena->peak = arena->used;
+		return ptr;
+	}
+	newptr = Arena_alloc(arena, size);
+	if(newptr == NULL) return NULL;
+	memcpy(newptr, ptr, *header < size ? *header : size);
+
+	return newptr;
+}
+
+void *QRalloc_malloc(size_t size)
+{
+	if(current != NULL) return Arena_alloc(current, size);
+	HEAP_COUNT();
+	return malloc(size);
+}
+
+void *QRalloc_calloc(size_t nmemb, size_t size)
+{
+	void *ptr;
+
+	if(current == NULL) {
+		HEAP_COUNT();
+		return calloc(nmemb, size);
+	}
+	if(size != 0 && nmemb > (size_t)-1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	ptr = Arena_alloc(current, nmemb * size);
+	if(ptr != NULL) memset(ptr, 0, nmemb * size);
+
+	return ptr;
+}
+
+void *QRalloc_realloc(void *ptr, size_t size)
+{
+	if(current == NULL) {
+		HEAP_COUNT();
+		return realloc(ptr, size);
+	}
+	if(ptr == NULL) return Arena_alloc(current, size);
+	return Arena_realloc(current, ptr, size);
+}
+
+void QRalloc_free(void *ptr)
+{
+	if(ptr == NULL) return;
+	if(current == NULL) {
+		free(ptr);
+	} else if(Arena_owns(current, ptr)) {
+		Arena_free(current, ptr);
+	}
+}
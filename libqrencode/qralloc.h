@@ -0,0 +1,60 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Memory allocator with an optional caller-provided arena.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRALLOC_H
+#define QRALLOC_H
+
+#include <stddef.h>
+
+/**
+ * Bump allocator over a fixed buffer. Blocks are released only when they are
+ * the most recent allocation, which matches the nesting of the encoder.
+ */
+typedef struct {
+	unsigned char *buf;
+	size_t size;
+	size_t used;
+	size_t peak;
+	size_t last;	///< offset of the most recent block, or (size_t)-1
+} QRalloc_Arena;
+
+extern void QRalloc_initArena(QRalloc_Arena *arena, void *buf, size_t size);
+
+/**
+ * Route all allocations of the calling thread to arena. NULL restores the heap.
+ * Returns the previous arena.
+ */
+extern QRalloc_Arena *QRalloc_setArena(QRalloc_Arena *arena);
+
+extern void *QRalloc_malloc(size_t size);
+extern void *QRalloc_calloc(size_t nmemb, size_t size);
+extern void *QRalloc_realloc(void *ptr, size_t size);
+extern void QRalloc_free(void *ptr);
+
+#ifdef WITH_TESTS
+/**
+ * Number of allocations that went to the heap since the last reset.
+ */
+extern long QRalloc_getHeapCount(void);
+extern void QRalloc_resetHeapCount(void);
+#endif
+
+#endif /* QRALLOC_H */
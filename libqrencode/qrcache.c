@@ -0,0 +1,310 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Cache of encoded symbols.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "qrencode.h"
+#include "qrspec.h"
+#include "mqrspec.h"
+#include "qralloc.h"
+#include "qrcache.h"
+
+/* Each entry holds the key with a copy of the payload, followed by the
+ * symbol packed in two bit planes: the modules (bit 0) and the ecc flags
+ * (bit 1). The other flags are those of the function patterns, restored from
+ * the frame of the version. Entries live on the heap, or in the buffer given
+ * to QRcode_setEncodeCache(), and are kept in a list from the one used most
+ * recently; the last ones are dropped to stay within the limit. */
+typedef struct _QRcache_Entry QRcache_Entry;
+struct _QRcache_Entry {
+	QRcache_Entry *next;
+	size_t size;
+	unsigned int hash;
+	int length;
+	int version;
+	QRecLevel level;
+	QRencodeMode hint;
+	int casesensitive;
+	int mqr;
+	int symbolVersion;	///< version of the symbol, when version is 0
+	int width;
+};
+
+static QRcache_Entry *entries = NULL;
+static unsigned char *cacheBuffer = NULL;
+static size_t cacheLimit = 0;
+static size_t cacheUsed = 0;
+static unsigned long cacheHits = 0;
+static unsigned long cacheMisses = 0;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define CACHE_ALIGN(__size__) (((__size__) + 7) & ~(size_t)7)
+#define PLANE_SIZE(__width__) (((size_t)(__width__) * (size_t)(__width__) + 7) / 8)
+#define ENTRY_PAYLOAD(__entry__) ((unsigned char *)(__entry__) + CACHE_ALIGN(sizeof(QRcache_Entry)))
+#define ENTRY_PLANES(__entry__) (ENTRY_PAYLOAD(__entry__) + (__entry__)->length)
+
+/* FNV-1a */
+static unsigned int QRcache_hash(const unsigned char *payload, int length)
+{
+	unsigned int hash = 2166136261U;
+	int i;
+
+	for(i = 0; i < length; i++) {
+		hash = (hash ^ payload[i]) * 16777619U;
+	}
+
+	return hash;
+}
+
+static int QRcache_match(const QRcache_Entry *entry, const QRcache_Key *key, unsigned int hash)
+{
+	return entry->hash == hash
+		&& entry->length == key->length
+		&& entry->version == key->version
+		&& entry->level == key->level
+		&& entry->hint == key->hint
+		&& entry->casesensitive == key->casesensitive
+		&& entry->mqr == key->mqr
+		&& memcmp(ENTRY_PAYLOAD(entry), key->payload, (size_t)key->length) == 0;
+}
+
+static void QRcache_drop(QRcache_Entry **link)
+{
+	QRcache_Entry *entry = *link;
+
+	*link = entry->next;
+	cacheUsed -= entry->size;
+	if(cacheBuffer == NULL) {
+		free(entry);
+	}
+}
+
+/* Called with cache_mutex held. Returns 0 if nothing is left to drop. */
+static int QRcache_dropLeastRecent(void)
+{
+	QRcache_Entry **link;
+
+	if(entries == NULL) return 0;
+	for(link = &entries; (*link)->next != NULL; link = &(*link)->next);
+	QRcache_drop(link);
+
+	return 1;
+}
+
+/* First gap of the buffer that holds size bytes, or NULL. */
+static unsigned char *QRcache_findGap(size_t size)
+{
+	unsigned char *p = cacheBuffer;
+	unsigned char *next, *q;
+	QRcache_Entry *entry;
+	int found;
+
+	for(;;) {
+		if(p + size > cacheBuffer + cacheLimit) return NULL;
+		found = 1;
+		next = p;
+		for(entry = entries; entry != NULL; entry = entry->next) {
+			q = (unsigned char *)entry;
+			if(q < p + size && q + entry->size > p) {
+				found = 0;
+				if(q + entry->size > next) {
+					next = q + entry->size;
+				}
+			}
+		}
+		if(found) return p;
+		p = next;
+	}
+}
+
+QRcode *QRcache_find(const QRcache_Key *key)
+{
+	QRcache_Entry **link, *entry;
+	QRcode *code = NULL;
+	unsigned char *data, *planes;
+	unsigned int hash;
+	int i, n;
+
+	if(cacheLimit == 0) return NULL;
+
+	hash = QRcache_hash(key->payload, key->length);
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&cache_mutex);
+#endif
+	for(link = &entries; *link != NULL; link = &(*link)->next) {
+		if(QRcache_match(*link, key, hash)) break;
+	}
+	entry = *link;
+	if(entry == NULL) {
+		cacheMisses++;
+		goto EXIT;
+	}
+	cacheHits++;
+	/* to the front */
+	*link = entry->next;
+	entry->next = entries;
+	entries = entry;
+
+	if(entry->mqr) {
+		data = MQRspec_newFrame(entry->symbolVersion);
+	} else {
+		data = QRspec_newFrame(entry->symbolVersion);
+	}
+	if(data == NULL) goto EXIT;
+	code = (QRcode *)QRalloc_malloc(sizeof(QRcode));
+	if(code == NULL) {
+		QRalloc_free(data);
+		goto EXIT;
+	}
+	n = entry->width * entry->width;
+	planes = ENTRY_PLANES(entry);
+	for(i = 0; i < n; i++) {
+		data[i] |= (unsigned char)(((planes[i >> 3] >> (i & 7)) & 1)
+			| (((planes[PLANE_SIZE(entry->width) + (i >> 3)] >> (i & 7)) & 1) << 1));
+	}
+	code->version = entry->symbolVersion;
+	code->width = entry->width;
+	code->data = data;
+
+EXIT:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+	return code;
+}
+
+void QRcache_store(const QRcache_Key *key, const QRcode *code)
+{
+	QRcache_Entry *entry = NULL;
+	unsigned char *planes;
+	size_t size, plane;
+	int i, n;
+
+	if(cacheLimit == 0) return;
+
+	plane = PLANE_SIZE(code->width);
+	size = CACHE_ALIGN(CACHE_ALIGN(sizeof(QRcache_Entry)) + (size_t)key->length + plane * 2);
+	if(size > cacheLimit) return;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&cache_mutex);
+#endif
+	for(;;) {
+		if(cacheBuffer != NULL) {
+			entry = (QRcache_Entry *)QRcache_findGap(size);
+			if(entry != NULL) break;
+		} else if(cacheUsed + size <= cacheLimit) {
+			entry = (QRcache_Entry *)malloc(size);
+			break;
+		}
+		if(!QRcache_dropLeastRecent()) break;
+	}
+	if(entry == NULL) goto EXIT;
+
+	entry->size = size;
+	entry->hash = QRcache_hash(key->payload, key->length);
+	entry->length = key->length;
+	entry->version = key->version;
+	entry->level = key->level;
+	entry->hint = key->hint;
+	entry->casesensitive = key->casesensitive;
+	entry->mqr = key->mqr;
+	entry->symbolVersion = code->version;
+	entry->width = code->width;
+	memcpy(ENTRY_PAYLOAD(entry), key->payload, (size_t)key->length);
+	planes = ENTRY_PLANES(entry);
+	memset(planes, 0, plane * 2);
+	n = code->width * code->width;
+	for(i = 0; i < n; i++) {
+		planes[i >> 3] |= (unsigned char)((code->data[i] & 1) << (i & 7));
+		planes[plane + (i >> 3)] |= (unsigned char)(((code->data[i] >> 1) & 1) << (i & 7));
+	}
+	entry->next = entries;
+	entries = entry;
+	cacheUsed += size;
+
+EXIT:
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+void QRcache_clear(void)
+{
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&cache_mutex);
+#endif
+	while(entries != NULL) {
+		QRcache_drop(&entries);
+	}
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+void QRcode_setEncodeCache(void *buffer, size_t limit)
+{
+	size_t skip;
+
+	QRcache_clear();
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&cache_mutex);
+#endif
+	/* entries start with pointers */
+	if(buffer != NULL) {
+		skip = (size_t)(-(uintptr_t)buffer & 7);
+		if(limit < skip) {
+			limit = 0;
+		} else {
+			buffer = (unsigned char *)buffer + skip;
+			limit -= skip;
+		}
+	}
+	cacheBuffer = (unsigned char *)buffer;
+	cacheLimit = limit;
+	cacheHits = 0;
+	cacheMisses = 0;
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+}
+
+void QRcode_getEncodeCacheStats(unsigned long *hits, unsigned long *misses)
+{
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&cache_mutex);
+#endif
+	if(hits != NULL) *hits = cacheHits;
+	if(misses != NULL) *misses = cacheMisses;
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&cache_mutex);
+#endif
+}
@@ -0,0 +1,53 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Cache of encoded symbols.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRCACHE_H
+#define QRCACHE_H
+
+#include "qrencode.h"
+
+/**
+ * Arguments of an encoding that determine the symbol.
+ */
+typedef struct {
+	const unsigned char *payload;
+	int length;
+	int version;
+	QRecLevel level;
+	QRencodeMode hint;	///< QR_MODE_NUL for data given as is
+	int casesensitive;
+	int mqr;
+} QRcache_Key;
+
+/**
+ * Return a copy of the symbol cached for the key, allocated by QRalloc, or
+ * NULL if it is not cached.
+ */
+extern QRcode *QRcache_find(const QRcache_Key *key);
+
+/**
+ * Cache the symbol encoded for the key.
+ */
+extern void QRcache_store(const QRcache_Key *key, const QRcode *code);
+
+extern void QRcache_clear(void);
+
+#endif /* QRCACHE_H */
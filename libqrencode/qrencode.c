@@ -35,6 +35,9 @@
 #include "split.h"
 #include "mask.h"
 #include "mmask.h"
+#include "qralloc.h"
+#include "qrparallel.h"
+#include "qrcache.h"
 
 /******************************************************************************
  * Raw code
@@ -65,8 +68,6 @@ static void RSblock_initBlock(RSblock *block, int dl, unsigned char *data, int e
 	block->data = data;
 	block->eccLength = el;
 	block->ecc = ecc;
-
-	RSECC_encode((size_t)dl, (size_t)el, data, ecc);
 }
 
 static int RSblock_init(RSblock *blocks, int spec[5], unsigned char *data, unsigned char *ecc)
@@ -75,32 +76,36 @@ static int RSblock_init(RSblock *blocks, int spec[5], unsigned char *data, unsig
 	RSblock *block;
 	unsigned char *dp, *ep;
 	int el, dl;
+	int b1, dl1, b2;
 
 	dl = QRspec_rsDataCodes1(spec);
 	el = QRspec_rsEccCodes1(spec);
+	b1 = QRspec_rsBlockNum1(spec);
+	dl1 = dl;
+	b2 = QRspec_rsBlockNum2(spec);
 
 	block = blocks;
 	dp = data;
 	ep = ecc;
-	for(i = 0; i < QRspec_rsBlockNum1(spec); i++) {
+	for(i = 0; i < b1; i++) {
 		RSblock_initBlock(block, dl, dp, el, ep);
 		dp += dl;
 		ep += el;
 		block++;
 	}
 
-	if(QRspec_rsBlockNum2(spec) == 0) return 0;
-
 	dl = QRspec_rsDataCodes2(spec);
 	el = QRspec_rsEccCodes2(spec);
-	for(i = 0; i < QRspec_rsBlockNum2(spec); i++) {
+	for(i = 0; i < b2; i++) {
 		RSblock_initBlock(block, dl, dp, el, ep);
 		dp += dl;
 		ep += el;
 		block++;
 	}
 
-	return 0;
+	/* Both groups share the ECC length, so all blocks are encoded in
+	 * lockstep. */
+	return RSECC_encodeBlocks(b1, (size_t)dl1, b2, (size_t)dl, (size_t)el, data, ecc);
 }
 
 STATIC_IN_RELEASE void QRraw_free(QRRawCode *raw);
@@ -109,12 +114,12 @@ STATIC_IN_RELEASE QRRawCode *QRraw_new(QRinput *input)
 	QRRawCode *raw;
 	int spec[5], ret;
 
-	raw = (QRRawCode *)malloc(sizeof(QRRawCode));
+	raw = (QRRawCode *)QRalloc_malloc(sizeof(QRRawCode));
 	if(raw == NULL) return NULL;
 
 	raw->datacode = QRinput_getByteStream(input);
 	if(raw->datacode == NULL) {
-		free(raw);
+		QRalloc_free(raw);
 		return NULL;
 	}
 
@@ -124,15 +129,15 @@ STATIC_IN_RELEASE QRRawCode *QRraw_new(QRinput *input)
 	raw->b1 = QRspec_rsBlockNum1(spec);
 	raw->dataLength = QRspec_rsDataLength(spec);
 	raw->eccLength = QRspec_rsEccLength(spec);
-	raw->ecccode = (unsigned char *)malloc((size_t)raw->eccLength);
+	raw->ecccode = (unsigned char *)QRalloc_malloc((size_t)raw->eccLength);
 	if(raw->ecccode == NULL) {
-		free(raw->datacode);
-		free(raw);
+		QRalloc_free(raw->datacode);
+		QRalloc_free(raw);
 		return NULL;
 	}
 
 	raw->blocks = QRspec_rsBlockNum(spec);
-	raw->rsblock = (RSblock *)calloc((size_t)(raw->blocks), sizeof(RSblock));
+	raw->rsblock = (RSblock *)QRalloc_calloc((size_t)(raw->blocks), sizeof(RSblock));
 	if(raw->rsblock == NULL) {
 		QRraw_free(raw);
 		return NULL;
@@ -177,13 +182,50 @@ STATIC_IN_RELEASE unsigned char QRraw_getCode(QRRawCode *raw)
 	return ret;
 }
 
+/**
+ * Put the interleaved codes and the remainder bits to the modules listed in
+ * the placement map of the version. Same result as QRraw_getCode() and
+ * FrameFiller_next().
+ */
+static void QRraw_place(QRRawCode *raw, unsigned char *frame, const unsigned short *placement, int remainder)
+{
+	int i, j, col, length;
+	RSblock *block;
+	unsigned char code;
+
+	/* blocks of the second group have one more data code */
+	length = raw->rsblock[raw->blocks - 1].dataLength;
+	for(col = 0; col < length; col++) {
+		for(i = 0; i < raw->blocks; i++) {
+			block = raw->rsblock + i;
+			if(col >= block->dataLength) continue;
+			code = block->data[col];
+			for(j = 7; j >= 0; j--) {
+				frame[*placement++] = (code >> j) & 1;
+			}
+		}
+	}
+	length = raw->rsblock[0].eccLength;
+	for(col = 0; col < length; col++) {
+		for(i = 0; i < raw->blocks; i++) {
+			code = raw->rsblock[i].ecc[col];
+			for(j = 7; j >= 0; j--) {
+				frame[*placement++] = 0x02 | ((code >> j) & 1);
+			}
+		}
+	}
+	for(i = 0; i < remainder; i++) {
+		frame[*placement++] = 0x02;
+	}
+}
+
 STATIC_IN_RELEASE void QRraw_free(QRRawCode *raw)
 {
 	if(raw != NULL) {
-		free(raw->datacode);
-		free(raw->ecccode);
-		free(raw->rsblock);
-		free(raw);
+		QRalloc_free(raw->datacode);
+		QRalloc_free(raw->ecccode);
+		QRalloc_free(raw->rsblock);
+		QRalloc_free(raw);
 	}
 }
 
@@ -207,7 +249,7 @@ STATIC_IN_RELEASE MQRRawCode *MQRraw_new(QRinput *input)
 {
 	MQRRawCode *raw;
 
-	raw = (MQRRawCode *)malloc(sizeof(MQRRawCode));
+	raw = (MQRRawCode *)QRalloc_malloc(sizeof(MQRRawCode));
 	if(raw == NULL) return NULL;
 
 	raw->version = input->version;
@@ -216,23 +258,27 @@ STATIC_IN_RELEASE MQRRawCode *MQRraw_new(QRinput *input)
 	raw->oddbits = raw->dataLength * 8 - MQRspec_getDataLengthBit(input->version, input->level);
 	raw->datacode = QRinput_getByteStream(input);
 	if(raw->datacode == NULL) {
-		free(raw);
+		QRalloc_free(raw);
 		return NULL;
 	}
-	raw->ecccode = (unsigned char *)malloc((size_t)raw->eccLength);
+	raw->ecccode = (unsigned char *)QRalloc_malloc((size_t)raw->eccLength);
 	if(raw->ecccode == NULL) {
-		free(raw->datacode);
-		free(raw);
+		QRalloc_free(raw->datacode);
+		QRalloc_free(raw);
 		return NULL;
 	}
 
-	raw->rsblock = (RSblock *)calloc(1, sizeof(RSblock));
+	raw->rsblock = (RSblock *)QRalloc_calloc(1, sizeof(RSblock));
 	if(raw->rsblock == NULL) {
 		MQRraw_free(raw);
 		return NULL;
 	}
 
 	RSblock_initBlock(raw->rsblock, raw->dataLength, raw->datacode, raw->eccLength, raw->ecccode);
+	if(RSECC_encode((size_t)raw->dataLength, (size_t)raw->eccLength, raw->datacode, raw->ecccode) < 0) {
+		MQRraw_free(raw);
+		return NULL;
+	}
 
 	raw->count = 0;
 
@@ -263,10 +309,10 @@ STATIC_IN_RELEASE unsigned char MQRraw_getCode(MQRRawCode *raw)
 STATIC_IN_RELEASE void MQRraw_free(MQRRawCode *raw)
 {
 	if(raw != NULL) {
-		free(raw->datacode);
-		free(raw->ecccode);
-		free(raw->rsblock);
-		free(raw);
+		QRalloc_free(raw->datacode);
+		QRalloc_free(raw->ecccode);
+		QRalloc_free(raw->rsblock);
+		QRalloc_free(raw);
 	}
 }
 
@@ -368,7 +414,7 @@ unsigned char *FrameFiller_test(int version)
 	for(i = 0; i < length; i++) {
 		p = FrameFiller_next(&filler);
 		if(p == NULL) {
-			free(frame);
+			QRalloc_free(frame);
 			return NULL;
 		}
 		*p = (unsigned char)(i & 0x7f) | 0x80;
@@ -410,7 +456,7 @@ STATIC_IN_RELEASE QRcode *QRcode_new(int version, int width, unsigned char *data
 {
 	QRcode *qrcode;
 
-	qrcode = (QRcode *)malloc(sizeof(QRcode));
+	qrcode = (QRcode *)QRalloc_malloc(sizeof(QRcode));
 	if(qrcode == NULL) return NULL;
 
 	qrcode->version = version;
@@ -423,43 +469,51 @@ STATIC_IN_RELEASE QRcode *QRcode_new(int version, int width, unsigned char *data
 void QRcode_free(QRcode *qrcode)
 {
 	if(qrcode != NULL) {
-		free(qrcode->data);
-		free(qrcode);
+		QRalloc_free(qrcode->data);
+		QRalloc_free(qrcode);
 	}
 }
 
-STATIC_IN_RELEASE QRcode *QRcode_encodeMask(QRinput *input, int mask)
+void QRcode_writeRows(const QRcode *qrcode, QRcode_RowSink *sink, void *data)
 {
-	int width, version;
-	QRRawCode *raw;
-	unsigned char *frame, *masked, *p, code, bit;
-	int i, j;
-	QRcode *qrcode = NULL;
-	FrameFiller filler;
+	unsigned char row[(QRSPEC_WIDTH_MAX + 7) / 8];
+	const unsigned char *p;
+	int x, y;
 
-	if(input->mqr) {
-		errno = EINVAL;
-		return NULL;
-	}
-	if(input->version < 0 || input->version > QRSPEC_VERSION_MAX) {
-		errno = EINVAL;
-		return NULL;
-	}
-	if(!(input->level >= QR_ECLEVEL_L && input->level <= QR_ECLEVEL_H)) {
-		errno = EINVAL;
-		return NULL;
+	p = qrcode->data;
+	for(y = 0; y < qrcode->width; y++) {
+		memset(row, 0, (size_t)((qrcode->width + 7) / 8));
+		for(x = 0; x < qrcode->width; x++) {
+			row[x >> 3] |= (unsigned char)((*p++ & 1) << (x & 7));
+		}
+		sink(y, row, qrcode->width, data);
 	}
+}
 
-	raw = QRraw_new(input);
-	if(raw == NULL) return NULL;
+/**
+ * Return the frame of the raw code with the interleaved data and ecc codes
+ * placed, unmasked. FrameFiller walks the frame if the placement map is not
+ * available, or if noPlacement is nonzero (for the tests and benchmarks).
+ */
+STATIC_IN_RELEASE unsigned char *QRraw_fillFrame(QRRawCode *raw, int noPlacement)
+{
+	int width, version;
+	unsigned char *frame, *p, code, bit;
+	const unsigned short *placement;
+	int i, j;
+	FrameFiller filler;
 
 	version = raw->version;
 	width = QRspec_getWidth(version);
-	frame = QRspec_newFrame(version);
-	if(frame == NULL) {
-		QRraw_free(raw);
-		return NULL;
+	frame = QRspec_newFramePlacement(version, &placement);
+	if(frame == NULL) return NULL;
+	if(placement != NULL && !noPlacement) {
+		QRraw_place(raw, frame, placement, QRspec_getRemainder(version));
+		QRspec_releasePlacement(version);
+		return frame;
 	}
+	if(placement != NULL) QRspec_releasePlacement(version);
+	raw->count = 0;
 	FrameFiller_set(&filler, width, frame, 0);
 
 	/* interleaved data and ecc codes */
@@ -483,8 +537,6 @@ STATIC_IN_RELEASE QRcode *QRcode_encodeMask(QRinput *input, int mask)
 			bit = bit >> 1;
 		}
 	}
-	QRraw_free(raw);
-	raw = NULL;
 	/* remainder bits */
 	j = QRspec_getRemainder(version);
 	for(i = 0; i < j; i++) {
@@ -493,9 +545,45 @@ STATIC_IN_RELEASE QRcode *QRcode_encodeMask(QRinput *input, int mask)
 		*p = 0x02;
 	}
 
+	return frame;
+
+EXIT:
+	QRalloc_free(frame);
+	return NULL;
+}
+
+STATIC_IN_RELEASE QRcode *QRcode_encodeMask(QRinput *input, int mask)
+{
+	int width, version;
+	QRRawCode *raw;
+	unsigned char *frame, *masked;
+	QRcode *qrcode = NULL;
+
+	if(input->mqr) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if(input->version < 0 || input->version > QRSPEC_VERSION_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!(input->level >= QR_ECLEVEL_L && input->level <= QR_ECLEVEL_H)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	raw = QRraw_new(input);
+	if(raw == NULL) return NULL;
+
+	version = raw->version;
+	width = QRspec_getWidth(version);
+	frame = QRraw_fillFrame(raw, 0);
+	QRraw_free(raw);
+	if(frame == NULL) return NULL;
+
 	/* masking */
 	if(mask == -2) { // just for debug purpose
-		masked = (unsigned char *)malloc((size_t)(width * width));
+		masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 		memcpy(masked, frame, (size_t)(width * width));
 	} else if(mask < 0) {
 		masked = Mask_mask(width, frame, input->level);
@@ -507,12 +595,11 @@ STATIC_IN_RELEASE QRcode *QRcode_encodeMask(QRinput *input, int mask)
 	}
 	qrcode = QRcode_new(version, width, masked);
 	if(qrcode == NULL) {
-		free(masked);
+		QRalloc_free(masked);
 	}
 
 EXIT:
-	QRraw_free(raw);
-	free(frame);
+	QRalloc_free(frame);
 	return qrcode;
 }
 
@@ -582,7 +669,7 @@ STATIC_IN_RELEASE QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask)
 
 	/* masking */
 	if(mask == -2) { // just for debug purpose
-		masked = (unsigned char *)malloc((size_t)(width * width));
+		masked = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 		memcpy(masked, frame, (size_t)(width * width));
 	} else if(mask < 0) {
 		masked = MMask_mask(version, frame, input->level);
@@ -595,12 +682,12 @@ STATIC_IN_RELEASE QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask)
 
 	qrcode = QRcode_new(version, width, masked);
 	if(qrcode == NULL) {
-		free(masked);
+		QRalloc_free(masked);
 	}
 
 EXIT:
 	MQRraw_free(raw);
-	free(frame);
+	QRalloc_free(frame);
 	return qrcode;
 }
 
@@ -617,6 +704,7 @@ static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLeve
 {
 	QRinput *input;
 	QRcode *code;
+	QRcache_Key key;
 	int ret;
 
 	if(string == NULL) {
@@ -628,6 +716,16 @@ static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLeve
 		return NULL;
 	}
 
+	key.payload = (const unsigned char *)string;
+	key.length = (int)strlen(string);
+	key.version = version;
+	key.level = level;
+	key.hint = hint;
+	key.casesensitive = casesensitive;
+	key.mqr = mqr;
+	code = QRcache_find(&key);
+	if(code != NULL) return code;
+
 	if(mqr) {
 		input = QRinput_newMQR(version, level);
 	} else {
@@ -642,6 +740,9 @@ static QRcode *QRcode_encodeStringReal(const char *string, int version, QRecLeve
 	}
 	code = QRcode_encodeInput(input);
 	QRinput_free(input);
+	if(code != NULL) {
+		QRcache_store(&key, code);
+	}
 
 	return code;
 }
@@ -651,6 +752,80 @@ QRcode *QRcode_encodeString(const char *string, int version, QRecLevel level, QR
 	return QRcode_encodeStringReal(string, version, level, 0, hint, casesensitive);
 }
 
+size_t QRcode_workspaceSize(int version, QRecLevel level)
+{
+	size_t width, data, ecc;
+
+	if(version < 0 || version > QRSPEC_VERSION_MAX) return 0;
+	if(!(level >= QR_ECLEVEL_L && level <= QR_ECLEVEL_H)) return 0;
+	if(version == 0) version = QRSPEC_VERSION_MAX;
+
+	width = (size_t)QRspec_getWidth(version);
+	data = (size_t)QRspec_getDataLength(version, level);
+	ecc = (size_t)QRspec_getECCLength(version, level);
+
+	/* frame, mask and result symbol, the input entries and the packed
+	 * bitstream with its growth, the data/ecc codewords with the lane
+	 * registers of the ECC encoder, and the masked planes of the extra
+	 * jobs of a parallel mask search. */
+	return width * width * 3 + data * 20 + (data + ecc) * 4 + 4096
+		+ (size_t)(QRparallel_workers((int)width) - 1) * Mask_jobSize((int)width);
+}
+
+QRcode *QRcode_encodeStringStatic(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, void *workspace, size_t size)
+{
+	QRalloc_Arena arena, *prev;
+	QRcode *code;
+
+	if(workspace == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	QRalloc_initArena(&arena, workspace, size);
+	prev = QRalloc_setArena(&arena);
+	code = QRcode_encodeStringReal(string, version, level, 0, hint, casesensitive);
+	QRalloc_setArena(prev);
+
+	return code;
+}
+
+#ifdef WITH_TESTS
+/*
+ * Encode the string with QRcode_encodeString() and again into a workspace of
+ * QRcode_workspaceSize(), and return the number of heap allocations made by
+ * the latter. The first encoding also fills the frame cache. Returns -1 if
+ * an encoding fails or the two symbols differ.
+ */
+int QRcode_testStatic(const char *string, int version, QRecLevel level)
+{
+	QRcode *ref, *code;
+	void *workspace;
+	size_t size;
+	int count = -1;
+
+	ref = QRcode_encodeString(string, version, level, QR_MODE_8, 1);
+	if(ref == NULL) return -1;
+	size = QRcode_workspaceSize(ref->version, level);
+	workspace = malloc(size);
+	if(workspace == NULL) {
+		QRcode_free(ref);
+		return -1;
+	}
+
+	QRalloc_resetHeapCount();
+	code = QRcode_encodeStringStatic(string, version, level, QR_MODE_8, 1, workspace, size);
+	if(code != NULL && code->version == ref->version && code->width == ref->width
+	   && memcmp(code->data, ref->data, (size_t)(ref->width * ref->width)) == 0) {
+		count = (int)QRalloc_getHeapCount();
+	}
+
+	free(workspace);
+	QRcode_free(ref);
+
+	return count;
+}
+#endif
+
 QRcode *QRcode_encodeStringMQR(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive)
 {
 	int i;
@@ -670,6 +845,7 @@ static QRcode *QRcode_encodeDataReal(const unsigned char *data, int length, int
 {
 	QRinput *input;
 	QRcode *code;
+	QRcache_Key key;
 	int ret;
 
 	if(data == NULL || length == 0) {
@@ -677,6 +853,16 @@ static QRcode *QRcode_encodeDataReal(const unsigned char *data, int length, int
 		return NULL;
 	}
 
+	key.payload = data;
+	key.length = length;
+	key.version = version;
+	key.level = level;
+	key.hint = QR_MODE_NUL;
+	key.casesensitive = 1;
+	key.mqr = mqr;
+	code = QRcache_find(&key);
+	if(code != NULL) return code;
+
 	if(mqr) {
 		input = QRinput_newMQR(version, level);
 	} else {
@@ -691,6 +877,9 @@ static QRcode *QRcode_encodeDataReal(const unsigned char *data, int length, int
 	}
 	code = QRcode_encodeInput(input);
 	QRinput_free(input);
+	if(code != NULL) {
+		QRcache_store(&key, code);
+	}
 
 	return code;
 }
@@ -743,6 +932,466 @@ QRcode *QRcode_encodeString8bitMQR(const char *string, int version, QRecLevel le
 	return NULL;
 }
 
+/******************************************************************************
+ * QR-code template
+ *****************************************************************************/
+
+typedef struct {
+	QRencodeMode mode;
+	int size;
+} QRtemplate_Segment;
+
+struct _QRtemplate {
+	int version;
+	QRecLevel level;
+	QRencodeMode hint;
+	int casesensitive;
+	int width;
+	int mask;			///< mask of the symbol, or -1 before the first one
+	int blocks;
+	int b1;				///< blocks of the first group
+	int dl1;			///< data codes of a block of the first group
+	int dl2;			///< data codes of a block of the second group
+	int el;				///< ecc codes of a block
+	int dataLength;
+	int eccLength;
+	unsigned char *datacode;	///< data codes, block by block
+	unsigned char *ecccode;		///< ecc codes, block by block
+	unsigned char *frame;		///< symbol before masking
+	QRcode code;				///< masked symbol
+	unsigned char *rows;		///< masked symbol packed in bits, row by row
+	int rowBytes;
+	const unsigned short *placement;	///< pinned placement map, or NULL
+	QRtemplate_Segment *segment;
+	int segments;		///< segments of the frozen layout, 0 if not frozen
+	int maxSegments;
+	size_t length;		///< length of the string of the frozen layout
+	unsigned char *workspace;	///< workspace of the updates, or NULL for the heap
+	size_t workspaceSize;
+	int heap;			///< the template itself is on the heap
+};
+
+#define TEMPLATE_ALIGN(__size__) (((__size__) + 7) & ~(size_t)7)
+
+static size_t QRtemplate_storageSize(int version, QRecLevel level)
+{
+	size_t width, data, ecc;
+
+	width = (size_t)QRspec_getWidth(version);
+	data = (size_t)QRspec_getDataLength(version, level);
+	ecc = (size_t)QRspec_getECCLength(version, level);
+
+	/* A segment takes 16 bits at least: mode, length and one character. */
+	return TEMPLATE_ALIGN(sizeof(QRtemplate)) + TEMPLATE_ALIGN(data) + TEMPLATE_ALIGN(ecc)
+		+ TEMPLATE_ALIGN(width * width) * 2 + TEMPLATE_ALIGN(width * ((width + 7) / 8))
+		+ TEMPLATE_ALIGN(sizeof(QRtemplate_Segment) * (data / 2 + 1));
+}
+
+size_t QRtemplate_size(int version, QRecLevel level)
+{
+	if(version < 0 || version > QRSPEC_VERSION_MAX) return 0;
+	if(!(level >= QR_ECLEVEL_L && level <= QR_ECLEVEL_H)) return 0;
+	if(version == 0) version = QRSPEC_VERSION_MAX;
+
+	return QRtemplate_storageSize(version, level) + QRcode_workspaceSize(version, level);
+}
+
+/**
+ * Keep the segments of the input to split the next strings the same way.
+ */
+static void QRtemplate_freeze(QRtemplate *tmpl, QRinput *input, const char *string)
+{
+	QRinput_List *list;
+	size_t length = 0;
+	int n = 0;
+
+	tmpl->segments = 0;
+	/* When case insensitive, the segments hold the string in upper case. */
+	if(!tmpl->casesensitive) return;
+
+	for(list = input->head; list != NULL; list = list->next) {
+		if(n >= tmpl->maxSegments) return;
+		tmpl->segment[n].mode = list->mode;
+		tmpl->segment[n].size = list->size;
+		length += (size_t)list->size;
+		n++;
+	}
+	if(length != strlen(string)) return;
+	tmpl->segments = n;
+	tmpl->length = length;
+}
+
+static QRinput *QRtemplate_newInput(QRtemplate *tmpl, const char *string)
+{
+	QRinput *input;
+	const unsigned char *p;
+	int i;
+
+	input = QRinput_new2(tmpl->version, tmpl->level);
+	if(input == NULL) return NULL;
+
+	if(tmpl->segments > 0 && strlen(string) == tmpl->length) {
+		p = (const unsigned char *)string;
+		for(i = 0; i < tmpl->segments; i++) {
+			if(QRinput_append(input, tmpl->segment[i].mode, tmpl->segment[i].size, p) < 0) break;
+			p += tmpl->segment[i].size;
+		}
+		if(i == tmpl->segments) return input;
+
+		/* a character does not fit its segment */
+		QRinput_free(input);
+		input = QRinput_new2(tmpl->version, tmpl->level);
+		if(input == NULL) return NULL;
+	}
+
+	if(Split_splitStringToQRinput(string, input, tmpl->hint, tmpl->casesensitive) < 0) {
+		QRinput_free(input);
+		return NULL;
+	}
+	QRtemplate_freeze(tmpl, input, string);
+
+	return input;
+}
+
+static void QRtemplate_packRows(QRtemplate *tmpl)
+{
+	const unsigned char *p;
+	unsigned char *row;
+	int x, y;
+
+	p = tmpl->code.data;
+	row = tmpl->rows;
+	memset(row, 0, (size_t)(tmpl->width * tmpl->rowBytes));
+	for(y = 0; y < tmpl->width; y++) {
+		for(x = 0; x < tmpl->width; x++) {
+			row[x >> 3] |= (unsigned char)((*p++ & 1) << (x & 7));
+		}
+		row += tmpl->rowBytes;
+	}
+}
+
+/**
+ * Encode the string from scratch and select the mask. The template is
+ * updated only on success.
+ */
+static int QRtemplate_encode(QRtemplate *tmpl, const char *string)
+{
+	QRinput *input;
+	QRRawCode *raw = NULL;
+	unsigned char *frame = NULL, *masked = NULL;
+	int mask, ret = -1;
+
+	input = QRtemplate_newInput(tmpl, string);
+	if(input == NULL) return -1;
+
+	raw = QRraw_new(input);
+	if(raw == NULL) goto EXIT;
+	/* the input grows the version rather than fail */
+	if(raw->version != tmpl->version) {
+		errno = ERANGE;
+		goto EXIT;
+	}
+	frame = QRraw_fillFrame(raw, 0);
+	if(frame == NULL) goto EXIT;
+	mask = Mask_select(tmpl->width, frame, tmpl->level, tmpl->mask);
+	if(mask < 0) goto EXIT;
+	masked = Mask_makeMask(tmpl->width, frame, mask, tmpl->level);
+	if(masked == NULL) goto EXIT;
+
+	memcpy(tmpl->datacode, raw->datacode, (size_t)tmpl->dataLength);
+	memcpy(tmpl->ecccode, raw->ecccode, (size_t)tmpl->eccLength);
+	memcpy(tmpl->frame, frame, (size_t)(tmpl->width * tmpl->width));
+	memcpy(tmpl->code.data, masked, (size_t)(tmpl->width * tmpl->width));
+	QRtemplate_packRows(tmpl);
+	tmpl->mask = mask;
+	ret = 0;
+
+EXIT:
+	QRalloc_free(masked);
+	QRalloc_free(frame);
+	QRraw_free(raw);
+	QRinput_free(input);
+	return ret;
+}
+
+/**
+ * Flip the modules of the bits set in diff, of the code at index in the
+ * interleaved order. The mask is an XOR, so the masked symbol flips alike.
+ */
+static void QRtemplate_flip(QRtemplate *tmpl, int index, unsigned int diff)
+{
+	const unsigned short *p;
+	int j, x, y;
+
+	p = tmpl->placement + index * 8;
+	for(j = 7; j >= 0; j--) {
+		if((diff >> j) & 1) {
+			tmpl->frame[*p] ^= 1;
+			tmpl->code.data[*p] ^= 1;
+			y = *p / tmpl->width;
+			x = *p - y * tmpl->width;
+			tmpl->rows[y * tmpl->rowBytes + (x >> 3)] ^= (unsigned char)(1 << (x & 7));
+		}
+		p++;
+	}
+}
+
+static int QRtemplate_dataIndex(QRtemplate *tmpl, int block, int col)
+{
+	if(col < tmpl->dl1) {
+		return col * tmpl->blocks + block;
+	}
+	/* only the second group has the last columns */
+	return tmpl->dl1 * tmpl->blocks + (col - tmpl->dl1) * (tmpl->blocks - tmpl->b1) + block - tmpl->b1;
+}
+
+/**
+ * Patch the symbol with the data codes of the string that changed and the
+ * ecc of the change. Reed-Solomon codes are linear, so the new ecc is the
+ * old one XORed with the ecc of the difference, whose leading zeros are
+ * skipped.
+ */
+static int QRtemplate_patch(QRtemplate *tmpl, const char *string, int recheck)
+{
+	QRinput *input;
+	unsigned char *data = NULL, *delta = NULL, *masked, *dp, *op;
+	int b, i, first, length, mask, ret = -1;
+
+	input = QRtemplate_newInput(tmpl, string);
+	if(input == NULL) return -1;
+
+	data = QRinput_getByteStream(input);
+	if(data == NULL) goto EXIT;
+	if(input->version != tmpl->version) {
+		errno = ERANGE;
+		goto EXIT;
+	}
+	delta = (unsigned char *)QRalloc_malloc((size_t)tmpl->el);
+	if(delta == NULL) goto EXIT;
+
+	dp = data;
+	op = tmpl->datacode;
+	for(b = 0; b < tmpl->blocks; b++) {
+		length = (b < tmpl->b1) ? tmpl->dl1 : tmpl->dl2;
+		first = -1;
+		for(i = 0; i < length; i++) {
+			dp[i] ^= op[i];
+			if(first < 0 && dp[i] != 0) first = i;
+		}
+		if(first >= 0) {
+			RSECC_encode((size_t)(length - first), (size_t)tmpl->el, dp + first, delta);
+			for(i = first; i < length; i++) {
+				if(dp[i] == 0) continue;
+				op[i] ^= dp[i];
+				QRtemplate_flip(tmpl, QRtemplate_dataIndex(tmpl, b, i), dp[i]);
+			}
+			for(i = 0; i < tmpl->el; i++) {
+				if(delta[i] == 0) continue;
+				tmpl->ecccode[b * tmpl->el + i] ^= delta[i];
+				QRtemplate_flip(tmpl, tmpl->dataLength + i * tmpl->blocks + b, delta[i]);
+			}
+		}
+		dp += length;
+		op += length;
+	}
+	ret = 0;
+
+	/* The kept mask is scored first, so the others are mostly pruned after
+	 * a few lines. */
+	if(recheck) {
+		mask = Mask_select(tmpl->width, tmpl->frame, tmpl->level, tmpl->mask);
+		if(mask < 0) {
+			ret = -1;
+		} else if(mask != tmpl->mask) {
+			masked = Mask_makeMask(tmpl->width, tmpl->frame, mask, tmpl->level);
+			if(masked == NULL) {
+				ret = -1;
+			} else {
+				memcpy(tmpl->code.data, masked, (size_t)(tmpl->width * tmpl->width));
+				QRalloc_free(masked);
+				QRtemplate_packRows(tmpl);
+				tmpl->mask = mask;
+			}
+		}
+	}
+
+EXIT:
+	QRalloc_free(delta);
+	QRalloc_free(data);
+	QRinput_free(input);
+	return ret;
+}
+
+/**
+ * Find the version that the string takes.
+ */
+static int QRtemplate_estimateVersion(const char *string, QRecLevel level, QRencodeMode hint, int casesensitive)
+{
+	QRinput *input;
+	unsigned char *data;
+	int version = -1;
+
+	input = QRinput_new2(0, level);
+	if(input == NULL) return -1;
+	if(Split_splitStringToQRinput(string, input, hint, casesensitive) == 0) {
+		data = QRinput_getByteStream(input);
+		if(data != NULL) {
+			version = input->version;
+			QRalloc_free(data);
+		}
+	}
+	QRinput_free(input);
+
+	return version;
+}
+
+QRtemplate *QRtemplate_new(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, void *buffer, size_t size)
+{
+	QRtemplate *tmpl = NULL;
+	QRalloc_Arena arena, *prev = NULL;
+	unsigned char *p, *frame;
+	size_t storage, width;
+	int spec[5];
+
+	if(string == NULL || version < 0 || version > QRSPEC_VERSION_MAX) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if(!(level >= QR_ECLEVEL_L && level <= QR_ECLEVEL_H)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	/* the buffer is laid out for the largest version when it is not given */
+	storage = QRtemplate_storageSize(version == 0 ? QRSPEC_VERSION_MAX : version, level);
+	if(buffer != NULL) {
+		if(size < storage) {
+			errno = EINVAL;
+			return NULL;
+		}
+		QRalloc_initArena(&arena, (unsigned char *)buffer + storage, size - storage);
+		prev = QRalloc_setArena(&arena);
+	}
+
+	if(version == 0) {
+		version = QRtemplate_estimateVersion(string, level, hint, casesensitive);
+		if(version < 0) goto EXIT;
+	}
+	if(buffer != NULL) {
+		p = (unsigned char *)buffer;
+	} else {
+		storage = QRtemplate_storageSize(version, level);
+		p = (unsigned char *)malloc(storage);
+		if(p == NULL) goto EXIT;
+	}
+	memset(p, 0, TEMPLATE_ALIGN(sizeof(QRtemplate)));
+
+	tmpl = (QRtemplate *)p;
+	QRspec_getEccSpec(version, level, spec);
+	width = (size_t)QRspec_getWidth(version);
+	tmpl->version = version;
+	tmpl->level = level;
+	tmpl->hint = hint;
+	tmpl->casesensitive = casesensitive;
+	tmpl->width = (int)width;
+	tmpl->mask = -1;
+	tmpl->blocks = QRspec_rsBlockNum(spec);
+	tmpl->b1 = QRspec_rsBlockNum1(spec);
+	tmpl->dl1 = QRspec_rsDataCodes1(spec);
+	tmpl->dl2 = QRspec_rsDataCodes2(spec);
+	tmpl->el = QRspec_rsEccCodes1(spec);
+	tmpl->dataLength = QRspec_rsDataLength(spec);
+	tmpl->eccLength = QRspec_rsEccLength(spec);
+	tmpl->maxSegments = tmpl->dataLength / 2 + 1;
+	tmpl->heap = (buffer == NULL);
+	if(buffer != NULL) {
+		tmpl->workspace = (unsigned char *)buffer + storage;
+		tmpl->workspaceSize = size - storage;
+	}
+
+	p += TEMPLATE_ALIGN(sizeof(QRtemplate));
+	tmpl->datacode = p;
+	p += TEMPLATE_ALIGN((size_t)tmpl->dataLength);
+	tmpl->ecccode = p;
+	p += TEMPLATE_ALIGN((size_t)tmpl->eccLength);
+	tmpl->frame = p;
+	p += TEMPLATE_ALIGN(width * width);
+	tmpl->code.version = version;
+	tmpl->code.width = (int)width;
+	tmpl->code.data = p;
+	p += TEMPLATE_ALIGN(width * width);
+	tmpl->rowBytes = (int)((width + 7) / 8);
+	tmpl->rows = p;
+	p += TEMPLATE_ALIGN(width * (size_t)tmpl->rowBytes);
+	tmpl->segment = (QRtemplate_Segment *)p;
+
+	/* The placement map is pinned for the patches. */
+	frame = QRspec_newFramePlacement(version, &tmpl->placement);
+	if(frame == NULL) goto ERROR;
+	QRalloc_free(frame);
+
+	if(QRtemplate_encode(tmpl, string) < 0) goto ERROR;
+
+EXIT:
+	if(buffer != NULL) {
+		QRalloc_setArena(prev);
+	}
+	return tmpl;
+
+ERROR:
+	QRtemplate_free(tmpl);
+	tmpl = NULL;
+	goto EXIT;
+}
+
+const QRcode *QRtemplate_update(QRtemplate *tmpl, const char *string, int mode)
+{
+	QRalloc_Arena arena, *prev = NULL;
+	int ret;
+
+	if(tmpl == NULL || string == NULL || mode < QR_TEMPLATE_PATCH || mode > QR_TEMPLATE_FULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if(tmpl->workspace != NULL) {
+		QRalloc_initArena(&arena, tmpl->workspace, tmpl->workspaceSize);
+		prev = QRalloc_setArena(&arena);
+	}
+
+	if(mode == QR_TEMPLATE_FULL || tmpl->placement == NULL) {
+		ret = QRtemplate_encode(tmpl, string);
+	} else {
+		ret = QRtemplate_patch(tmpl, string, mode == QR_TEMPLATE_RECHECK);
+	}
+
+	if(tmpl->workspace != NULL) {
+		QRalloc_setArena(prev);
+	}
+
+	return (ret < 0) ? NULL : &tmpl->code;
+}
+
+void QRtemplate_writeRows(const QRtemplate *tmpl, QRcode_RowSink *sink, void *data)
+{
+	int y;
+
+	for(y = 0; y < tmpl->width; y++) {
+		sink(y, tmpl->rows + y * tmpl->rowBytes, tmpl->width, data);
+	}
+}
+
+void QRtemplate_free(QRtemplate *tmpl)
+{
+	if(tmpl == NULL) return;
+
+	if(tmpl->placement != NULL) {
+		QRspec_releasePlacement(tmpl->version);
+		tmpl->placement = NULL;
+	}
+	if(tmpl->heap) {
+		free(tmpl);
+	}
+}
+
 
 /******************************************************************************
  * Structured QR-code encoding
@@ -752,7 +1401,7 @@ static QRcode_List *QRcode_List_newEntry(void)
 {
 	QRcode_List *entry;
 
-	entry = (QRcode_List *)malloc(sizeof(QRcode_List));
+	entry = (QRcode_List *)QRalloc_malloc(sizeof(QRcode_List));
 	if(entry == NULL) return NULL;
 
 	entry->next = NULL;
@@ -765,7 +1414,7 @@ static void QRcode_List_freeEntry(QRcode_List *entry)
 {
 	if(entry != NULL) {
 		QRcode_free(entry->code);
-		free(entry);
+		QRalloc_free(entry);
 	}
 }
 
@@ -932,7 +1581,18 @@ char *QRcode_APIVersionString(void)
 	return VERSION;
 }
 
+int QRcode_setFrameCache(void *buffer, size_t limit)
+{
+	return QRspec_setFrameCache(buffer, limit);
+}
+
+size_t QRcode_frameCacheSize(int version)
+{
+	return QRspec_frameCacheSize(version);
+}
+
 void QRcode_clearCache(void)
 {
-	return;
+	QRspec_clearCache();
+	QRcache_clear();
 }
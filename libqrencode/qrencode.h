@@ -99,6 +99,8 @@
 #ifndef QRENCODE_H
 #define QRENCODE_H
 
+#include <stddef.h>
+
 #if defined(__cplusplus)
 extern "C" {
 #endif
@@ -378,6 +380,12 @@ typedef struct {
 	unsigned char *data; ///< symbol data
 } QRcode;
 
+/**
+ * Receiver of the rows of a symbol, from the top. Module x of the row is bit
+ * (x % 8) of row[x / 8], 1 for black. The row is valid only during the call.
+ */
+typedef void QRcode_RowSink(int y, const unsigned char *row, int width, void *data);
+
 /**
  * Singly-linked list of QRcode. Used to represent a structured symbols.
  * A list is terminated with NULL.
@@ -425,6 +433,102 @@ extern QRcode *QRcode_encodeInput(QRinput *input);
  */
 extern QRcode *QRcode_encodeString(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive);
 
+/**
+ * Return the size of the workspace that QRcode_encodeStringStatic() needs to
+ * encode any input that fits in the given version and level.
+ * @param version version of the symbol. If 0, the size for the largest
+ *                version is returned.
+ * @param level error correction level.
+ * @return workspace size in bytes. On error, 0 is returned.
+ */
+extern size_t QRcode_workspaceSize(int version, QRecLevel level);
+
+/**
+ * Same to QRcode_encodeString(), but all memory is taken from the given
+ * workspace instead of the heap. The returned QRcode and its data are placed
+ * in the workspace; they are valid until the workspace is reused and must NOT
+ * be freed by QRcode_free(). The frame cache is not in the workspace; give it
+ * a buffer by QRcode_setFrameCache() to keep the heap untouched.
+ * @warning This function is THREAD UNSAFE when pthread is disabled.
+ * @param workspace memory for the encoder. Size it with QRcode_workspaceSize().
+ * @param size size of the workspace.
+ * @throw EINVAL invalid input object.
+ * @throw ENOMEM the workspace is too small.
+ * @throw ERANGE input data is too large.
+ */
+extern QRcode *QRcode_encodeStringStatic(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, void *workspace, size_t size);
+
+/**
+ * Template of a symbol whose payload changes only in a few places, such as a
+ * fixed-format string with fields that change. The template keeps the
+ * version, mask, segmentation and codewords of the last string, and a new
+ * string patches only the modules of the data codewords that changed and of
+ * the ECC, updated by the ECC of the difference.
+ */
+typedef struct _QRtemplate QRtemplate;
+
+/**
+ * How QRtemplate_update() produces the symbol.
+ */
+#define QR_TEMPLATE_PATCH 0		///< patch and keep the mask
+#define QR_TEMPLATE_RECHECK 1	///< patch, then select the mask again, trying the kept one first
+#define QR_TEMPLATE_FULL 2		///< encode the string from scratch
+
+/**
+ * Return the size of the memory that QRtemplate_new() needs, the template
+ * and the workspace of its updates.
+ * @param version version of the symbol. 0 for the largest version.
+ * @param level error correction level.
+ * @return size in bytes. On error, 0 is returned.
+ */
+extern size_t QRtemplate_size(int version, QRecLevel level);
+
+/**
+ * Create a template from the first string. The arguments are the same as
+ * QRcode_encodeString(). If version is 0, the version chosen for this string
+ * is kept for the later ones. Patching needs the placement map of the frame
+ * cache (see QRcode_setFrameCache()), which the template keeps until
+ * QRtemplate_free(); without it every update is encoded from scratch.
+ * @param buffer memory to keep the template in, or NULL to use the heap.
+ * @param size size of the buffer. Size it with QRtemplate_size().
+ * @return template, or NULL on error. errno is set.
+ * @throw EINVAL invalid argument, or the buffer is too small.
+ * @throw ENOMEM unable to allocate memory.
+ * @throw ERANGE input data is too large.
+ */
+extern QRtemplate *QRtemplate_new(const char *string, int version, QRecLevel level, QRencodeMode hint, int casesensitive, void *buffer, size_t size);
+
+/**
+ * Encode a new string by the template. A string of the same length is split
+ * in the same segments as the last one if its characters fit them; otherwise
+ * it is split again. Either way the symbol is correct, but the fewer bytes
+ * change, the less is patched. QR_TEMPLATE_PATCH may keep a mask that a full
+ * encoding would not choose; the other modes give the same symbol as
+ * QRcode_encodeString() for the same segments.
+ * @warning This function is THREAD UNSAFE.
+ * @param mode one of QR_TEMPLATE_*.
+ * @return symbol held by the template, valid until the next update. Do NOT
+ *         free it. On error, NULL is returned and the template keeps the
+ *         last symbol.
+ * @throw EINVAL invalid argument.
+ * @throw ENOMEM unable to allocate memory.
+ * @throw ERANGE the string does not fit the version.
+ */
+extern const QRcode *QRtemplate_update(QRtemplate *tmpl, const char *string, int mode);
+
+/**
+ * Pass the rows of the last symbol of the template to sink. The template
+ * keeps the rows packed and patches them with the symbol, so this does not
+ * read the symbol itself.
+ * @param data passed to sink as is.
+ */
+extern void QRtemplate_writeRows(const QRtemplate *tmpl, QRcode_RowSink *sink, void *data);
+
+/**
+ * Free the template. The buffer given to QRtemplate_new() may be reused.
+ */
+extern void QRtemplate_free(QRtemplate *tmpl);
+
 /**
  * Same to QRcode_encodeString(), but encode whole data in 8-bit mode.
  * @warning This function is THREAD UNSAFE when pthread is disabled.
@@ -469,6 +573,12 @@ extern QRcode *QRcode_encodeDataMQR(int size, const unsigned char *data, int ver
  */
 extern void QRcode_free(QRcode *qrcode);
 
+/**
+ * Pass the rows of the symbol to sink, packed in bits.
+ * @param data passed to sink as is.
+ */
+extern void QRcode_writeRows(const QRcode *qrcode, QRcode_RowSink *sink, void *data);
+
 /**
  * Create structured symbols from the input data.
  * @warning This function is THREAD UNSAFE when pthread is disabled.
@@ -537,6 +647,44 @@ extern void QRcode_List_free(QRcode_List *qrlist);
  * System utilities
  *****************************************************************************/
 
+/**
+ * Job runner for the parallel mask search. It must call func(args[i]) for
+ * every i in [0, n) and return after all of them have finished. args[0] may
+ * be run on the calling thread.
+ */
+typedef void QRcode_Runner(void (*func)(void *), void **args, int n, void *data);
+
+/**
+ * Evaluate the mask patterns of a symbol in parallel. The candidates are
+ * split into nworkers jobs; the chosen mask is the same as the serial search.
+ * The scratch memory of every job is allocated by the calling thread, so
+ * QRcode_workspaceSize() grows accordingly.
+ * @warning This function is THREAD UNSAFE. Call it before encoding.
+ * @param nworkers number of jobs. 1 restores the serial search.
+ * @param minimumWidth symbols narrower than this are masked serially.
+ * @param func runner, or NULL to use the built-in thread pool.
+ * @param data passed to func as is.
+ * @retval 0 success.
+ * @retval -1 error. errno is set.
+ * @throw EINVAL nworkers is out of range (1-8).
+ * @throw ENOSYS func is NULL and the library was built without pthread.
+ */
+extern int QRcode_setParallel(int nworkers, int minimumWidth, QRcode_Runner *func, void *data);
+
+/**
+ * Options of the mask search. Neither changes the chosen mask.
+ */
+#define QR_MASKSEARCH_PRUNE 1	///< stop scoring a mask once it cannot win (default)
+#define QR_MASKSEARCH_ORDER 2	///< try the mask chosen by the last encoding first
+
+/**
+ * Set the options of the mask search.
+ * @warning This function is THREAD UNSAFE. Call it before encoding.
+ * @param flags bitwise OR of QR_MASKSEARCH_* values. 0 scores every mask in
+ *              full.
+ */
+extern void QRcode_setMaskSearch(int flags);
+
 /**
  * Return a string that identifies the library version.
  * @param major_version major version number
@@ -553,13 +701,52 @@ extern void QRcode_APIVersion(int *major_version, int *minor_version, int *micro
 extern char *QRcode_APIVersionString(void);
 
 /**
- * @deprecated
+ * Limit the memory of the frame cache, which keeps the function patterns of
+ * each version once built. The versions used least recently are dropped
+ * first. By default the cache is on the heap without a limit.
+ * @warning This function is THREAD UNSAFE. Call it before encoding.
+ * @param buffer memory to keep the cache in, or NULL to use the heap. A
+ *               version needs QRcode_frameCacheSize() bytes.
+ * @param limit size of the buffer, or the heap limit in bytes. 0 disables the
+ *              cache.
+ * @retval 0 success.
+ * @retval -1 a template keeps a placement map of the cache. errno is set to
+ *            EBUSY and the cache is left as it is. Free the templates first.
+ */
+extern int QRcode_setFrameCache(void *buffer, size_t limit);
+
+/**
+ * Return the bytes of the frame cache that a version takes.
+ * @param version version of the symbol.
+ * @return size in bytes. On error, 0 is returned.
+ */
+extern size_t QRcode_frameCacheSize(int version);
+
+/**
+ * Keep the symbols encoded from strings and data by QRcode_encodeString(),
+ * QRcode_encodeData() and their variants, and return a copy when the same
+ * payload is encoded again with the same arguments. A symbol takes about a
+ * quarter of its size, packed in bits, plus its payload. The symbols used
+ * least recently are dropped to stay within the limit. Disabled by default.
+ * @warning This function is THREAD UNSAFE. Call it before encoding.
+ * @param buffer memory to keep the cache in, or NULL to use the heap.
+ * @param limit size of the buffer, or the heap limit in bytes. 0 disables the
+ *              cache.
+ */
+extern void QRcode_setEncodeCache(void *buffer, size_t limit);
+
+/**
+ * Return the counters of the encode cache since QRcode_setEncodeCache().
+ * @param hits encodings answered from the cache. May be NULL.
+ * @param misses encodings not found in the cache. May be NULL.
+ */
+extern void QRcode_getEncodeCacheStats(unsigned long *hits, unsigned long *misses);
+
+/**
+ * Release the frame cache and the encode cache. The templates are built
+ * again when needed.
  */
-#ifndef _MSC_VER
-extern void QRcode_clearCache(void) __attribute__ ((deprecated));
-#else
 extern void QRcode_clearCache(void);
-#endif
 
 #if defined(__cplusplus)
 }
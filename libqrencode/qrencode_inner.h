@@ -52,6 +52,7 @@ typedef struct {
 extern QRRawCode *QRraw_new(QRinput *input);
 extern unsigned char QRraw_getCode(QRRawCode *raw);
 extern void QRraw_free(QRRawCode *raw);
+extern unsigned char *QRraw_fillFrame(QRRawCode *raw, int noPlacement);
 
 /******************************************************************************
  * Raw code for Micro QR Code
@@ -84,5 +85,6 @@ extern unsigned char *FrameFiller_testMQR(int version);
 extern QRcode *QRcode_encodeMask(QRinput *input, int mask);
 extern QRcode *QRcode_encodeMaskMQR(QRinput *input, int mask);
 extern QRcode *QRcode_new(int version, int width, unsigned char *data);
+extern int QRcode_testStatic(const char *string, int version, QRecLevel level);
 
 #endif /* QRENCODE_INNER_H */
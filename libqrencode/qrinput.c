@@ -32,6 +32,7 @@
 #include "mqrspec.h"
 #include "bitstream.h"
 #include "qrinput.h"
+#include "qralloc.h"
 
 /******************************************************************************
  * Utilities
@@ -54,16 +55,16 @@ static QRinput_List *QRinput_List_newEntry(QRencodeMode mode, int size, const un
 		return NULL;
 	}
 
-	entry = (QRinput_List *)malloc(sizeof(QRinput_List));
+	entry = (QRinput_List *)QRalloc_malloc(sizeof(QRinput_List));
 	if(entry == NULL) return NULL;
 
 	entry->mode = mode;
 	entry->size = size;
 	entry->data = NULL;
 	if(size > 0) {
-		entry->data = (unsigned char *)malloc((size_t)size);
+		entry->data = (unsigned char *)QRalloc_malloc((size_t)size);
 		if(entry->data == NULL) {
-			free(entry);
+			QRalloc_free(entry);
 			return NULL;
 		}
 		memcpy(entry->data, data, (size_t)size);
@@ -77,9 +78,9 @@ static QRinput_List *QRinput_List_newEntry(QRencodeMode mode, int size, const un
 static void QRinput_List_freeEntry(QRinput_List *entry)
 {
 	if(entry != NULL) {
-		free(entry->data);
+		QRalloc_free(entry->data);
 		BitStream_free(entry->bstream);
-		free(entry);
+		QRalloc_free(entry);
 	}
 }
 
@@ -87,14 +88,14 @@ static QRinput_List *QRinput_List_dup(QRinput_List *entry)
 {
 	QRinput_List *n;
 
-	n = (QRinput_List *)malloc(sizeof(QRinput_List));
+	n = (QRinput_List *)QRalloc_malloc(sizeof(QRinput_List));
 	if(n == NULL) return NULL;
 
 	n->mode = entry->mode;
 	n->size = entry->size;
-	n->data = (unsigned char *)malloc((size_t)n->size);
+	n->data = (unsigned char *)QRalloc_malloc((size_t)n->size);
 	if(n->data == NULL) {
-		free(n);
+		QRalloc_free(n);
 		return NULL;
 	}
 	memcpy(n->data, entry->data, (size_t)entry->size);
@@ -122,7 +123,7 @@ QRinput *QRinput_new2(int version, QRecLevel level)
 		return NULL;
 	}
 
-	input = (QRinput *)malloc(sizeof(QRinput));
+	input = (QRinput *)QRalloc_malloc(sizeof(QRinput));
 	if(input == NULL) return NULL;
 
 	input->head = NULL;
@@ -302,7 +303,7 @@ void QRinput_free(QRinput *input)
 			QRinput_List_freeEntry(list);
 			list = next;
 		}
-		free(input);
+		QRalloc_free(input);
 	}
 }
 
@@ -1339,7 +1340,7 @@ unsigned char *QRinput_getByteStream(QRinput *input)
 		BitStream_free(bstream);
 		return NULL;
 	}
-	array = BitStream_toByte(bstream);
+	array = BitStream_detach(bstream);
 	BitStream_free(bstream);
 
 	return array;
@@ -1353,7 +1354,7 @@ static QRinput_InputList *QRinput_InputList_newEntry(QRinput *input)
 {
 	QRinput_InputList *entry;
 
-	entry = (QRinput_InputList *)malloc(sizeof(QRinput_InputList));
+	entry = (QRinput_InputList *)QRalloc_malloc(sizeof(QRinput_InputList));
 	if(entry == NULL) return NULL;
 
 	entry->input = input;
@@ -1366,7 +1367,7 @@ static void QRinput_InputList_freeEntry(QRinput_InputList *entry)
 {
 	if(entry != NULL) {
 		QRinput_free(entry->input);
-		free(entry);
+		QRalloc_free(entry);
 	}
 }
 
@@ -1374,7 +1375,7 @@ QRinput_Struct *QRinput_Struct_new(void)
 {
 	QRinput_Struct *s;
 
-	s = (QRinput_Struct *)malloc(sizeof(QRinput_Struct));
+	s = (QRinput_Struct *)QRalloc_malloc(sizeof(QRinput_Struct));
 	if(s == NULL) return NULL;
 
 	s->size = 0;
@@ -1425,7 +1426,7 @@ void QRinput_Struct_free(QRinput_Struct *s)
 			QRinput_InputList_freeEntry(list);
 			list = next;
 		}
-		free(s);
+		QRalloc_free(s);
 	}
 }
 
@@ -1449,11 +1450,11 @@ static int QRinput_List_shrinkEntry(QRinput_List *entry, int bytes)
 {
 	unsigned char *data;
 
-	data = (unsigned char *)malloc((size_t)bytes);
+	data = (unsigned char *)QRalloc_malloc((size_t)bytes);
 	if(data == NULL) return -1;
 
 	memcpy(data, entry->data, (size_t)bytes);
-	free(entry->data);
+	QRalloc_free(entry->data);
 	entry->data = data;
 	entry->size = bytes;
 
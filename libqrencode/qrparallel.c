@@ -0,0 +1,189 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Job runner for the parallel mask search.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+#include "qrencode.h"
+#include "qrparallel.h"
+
+static int workers = 1;
+static int minWidth = 0;
+static QRcode_Runner *runner = NULL;
+static void *runnerData = NULL;
+
+int QRcode_setParallel(int nworkers, int minimumWidth, QRcode_Runner *func, void *data)
+{
+	if(nworkers < 1 || nworkers > QRPARALLEL_MAX_WORKERS) {
+		errno = EINVAL;
+		return -1;
+	}
+#if !HAVE_LIBPTHREAD
+	if(nworkers > 1 && func == NULL) {
+		errno = ENOSYS;
+		return -1;
+	}
+#endif
+	workers = nworkers;
+	minWidth = minimumWidth;
+	runner = func;
+	runnerData = data;
+
+	return 0;
+}
+
+int QRparallel_workers(int width)
+{
+	if(width < minWidth) return 1;
+	return workers;
+}
+
+static void QRparallel_runSerial(void (*func)(void *), void **args, int n)
+{
+	int i;
+
+	for(i = 0; i < n; i++) {
+		func(args[i]);
+	}
+}
+
+#if HAVE_LIBPTHREAD
+/* Built-in pool. Threads are created on first use and wait for the next
+ * batch; thread i runs args[i]. Only one batch is in flight at a time, a
+ * caller that finds the pool busy runs its jobs by itself. */
+static pthread_mutex_t pool_busy = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_start = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t pool_done = PTHREAD_COND_INITIALIZER;
+static int pool_threads = 0;
+static unsigned long pool_generation = 0;
+static void (*pool_func)(void *);
+static void **pool_args;
+static int pool_count;
+static int pool_pending;
+
+static void *QRparallel_thread(void *arg)
+{
+	int index = (int)(intptr_t)arg;
+	unsigned long seen = 0;
+	void (*func)(void *);
+	void *job;
+
+	pthread_mutex_lock(&pool_mutex);
+	for(;;) {
+		while(pool_generation == seen) {
+			pthread_cond_wait(&pool_start, &pool_mutex);
+		}
+		seen = pool_generation;
+		if(index >= pool_count) continue;
+
+		func = pool_func;
+		job = pool_args[index];
+		pthread_mutex_unlock(&pool_mutex);
+		func(job);
+		pthread_mutex_lock(&pool_mutex);
+		pool_pending--;
+		if(pool_pending == 0) {
+			pthread_cond_signal(&pool_done);
+		}
+	}
+
+	return NULL;
+}
+
+/* Called with pool_busy held. */
+static int QRparallel_spawn(int n)
+{
+	pthread_t thread;
+	pthread_attr_t attr;
+	int ret = 0;
+
+	if(pool_threads >= n - 1) return 0;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_mutex_lock(&pool_mutex);
+	while(pool_threads < n - 1) {
+		if(pthread_create(&thread, &attr, QRparallel_thread, (void *)(intptr_t)(pool_threads + 1)) != 0) {
+			ret = -1;
+			break;
+		}
+		pool_threads++;
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	pthread_attr_destroy(&attr);
+
+	return ret;
+}
+
+static void QRparallel_runPool(void (*func)(void *), void **args, int n)
+{
+	if(pthread_mutex_trylock(&pool_busy) != 0) {
+		QRparallel_runSerial(func, args, n);
+		return;
+	}
+	if(QRparallel_spawn(n) < 0) {
+		pthread_mutex_unlock(&pool_busy);
+		QRparallel_runSerial(func, args, n);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_mutex);
+	pool_func = func;
+	pool_args = args;
+	pool_count = n;
+	pool_pending = n - 1;
+	pool_generation++;
+	pthread_cond_broadcast(&pool_start);
+	pthread_mutex_unlock(&pool_mutex);
+
+	func(args[0]);
+
+	pthread_mutex_lock(&pool_mutex);
+	while(pool_pending > 0) {
+		pthread_cond_wait(&pool_done, &pool_mutex);
+	}
+	pthread_mutex_unlock(&pool_mutex);
+	pthread_mutex_unlock(&pool_busy);
+}
+#endif
+
+void QRparallel_run(void (*func)(void *), void **args, int n)
+{
+	if(n <= 1) {
+		QRparallel_runSerial(func, args, n);
+	} else if(runner != NULL) {
+		runner(func, args, n, runnerData);
+	} else {
+#if HAVE_LIBPTHREAD
+		QRparallel_runPool(func, args, n);
+#else
+		QRparallel_runSerial(func, args, n);
+#endif
+	}
+}
@@ -0,0 +1,39 @@
+/*
+ * qrencode - QR Code encoder
+ *
+ * Job runner for the parallel mask search.
+ * Copyright (C) 2026 The QRClock2 authors
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef QRPARALLEL_H
+#define QRPARALLEL_H
+
+#define QRPARALLEL_MAX_WORKERS 8
+
+/**
+ * Number of jobs the mask search of a symbol of the given width should be
+ * split into. 1 means serial.
+ */
+extern int QRparallel_workers(int width);
+
+/**
+ * Call func(args[i]) for every i in [0, n) and return when all of them have
+ * finished. args[0] runs on the calling thread.
+ */
+extern void QRparallel_run(void (*func)(void *), void **args, int n);
+
+#endif /* QRPARALLEL_H */
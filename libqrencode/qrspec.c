@@ -31,10 +31,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <errno.h>
+#if HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 #include "qrspec.h"
 #include "qrinput.h"
+#include "qralloc.h"
 
 /******************************************************************************
  * Version and capacity
@@ -431,7 +436,7 @@ static unsigned char *QRspec_createFrame(int version)
 	unsigned int verinfo, v;
 
 	width = qrspecCapacity[version].width;
-	frame = (unsigned char *)malloc((size_t)(width * width));
+	frame = (unsigned char *)QRalloc_malloc((size_t)(width * width));
 	if(frame == NULL) return NULL;
 
 	memset(frame, 0, (size_t)(width * width));
@@ -506,9 +511,247 @@ static unsigned char *QRspec_createFrame(int version)
 	return frame;
 }
 
-unsigned char *QRspec_newFrame(int version)
+/******************************************************************************
+ * Frame cache
+ *****************************************************************************/
+
+/* Each entry holds the template of a version followed by its placement map.
+ * Entries live on the heap, or in the buffer given to QRspec_setFrameCache();
+ * never in the arena of the encoding. The versions used least recently are
+ * dropped to stay within the limit, except those whose placement map is in
+ * use. */
+typedef struct {
+	unsigned char *frame;
+	unsigned int stamp;
+	int users;	///< placement maps handed out and not released yet
+} FrameCache;
+
+static FrameCache frames[QRSPEC_VERSION_MAX + 1];
+static unsigned char *cacheBuffer = NULL;
+static size_t cacheLimit = (size_t)-1;
+static size_t cacheUsed = 0;
+static unsigned int cacheClock = 0;
+#if HAVE_LIBPTHREAD
+static pthread_mutex_t frames_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+#define FRAME_SIZE(__version__) ((size_t)(qrspecCapacity[__version__].width * qrspecCapacity[__version__].width))
+#define PLACEMENT_LENGTH(__version__) ((size_t)(qrspecCapacity[__version__].words * 8 + qrspecCapacity[__version__].remainder))
+#define PLACEMENT_OFFSET(__version__) ((FRAME_SIZE(__version__) + 1) & ~(size_t)1)
+#define ENTRY_SIZE(__version__) (PLACEMENT_OFFSET(__version__) + PLACEMENT_LENGTH(__version__) * sizeof(unsigned short))
+
+/* Module offsets of the data modules in the order of the bits: pairs of
+ * columns from the right, zig-zagging up and down, skipping the vertical
+ * timing pattern. */
+static void QRspec_createPlacement(int version, const unsigned char *frame, unsigned short *placement)
 {
+	int width = qrspecCapacity[version].width;
+	int x, y, i, up = 1;
+
+	for(x = width - 1; x > 0; x -= 2) {
+		if(x == 6) x--;
+		for(i = 0; i < width; i++) {
+			y = up ? width - 1 - i : i;
+			if(!(frame[y * width + x] & 0x80)) {
+				*placement++ = (unsigned short)(y * width + x);
+			}
+			if(!(frame[y * width + x - 1] & 0x80)) {
+				*placement++ = (unsigned short)(y * width + x - 1);
+			}
+		}
+		up = !up;
+	}
+}
+
+static void QRspec_dropFrame(int version)
+{
+	if(cacheBuffer == NULL) {
+		free(frames[version].frame);
+	}
+	frames[version].frame = NULL;
+	cacheUsed -= ENTRY_SIZE(version);
+}
+
+static int QRspec_leastRecentFrame(void)
+{
+	int i, oldest = 0;
+
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		if(frames[i].frame == NULL || frames[i].users > 0) continue;
+		if(oldest == 0 || frames[i].stamp < frames[oldest].stamp) {
+			oldest = i;
+		}
+	}
+
+	return oldest;
+}
+
+/* First gap of the buffer that holds size bytes, or NULL. */
+static unsigned char *QRspec_findGap(size_t size)
+{
+	unsigned char *p = cacheBuffer;
+	unsigned char *next;
+	int i, found;
+
+	for(;;) {
+		if(p + size > cacheBuffer + cacheLimit) return NULL;
+		found = 1;
+		next = p;
+		for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+			if(frames[i].frame == NULL) continue;
+			if(frames[i].frame < p + size && frames[i].frame + ENTRY_SIZE(i) > p) {
+				found = 0;
+				if(frames[i].frame + ENTRY_SIZE(i) > next) {
+					next = frames[i].frame + ENTRY_SIZE(i);
+				}
+			}
+		}
+		if(found) return p;
+		p = next;
+	}
+}
+
+/* Called with frames_mutex held. Returns 0 if the frame was not cached. */
+static int QRspec_storeFrame(int version, const unsigned char *frame)
+{
+	size_t size = ENTRY_SIZE(version);
+	unsigned char *p = NULL;
+	int oldest;
+
+	if(size > cacheLimit) return 0;
+
+	for(;;) {
+		if(cacheBuffer != NULL) {
+			p = QRspec_findGap(size);
+			if(p != NULL) break;
+		} else if(cacheUsed + size <= cacheLimit) {
+			p = (unsigned char *)malloc(size);
+			break;
+		}
+		oldest = QRspec_leastRecentFrame();
+		if(oldest == 0) break;
+		QRspec_dropFrame(oldest);
+	}
+	if(p == NULL) return 0;
+
+	memcpy(p, frame, FRAME_SIZE(version));
+	QRspec_createPlacement(version, frame, (unsigned short *)(p + PLACEMENT_OFFSET(version)));
+	frames[version].frame = p;
+	frames[version].stamp = ++cacheClock;
+	frames[version].users = 0;
+	cacheUsed += size;
+
+	return 1;
+}
+
+unsigned char *QRspec_newFramePlacement(int version, const unsigned short **placement)
+{
+	unsigned char *frame;
+	size_t size;
+	int cached;
+
+	if(placement != NULL) *placement = NULL;
 	if(version < 1 || version > QRSPEC_VERSION_MAX) return NULL;
 
-	return QRspec_createFrame(version);
+	size = FRAME_SIZE(version);
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&frames_mutex);
+#endif
+	if(frames[version].frame != NULL) {
+		frame = (unsigned char *)QRalloc_malloc(size);
+		if(frame != NULL) {
+			memcpy(frame, frames[version].frame, size);
+			frames[version].stamp = ++cacheClock;
+		}
+		cached = 1;
+	} else {
+		frame = QRspec_createFrame(version);
+		cached = frame != NULL && QRspec_storeFrame(version, frame);
+	}
+	if(frame != NULL && cached && placement != NULL) {
+		*placement = (const unsigned short *)(frames[version].frame + PLACEMENT_OFFSET(version));
+		frames[version].users++;
+	}
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&frames_mutex);
+#endif
+
+	return frame;
+}
+
+unsigned char *QRspec_newFrame(int version)
+{
+	return QRspec_newFramePlacement(version, NULL);
+}
+
+void QRspec_releasePlacement(int version)
+{
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&frames_mutex);
+#endif
+	frames[version].users--;
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&frames_mutex);
+#endif
+}
+
+size_t QRspec_frameCacheSize(int version)
+{
+	if(version < 1 || version > QRSPEC_VERSION_MAX) return 0;
+
+	/* and the alignment of a caller's buffer */
+	return ENTRY_SIZE(version) + 1;
+}
+
+void QRspec_clearCache(void)
+{
+	int i;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&frames_mutex);
+#endif
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		if(frames[i].frame != NULL && frames[i].users == 0) {
+			QRspec_dropFrame(i);
+		}
+	}
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&frames_mutex);
+#endif
+}
+
+int QRspec_setFrameCache(void *buffer, size_t limit)
+{
+	int i;
+
+#if HAVE_LIBPTHREAD
+	pthread_mutex_lock(&frames_mutex);
+#endif
+	/* A pinned entry must be dropped the way it was allocated. */
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		if(frames[i].frame != NULL && frames[i].users > 0) {
+#if HAVE_LIBPTHREAD
+			pthread_mutex_unlock(&frames_mutex);
+#endif
+			errno = EBUSY;
+			return -1;
+		}
+	}
+	for(i = 1; i <= QRSPEC_VERSION_MAX; i++) {
+		if(frames[i].frame != NULL) {
+			QRspec_dropFrame(i);
+		}
+	}
+	/* placement maps are arrays of unsigned short */
+	if(buffer != NULL && ((uintptr_t)buffer & 1) && limit > 0) {
+		buffer = (unsigned char *)buffer + 1;
+		limit--;
+	}
+	cacheBuffer = (unsigned char *)buffer;
+	cacheLimit = limit;
+#if HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&frames_mutex);
+#endif
+
+	return 0;
 }
@@ -148,12 +148,40 @@ extern unsigned int QRspec_getFormatInfo(int mask, QRecLevel level);
  *****************************************************************************/
 
 /**
- * Return a copy of initialized frame.
+ * Return a copy of initialized frame. The template of each version is built
+ * once and kept in the frame cache.
  * @param version version of the symbol
- * @return Array of unsigned char. You can free it by free().
+ * @return Array of unsigned char. You can free it by QRalloc_free().
  */
 extern unsigned char *QRspec_newFrame(int version);
 
+/**
+ * Same to QRspec_newFrame(), and also return the placement map of the version:
+ * the module offset of every data bit in the order they are placed, i.e. the
+ * interleaved data and ecc codewords followed by the remainder bits. The map
+ * belongs to the frame cache and stays valid until QRspec_releasePlacement()
+ * is called. *placement is NULL if the cache could not keep the version.
+ */
+extern unsigned char *QRspec_newFramePlacement(int version, const unsigned short **placement);
+extern void QRspec_releasePlacement(int version);
+
+/**
+ * Bytes of the frame cache taken by a version.
+ */
+extern size_t QRspec_frameCacheSize(int version);
+
+/**
+ * Release the frame cache.
+ */
+extern void QRspec_clearCache(void);
+
+/**
+ * Keep the frame cache within limit bytes. If buffer is not NULL, templates
+ * are stored in it (limit is its size) instead of the heap. Clears the cache.
+ * Fails with EBUSY while a placement map is in use.
+ */
+extern int QRspec_setFrameCache(void *buffer, size_t limit);
+
 /******************************************************************************
  * Mode indicator
  *****************************************************************************/
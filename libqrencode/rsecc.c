@@ -28,122 +28,436 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
-#if HAVE_LIBPTHREAD
-#include <pthread.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
 #endif
 
 #include "rsecc.h"
-
-#if HAVE_LIBPTHREAD
-static pthread_mutex_t RSECC_mutex = PTHREAD_MUTEX_INITIALIZER;
+#include "qralloc.h"
+#ifdef WITH_TESTS
+#include "qrspec.h"
 #endif
 
-static int initialized = 0;
-
-#define SYMBOL_SIZE (8)
-#define symbols ((1U << SYMBOL_SIZE) - 1)
-static const unsigned int proot = 0x11d; /* stands for x^8+x^4+x^3+x^2+1 (see pp.37 of JIS X0510:2004) */
-
 /* min/max codeword length of ECC, calculated from the specification. */
 #define min_length (2)
 #define max_length (30)
-#define max_generatorSize (max_length)
 
-static unsigned char alpha[symbols + 1];
-static unsigned char aindex[symbols + 1];
-static unsigned char generator[max_length - min_length + 1][max_generatorSize + 1];
-static unsigned char generatorInitialized[max_length - min_length + 1];
+/*
+ * The tables below are generated from the primitive polynomial 0x11d
+ * (x^8+x^4+x^3+x^2+1, see pp.37 of JIS X0510:2004). They are constant, so
+ * the encoder needs no initialization and can be called from any thread.
+ */
+
+/* alpha^i for i = 0..509, so that a sum of two logs needs no modulo. The
+ * tail is zero and the log of zero points into it, so that a product with
+ * zero needs no branch. */
+static const unsigned char RSECC_exp[768] = {
+	0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26,
+	0x4c, 0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0,
+	0x9d, 0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23,
+	0x46, 0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1,
+	0x5f, 0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0,
+	0xfd, 0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2,
+	0xd9, 0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce,
+	0x81, 0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc,
+	0x85, 0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54,
+	0xa8, 0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73,
+	0xe6, 0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff,
+	0xe3, 0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41,
+	0x82, 0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6,
+	0x51, 0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09,
+	0x12, 0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16,
+	0x2c, 0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x01,
+	0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1d, 0x3a, 0x74, 0xe8, 0xcd, 0x87, 0x13, 0x26, 0x4c,
+	0x98, 0x2d, 0x5a, 0xb4, 0x75, 0xea, 0xc9, 0x8f, 0x03, 0x06, 0x0c, 0x18, 0x30, 0x60, 0xc0, 0x9d,
+	0x27, 0x4e, 0x9c, 0x25, 0x4a, 0x94, 0x35, 0x6a, 0xd4, 0xb5, 0x77, 0xee, 0xc1, 0x9f, 0x23, 0x46,
+	0x8c, 0x05, 0x0a, 0x14, 0x28, 0x50, 0xa0, 0x5d, 0xba, 0x69, 0xd2, 0xb9, 0x6f, 0xde, 0xa1, 0x5f,
+	0xbe, 0x61, 0xc2, 0x99, 0x2f, 0x5e, 0xbc, 0x65, 0xca, 0x89, 0x0f, 0x1e, 0x3c, 0x78, 0xf0, 0xfd,
+	0xe7, 0xd3, 0xbb, 0x6b, 0xd6, 0xb1, 0x7f, 0xfe, 0xe1, 0xdf, 0xa3, 0x5b, 0xb6, 0x71, 0xe2, 0xd9,
+	0xaf, 0x43, 0x86, 0x11, 0x22, 0x44, 0x88, 0x0d, 0x1a, 0x34, 0x68, 0xd0, 0xbd, 0x67, 0xce, 0x81,
+	0x1f, 0x3e, 0x7c, 0xf8, 0xed, 0xc7, 0x93, 0x3b, 0x76, 0xec, 0xc5, 0x97, 0x33, 0x66, 0xcc, 0x85,
+	0x17, 0x2e, 0x5c, 0xb8, 0x6d, 0xda, 0xa9, 0x4f, 0x9e, 0x21, 0x42, 0x84, 0x15, 0x2a, 0x54, 0xa8,
+	0x4d, 0x9a, 0x29, 0x52, 0xa4, 0x55, 0xaa, 0x49, 0x92, 0x39, 0x72, 0xe4, 0xd5, 0xb7, 0x73, 0xe6,
+	0xd1, 0xbf, 0x63, 0xc6, 0x91, 0x3f, 0x7e, 0xfc, 0xe5, 0xd7, 0xb3, 0x7b, 0xf6, 0xf1, 0xff, 0xe3,
+	0xdb, 0xab, 0x4b, 0x96, 0x31, 0x62, 0xc4, 0x95, 0x37, 0x6e, 0xdc, 0xa5, 0x57, 0xae, 0x41, 0x82,
+	0x19, 0x32, 0x64, 0xc8, 0x8d, 0x07, 0x0e, 0x1c, 0x38, 0x70, 0xe0, 0xdd, 0xa7, 0x53, 0xa6, 0x51,
+	0xa2, 0x59, 0xb2, 0x79, 0xf2, 0xf9, 0xef, 0xc3, 0x9b, 0x2b, 0x56, 0xac, 0x45, 0x8a, 0x09, 0x12,
+	0x24, 0x48, 0x90, 0x3d, 0x7a, 0xf4, 0xf5, 0xf7, 0xf3, 0xfb, 0xeb, 0xcb, 0x8b, 0x0b, 0x16, 0x2c,
+	0x58, 0xb0, 0x7d, 0xfa, 0xe9, 0xcf, 0x83, 0x1b, 0x36, 0x6c, 0xd8, 0xad, 0x47, 0x8e, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
 
-static void RSECC_initLookupTable(void)
+/* log(alpha^i) = i, and log(0) = 510 points into the zero tail above. */
+static const unsigned short RSECC_log[256] = {
+	510,   0,   1,  25,   2,  50,  26, 198,   3, 223,  51, 238,  27, 104, 199,  75,
+	  4, 100, 224,  14,  52, 141, 239, 129,  28, 193, 105, 248, 200,   8,  76, 113,
+	  5, 138, 101,  47, 225,  36,  15,  33,  53, 147, 142, 218, 240,  18, 130,  69,
+	 29, 181, 194, 125, 106,  39, 249, 185, 201, 154,   9, 120,  77, 228, 114, 166,
+	  6, 191, 139,  98, 102, 221,  48, 253, 226, 152,  37, 179,  16, 145,  34, 136,
+	 54, 208, 148, 206, 143, 150, 219, 189, 241, 210,  19,  92, 131,  56,  70,  64,
+	 30,  66, 182, 163, 195,  72, 126, 110, 107,  58,  40,  84, 250, 133, 186,  61,
+	202,  94, 155, 159,  10,  21, 121,  43,  78, 212, 229, 172, 115, 243, 167,  87,
+	  7, 112, 192, 247, 140, 128,  99,  13, 103,  74, 222, 237,  49, 197, 254,  24,
+	227, 165, 153, 119,  38, 184, 180, 124,  17,  68, 146, 217,  35,  32, 137,  46,
+	 55,  63, 209,  91, 149, 188, 207, 205, 144, 135, 151, 178, 220, 252, 190,  97,
+	242,  86, 211, 171,  20,  42,  93, 158, 132,  60,  57,  83,  71, 109,  65, 162,
+	 31,  45,  67, 216, 183, 123, 164, 118, 196,  23,  73, 236, 127,  12, 111, 246,
+	108, 161,  59,  82,  41, 157,  85, 170, 251,  96, 134, 177, 187, 204,  62,  90,
+	203,  89,  95, 176, 156, 169, 160,  81,  11, 245,  22, 235, 122, 117,  44, 215,
+	 79, 174, 213, 233, 230, 231, 173, 232, 116, 214, 244, 234, 168,  80,  88, 175
+};
+
+/* Logs of the coefficients of the generator polynomials, lowest degree
+ * first, for each ECC length from min_length to max_length. */
+static const unsigned char RSECC_generator[] = {
+	/*  2 */   1,  25,   0,
+	/*  3 */   3, 199, 198,   0,
+	/*  4 */   6,  78, 249,  75,   0,
+	/*  5 */  10, 119, 166, 164, 113,   0,
+	/*  6 */  15, 176,   5, 134,   0, 166,   0,
+	/*  7 */  21, 102, 238, 149, 146, 229,  87,   0,
+	/*  8 */  28, 196, 252, 215, 249, 208, 238, 175,   0,
+	/*  9 */  36, 123,  11, 149, 235, 231, 137, 246,  95,   0,
+	/* 10 */  45,  32,  94,  64,  70, 118,  61,  46,  67, 251,   0,
+	/* 11 */  55,  10, 227, 116, 209, 177, 172, 194,  91, 192, 220,   0,
+	/* 12 */  66, 157,  87, 131, 143, 198, 113, 187, 121,  98,  43, 102,   0,
+	/* 13 */  78, 140, 206, 218, 130, 104, 106, 100,  86, 100, 176, 152,  74,   0,
+	/* 14 */  91,  22,  59, 207,  87, 216, 137, 218, 124, 190,  48, 155, 249, 199,   0,
+	/* 15 */ 105,  99,   5, 124, 140, 237,  58,  58,  51,  37, 202,  91,  61, 183,   8,   0,
+	/* 16 */ 120, 225, 194, 182, 169, 147, 191,  91,   3,  76, 161, 102, 109, 107, 104, 120,
+	           0,
+	/* 17 */ 136, 163, 243,  39, 150,  99,  24, 147, 214, 206, 123, 239,  43,  78, 206, 139,
+	          43,   0,
+	/* 18 */ 153,  96,  98,   5, 179, 252, 148, 152, 187,  79, 170, 118,  97, 184,  94, 158,
+	         234, 215,   0,
+	/* 19 */ 171, 220, 138, 222, 252, 133, 153, 128,  44, 159, 150,  17,  83,  90,  52, 153,
+	         105,   3,  67,   0,
+	/* 20 */ 190, 188, 212, 212, 164, 156, 239,  83, 225, 221, 180, 202, 187,  26, 163,  61,
+	          50,  79,  60,  17,   0,
+	/* 21 */ 210, 175, 148, 254, 122,  36, 230, 137, 148, 115, 210, 200,  85,  98,  67, 140,
+	         181, 247, 104, 233, 240,   0,
+	/* 22 */ 231, 165, 105, 160, 134, 219,  80,  98, 172,   8,  74, 200,  53, 221, 109,  14,
+	         230,  93, 242, 247, 171, 210,   0,
+	/* 23 */ 253, 147,  56,  78,   1, 192, 224, 164,  94, 248, 183,  25,  14, 150, 193,  17,
+	          65, 103,  49,  91, 146, 102, 171,   0,
+	/* 24 */  21, 227,  96,  87, 232, 117,   0, 111, 218, 228, 226, 192, 152, 169, 180, 159,
+	         126, 251, 117, 211,  48, 135, 121, 229,   0,
+	/* 25 */  45, 252, 178, 129, 243,  95, 182, 144, 167,  99, 208, 237,  66,  54, 201, 148,
+	          15,  59,  12,  26, 170,  39, 156, 181, 231,   0,
+	/* 26 */  70, 218, 145, 153, 227,  48, 102,  13, 142, 245,  21, 161,  53, 165,  28, 111,
+	         201, 145,  17, 118, 182, 103,   2, 158, 125, 173,   0,
+	/* 27 */  96, 149,  17,  26, 157, 193, 216,  94, 172, 126,  73, 135, 138,  58,  45,  99,
+	          70, 237,   9,  29, 180,  21, 227, 165,   8, 228,  79,   0,
+	/* 28 */ 123,   9,  37, 242, 119, 212, 195,  42,  87, 245,  43,  21, 201, 232,  27, 205,
+	         147, 195, 190, 110, 180, 108, 234, 224, 104, 200, 223, 168,   0,
+	/* 29 */ 151,  24, 140, 250,  68, 162, 202,   9,  23, 148, 150, 234,  75,  28, 189, 175,
+	         241,   5, 136,  24, 249,  96,  54, 219, 151,  29, 183,  45, 156,   0,
+	/* 30 */ 180, 192,  40, 238, 216, 251,  37, 156, 130, 224, 193, 226, 173,  42, 125, 222,
+	          96, 239,  86, 110,  48,  50, 182, 179,  31, 216, 152, 145, 173,  41,   0
+};
+
+#define GENERATOR(__length__) (RSECC_generator + (__length__) * ((__length__) + 1) / 2 - 3)
+
+int RSECC_encode(size_t data_length, size_t ecc_length, const unsigned char *data, unsigned char *ecc)
 {
-	unsigned int i, b;
+	size_t i, j;
+	unsigned int feedback;
+	const unsigned char *gen;
 
-	alpha[symbols] = 0;
-	aindex[0] = symbols;
+	if(ecc_length < min_length || ecc_length > max_length) return -1;
 
-	b = 1;
-	for(i = 0; i < symbols; i++) {
-		alpha[i] = b;
-		aindex[b] = i;
-		b <<= 1;
-		if(b & (symbols + 1)) {
-			b ^= proot;
+	gen = GENERATOR(ecc_length);
+	memset(ecc, 0, ecc_length);
+	for(i = 0; i < data_length; i++) {
+		feedback = RSECC_log[data[i] ^ ecc[0]];
+		for(j = 0; j < ecc_length - 1; j++) {
+			ecc[j] = ecc[j + 1] ^ RSECC_exp[feedback + gen[ecc_length - 1 - j]];
 		}
-		b &= symbols;
+		ecc[ecc_length - 1] = RSECC_exp[feedback + gen[0]];
 	}
+
+	return 0;
 }
 
-static void RSECC_init(void)
+/******************************************************************************
+ * Lockstep encoder
+ *****************************************************************************/
+
+/*
+ * All blocks of a symbol share one generator, so their shift registers are
+ * kept side by side: row k of the register holds the k-th ECC codeword of
+ * every block (a lane per block), and each step shifts all lanes at once.
+ * With vectors, the lane count is padded to LANE_ALIGN so that the rows
+ * are processed without a tail.
+ */
+#if defined(__SSSE3__)
+#define LANE_ALIGN (16)
+#else
+#define LANE_ALIGN (1)
+#endif
+
+#if defined(__SSSE3__)
+/* The product of a byte and a fixed coefficient is the sum of the products
+ * of its two nibbles, each looked up from a 16-byte table by a shuffle. */
+static void RSECC_initNibbleTables(size_t ecc_length, const unsigned char *gen, unsigned char tables[][32])
 {
-	RSECC_initLookupTable();
-	memset(generatorInitialized, 0, (max_length - min_length + 1));
-	initialized = 1;
+	size_t k;
+	unsigned int g, x;
+
+	for(k = 0; k < ecc_length; k++) {
+		g = gen[ecc_length - 1 - k];
+		for(x = 0; x < 16; x++) {
+			tables[k][x] = RSECC_exp[RSECC_log[x] + g];
+			tables[k][x + 16] = RSECC_exp[RSECC_log[x << 4] + g];
+		}
+	}
 }
 
-static void generator_init(size_t length)
+static void RSECC_shiftLanes(size_t lanes, size_t ecc_length, unsigned char tables[][32], const unsigned char *feedback, unsigned char *reg)
 {
-	size_t i, j;
-	int g[max_generatorSize + 1];
+	size_t b, k;
+	__m128i f, lo, hi, p, nibble;
+	unsigned char *row;
 
-	g[0] = 1;
-	for(i = 0; i < length; i++) {
-		g[i + 1] = 1;
-		/* Because g[0] never be zero, skipped some conditional checks. */
-		for(j = i; j > 0; j--) {
-			g[j] = g[j - 1] ^  alpha[(aindex[g[j]] + i) % symbols];
+	nibble = _mm_set1_epi8(0x0f);
+	for(b = 0; b < lanes; b += 16) {
+		f = _mm_loadu_si128((const __m128i *)(feedback + b));
+		lo = _mm_and_si128(f, nibble);
+		hi = _mm_and_si128(_mm_srli_epi16(f, 4), nibble);
+		row = reg + b;
+		for(k = 0; k < ecc_length; k++) {
+			p = _mm_xor_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)tables[k]), lo),
+			                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(tables[k] + 16)), hi));
+			p = _mm_xor_si128(p, _mm_loadu_si128((const __m128i *)(row + lanes)));
+			_mm_storeu_si128((__m128i *)row, p);
+			row += lanes;
 		}
-		g[0] = alpha[(aindex[g[0]] + i) % symbols];
 	}
+}
+#else
+static void RSECC_shiftLanes(size_t lanes, size_t ecc_length, const unsigned char *gen, const unsigned char *feedback, unsigned short *logs, unsigned char *reg)
+{
+	size_t b, k;
+	unsigned int g;
+	unsigned char *row;
 
-	for(i = 0; i <= length; i++) {
-		generator[length - min_length][i] = aindex[g[i]];
+	for(b = 0; b < lanes; b++) {
+		logs[b] = RSECC_log[feedback[b]];
 	}
+	row = reg;
+	for(k = 0; k < ecc_length; k++) {
+		g = gen[ecc_length - 1 - k];
+		for(b = 0; b < lanes; b++) {
+			row[b] = row[b + lanes] ^ RSECC_exp[logs[b] + g];
+		}
+		row += lanes;
+	}
+}
+#endif
+
+int RSECC_encodeBlocks(int blocks1, size_t data_length1, int blocks2, size_t data_length2, size_t ecc_length, const unsigned char *data, unsigned char *ecc)
+{
+	size_t blocks, lanes, steps, length, skip, i, k, b;
+	const unsigned char *gen, *dp;
+	unsigned char *work, *reg, *feedback;
+#if defined(__SSSE3__)
+	unsigned char tables[max_length][32];
+#else
+	unsigned short *logs;
+#endif
+
+	if(ecc_length < min_length || ecc_length > max_length) return -1;
+	if(blocks1 < 0 || blocks2 < 0) return -1;
+
+	blocks = (size_t)blocks1 + (size_t)blocks2;
+	if(blocks == 0) return 0;
+	lanes = (blocks + LANE_ALIGN - 1) / LANE_ALIGN * LANE_ALIGN;
+	steps = (blocks2 > 0 && data_length2 > data_length1) ? data_length2 : data_length1;
 
-	generatorInitialized[length - min_length] = 1;
+	/* logs (scalar build only), register rows 0..ecc_length and the
+	 * feedback row. Row ecc_length stays zero: it is shifted into the last
+	 * codeword. */
+	work = (unsigned char *)QRalloc_calloc(lanes, ecc_length + 4);
+	if(work == NULL) return -1;
+#if defined(__SSSE3__)
+	reg = work;
+#else
+	logs = (unsigned short *)work;
+	reg = work + lanes * 2;
+#endif
+	feedback = reg + lanes * (ecc_length + 1);
+
+	gen = GENERATOR(ecc_length);
+#if defined(__SSSE3__)
+	RSECC_initNibbleTables(ecc_length, gen, tables);
+#endif
+
+	/* A shorter block starts later: leading zeros do not change the
+	 * remainder, so every lane takes the same number of steps. */
+	for(i = 0; i < steps; i++) {
+		dp = data;
+		for(b = 0; b < blocks; b++) {
+			length = (b < (size_t)blocks1) ? data_length1 : data_length2;
+			skip = steps - length;
+			feedback[b] = reg[b] ^ ((i < skip) ? 0 : dp[i - skip]);
+			dp += length;
+		}
+#if defined(__SSSE3__)
+		RSECC_shiftLanes(lanes, ecc_length, tables, feedback, reg);
+#else
+		RSECC_shiftLanes(lanes, ecc_length, gen, feedback, logs, reg);
+#endif
+	}
+
+	for(b = 0; b < blocks; b++) {
+		for(k = 0; k < ecc_length; k++) {
+			ecc[b * ecc_length + k] = reg[k * lanes + b];
+		}
+	}
+	QRalloc_free(work);
+
+	return 0;
 }
 
-int RSECC_encode(size_t data_length, size_t ecc_length, const unsigned char *data, unsigned char *ecc)
+#ifdef WITH_TESTS
+/*
+ * Reference encoder for the tests below: the previous byte-serial encoder,
+ * which builds the tables and the generator at run time with the modulo
+ * and the zero-feedback branch.
+ */
+STATIC_IN_RELEASE int RSECC_encodeReference(size_t data_length, size_t ecc_length, const unsigned char *data, unsigned char *ecc)
 {
+	unsigned char alpha[256], aindex[256], gen[max_length + 1];
+	int g[max_length + 1];
+	unsigned int b, feedback;
 	size_t i, j;
-	unsigned char feedback;
-	unsigned char *gen;
 
-#if HAVE_LIBPTHREAD
-	pthread_mutex_lock(&RSECC_mutex);
-#endif
-	if(!initialized) {
-		RSECC_init();
+	if(ecc_length < min_length || ecc_length > max_length) return -1;
+
+	alpha[255] = 0;
+	aindex[0] = 255;
+	b = 1;
+	for(i = 0; i < 255; i++) {
+		alpha[i] = (unsigned char)b;
+		aindex[b] = (unsigned char)i;
+		b <<= 1;
+		if(b & 0x100) b ^= 0x11d;
 	}
-#if HAVE_LIBPTHREAD
-	pthread_mutex_unlock(&RSECC_mutex);
-#endif
 
-	if(ecc_length > max_length) return -1;
+	g[0] = 1;
+	for(i = 0; i < ecc_length; i++) {
+		g[i + 1] = 1;
+		for(j = i; j > 0; j--) {
+			g[j] = g[j - 1] ^ alpha[(aindex[g[j]] + i) % 255];
+		}
+		g[0] = alpha[(aindex[g[0]] + i) % 255];
+	}
+	for(i = 0; i <= ecc_length; i++) {
+		gen[i] = aindex[g[i]];
+	}
 
 	memset(ecc, 0, ecc_length);
-#if HAVE_LIBPTHREAD
-	pthread_mutex_lock(&RSECC_mutex);
-#endif
-	if(!generatorInitialized[ecc_length - min_length]) generator_init(ecc_length);
-#if HAVE_LIBPTHREAD
-	pthread_mutex_unlock(&RSECC_mutex);
-#endif
-	gen = generator[ecc_length - min_length];
-
 	for(i = 0; i < data_length; i++) {
 		feedback = aindex[data[i] ^ ecc[0]];
-		if(feedback != symbols) {
+		if(feedback != 255) {
 			for(j = 1; j < ecc_length; j++) {
-				ecc[j] ^= alpha[(unsigned int)(feedback + gen[ecc_length - j]) % symbols];
+				ecc[j] ^= alpha[(feedback + gen[ecc_length - j]) % 255];
 			}
 		}
 		memmove(&ecc[0], &ecc[1], ecc_length - 1);
-		if(feedback != symbols) {
-			ecc[ecc_length - 1] = alpha[(unsigned int)(feedback + gen[0]) % symbols];
+		ecc[ecc_length - 1] = (feedback != 255) ? alpha[(feedback + gen[0]) % 255] : 0;
+	}
+
+	return 0;
+}
+
+static void RSECC_fillTestData(unsigned char *data, size_t length, int pattern, unsigned int *seed)
+{
+	size_t i;
+
+	for(i = 0; i < length; i++) {
+		if(pattern == 0) {
+			data[i] = 0;
+		} else if(pattern == 1) {
+			data[i] = 0xff;
 		} else {
-			ecc[ecc_length - 1] = 0;
+			*seed = *seed * 1103515245U + 12345U;
+			data[i] = (unsigned char)(*seed >> 16);
 		}
 	}
+}
 
-	return 0;
+/*
+ * Differential test of RSECC_encode() and RSECC_encodeBlocks() against
+ * RSECC_encodeReference(). RSECC_encode() is checked for every ECC length
+ * and data lengths up to 2 * max_length, RSECC_encodeBlocks() for the block
+ * layout of every version and level. Each case runs with all-zero,
+ * all-0xff and pseudo-random data.
+ * @return the number of mismatching cases, or -1 on allocation failure.
+ */
+int RSECC_test(void)
+{
+	unsigned char buf[max_length * 3], ref[max_length];
+	unsigned char *data, *ecc, *dp;
+	unsigned int seed = 1;
+	int spec[5];
+	int version, level, pattern, b, blocks, errors = 0;
+	size_t elen, dlen, length;
+
+	for(pattern = 0; pattern < 3; pattern++) {
+		for(elen = min_length; elen <= max_length; elen++) {
+			for(dlen = 1; dlen <= max_length * 2; dlen++) {
+				RSECC_fillTestData(buf, dlen, pattern, &seed);
+				RSECC_encodeReference(dlen, elen, buf, ref);
+				RSECC_encode(dlen, elen, buf, buf + dlen);
+				if(memcmp(buf + dlen, ref, elen) != 0) errors++;
+			}
+		}
+		for(version = 1; version <= QRSPEC_VERSION_MAX; version++) {
+			for(level = QR_ECLEVEL_L; level <= QR_ECLEVEL_H; level++) {
+				QRspec_getEccSpec(version, (QRecLevel)level, spec);
+				data = (unsigned char *)QRalloc_malloc((size_t)(QRspec_rsDataLength(spec) + QRspec_rsEccLength(spec)));
+				if(data == NULL) return -1;
+				ecc = data + QRspec_rsDataLength(spec);
+				RSECC_fillTestData(data, (size_t)QRspec_rsDataLength(spec), pattern, &seed);
+				if(RSECC_encodeBlocks(QRspec_rsBlockNum1(spec), (size_t)QRspec_rsDataCodes1(spec),
+				                      QRspec_rsBlockNum2(spec), (size_t)QRspec_rsDataCodes2(spec),
+				                      (size_t)QRspec_rsEccCodes1(spec), data, ecc) < 0) {
+					QRalloc_free(data);
+					return -1;
+				}
+				elen = (size_t)QRspec_rsEccCodes1(spec);
+				blocks = QRspec_rsBlockNum(spec);
+				dp = data;
+				for(b = 0; b < blocks; b++) {
+					length = (size_t)((b < QRspec_rsBlockNum1(spec)) ? QRspec_rsDataCodes1(spec) : QRspec_rsDataCodes2(spec));
+					RSECC_encodeReference(length, elen, dp, ref);
+					if(memcmp(ecc + (size_t)b * elen, ref, elen) != 0) {
+						errors++;
+						break;
+					}
+					dp += length;
+				}
+				QRalloc_free(data);
+			}
+		}
+	}
+
+	return errors;
 }
+#endif
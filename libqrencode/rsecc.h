@@ -28,4 +28,19 @@
 
 extern int RSECC_encode(size_t data_length, size_t ecc_length, const unsigned char *data, unsigned char *ecc);
 
+/**
+ * Encode the ECC codewords of all blocks of a symbol at once. The data
+ * blocks are stored in a row, blocks1 blocks of data_length1 followed by
+ * blocks2 blocks of data_length2, and the ECC blocks of ecc_length are
+ * written in the same order.
+ * @return 0 on success, or -1 on error. errno is set to ENOMEM if the
+ *         working registers cannot be allocated.
+ */
+extern int RSECC_encodeBlocks(int blocks1, size_t data_length1, int blocks2, size_t data_length2, size_t ecc_length, const unsigned char *data, unsigned char *ecc);
+
+#ifdef WITH_TESTS
+extern int RSECC_encodeReference(size_t data_length, size_t ecc_length, const unsigned char *data, unsigned char *ecc);
+extern int RSECC_test(void);
+#endif
+
 #endif /* RSECC_H */
@@ -31,10 +31,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include "qrencode.h"
 #include "qrinput.h"
 #include "qrspec.h"
+#include "mqrspec.h"
 #include "split.h"
+#include "qralloc.h"
 
 #define isdigit(__c__) ((unsigned char)((signed char)(__c__) - '0') < 10)
 #define isalnum(__c__) (QRinput_lookAnTable(__c__) >= 0)
@@ -44,7 +47,7 @@
 char *strdup(const char *s)
 {
 	size_t len = strlen(s) + 1;
-	void *newstring = malloc(len);
+	void *newstring = QRalloc_malloc(len);
 	if(newstring == NULL) return NULL;
 	return (char *)memcpy(newstring, s, len);
 }
@@ -75,203 +78,196 @@ static QRencodeMode Split_identifyMode(const char *string, QRencodeMode hint)
 	return QR_MODE_8;
 }
 
-static int Split_eatAn(const char *string, QRinput *input, QRencodeMode hint);
-static int Split_eat8(const char *string, QRinput *input, QRencodeMode hint);
-
-static int Split_eatNum(const char *string, QRinput *input,QRencodeMode hint)
-{
-	const char *p;
-	int ret;
-	int run;
-	int dif;
-	int ln;
-	QRencodeMode mode;
-
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
-
-	p = string;
-	while(isdigit(*p)) {
-		p++;
-	}
-	run = (int)(p - string);
-	mode = Split_identifyMode(p, hint);
-	if(mode == QR_MODE_8) {
-		dif = QRinput_estimateBitsModeNum(run) + 4 + ln
-			+ QRinput_estimateBitsMode8(1) /* + 4 + l8 */
-			- QRinput_estimateBitsMode8(run + 1) /* - 4 - l8 */;
-		if(dif > 0) {
-			return Split_eat8(string, input, hint);
-		}
-	}
-	if(mode == QR_MODE_AN) {
-		dif = QRinput_estimateBitsModeNum(run) + 4 + ln
-			+ QRinput_estimateBitsModeAn(1) /* + 4 + la */
-			- QRinput_estimateBitsModeAn(run + 1) /* - 4 - la */;
-		if(dif > 0) {
-			return Split_eatAn(string, input, hint);
-		}
-	}
-
-	ret = QRinput_append(input, QR_MODE_NUM, run, (unsigned char *)string);
-	if(ret < 0) return -1;
-
-	return run;
-}
-
-static int Split_eatAn(const char *string, QRinput *input, QRencodeMode hint)
+/* Costs are counted in 1/6 bits so that numeric (10/3 bits per digit) and
+ * alphanumeric (11/2 bits per character) runs can be extended one character
+ * at a time. A segment is rounded up to whole bits when it is closed. */
+#define SPLIT_MODES 4
+#define SPLIT_UNIT 6
+#define SPLIT_INF (INT_MAX / 4)
+#define SPLIT_CEIL(__c__) (((__c__) + SPLIT_UNIT - 1) / SPLIT_UNIT * SPLIT_UNIT)
+
+/**
+ * Set the cost of opening a segment of each mode (mode indicator and length
+ * indicator) for the given version. An unavailable mode gets -1. 8-bit mode
+ * is always available in QR Code, but not in M1 and M2.
+ */
+static void Split_initHeads(int head[SPLIT_MODES], int version, int mqr, QRencodeMode hint)
 {
-	const char *p, *q;
-	int ret;
-	int run;
-	int dif;
-	int la, ln;
-
-	la = QRspec_lengthIndicator(QR_MODE_AN, input->version);
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
-
-	p = string;
-	while(isalnum(*p)) {
-		if(isdigit(*p)) {
-			q = p;
-			while(isdigit(*q)) {
-				q++;
-			}
-			dif = QRinput_estimateBitsModeAn((int)(p - string)) /* + 4 + la */
-				+ QRinput_estimateBitsModeNum((int)(q - p)) + 4 + ln
-				+ (isalnum(*q)?(4 + ln):0)
-				- QRinput_estimateBitsModeAn((int)(q - string)) /* - 4 - la */;
-			if(dif < 0) {
-				break;
+	int mode, l;
+
+	for(mode = 0; mode < SPLIT_MODES; mode++) {
+		if(mode == QR_MODE_KANJI && hint != QR_MODE_KANJI) {
+			head[mode] = -1;
+		} else if(mqr) {
+			l = MQRspec_lengthIndicator((QRencodeMode)mode, version);
+			if(l == 0) {
+				head[mode] = -1;
+			} else {
+				head[mode] = (version - 1 + l) * SPLIT_UNIT;
 			}
-			p = q;
 		} else {
-			p++;
+			head[mode] = (4 + QRspec_lengthIndicator((QRencodeMode)mode, version)) * SPLIT_UNIT;
 		}
 	}
-
-	run = (int)(p - string);
-
-	if(*p && !isalnum(*p)) {
-		dif = QRinput_estimateBitsModeAn(run) + 4 + la
-			+ QRinput_estimateBitsMode8(1) /* + 4 + l8 */
-			- QRinput_estimateBitsMode8(run + 1) /* - 4 - l8 */;
-		if(dif > 0) {
-			return Split_eat8(string, input, hint);
-		}
-	}
-
-	ret = QRinput_append(input, QR_MODE_AN, run, (unsigned char *)string);
-	if(ret < 0) return -1;
-
-	return run;
 }
 
-static int Split_eatKanji(const char *string, QRinput *input, QRencodeMode hint)
+/* Cost of a character of each class in each mode, SPLIT_INF if the mode
+ * cannot carry it. A Kanji character takes two bytes in 8-bit mode. */
+#define SPLIT_DIGIT 0
+#define SPLIT_ALNUM 1
+#define SPLIT_BYTE  2
+#define SPLIT_KANJI 3
+static const int Split_charCosts[4][SPLIT_MODES] = {
+	{20, 33, 48, SPLIT_INF},
+	{SPLIT_INF, 33, 48, SPLIT_INF},
+	{SPLIT_INF, SPLIT_INF, 48, SPLIT_INF},
+	{SPLIT_INF, SPLIT_INF, 96, 78}
+};
+
+static int Split_charClass(const char *p, QRencodeMode hint)
 {
-	const char *p;
-	int ret;
-	int run;
-
-	p = string;
-	while(Split_identifyMode(p, hint) == QR_MODE_KANJI) {
-		p += 2;
-	}
-	run = (int)(p - string);
-	ret = QRinput_append(input, QR_MODE_KANJI, run, (unsigned char *)string);
-	if(ret < 0) return -1;
-
-	return run;
+	if(isdigit(*p)) return SPLIT_DIGIT;
+	if(isalnum(*p)) return SPLIT_ALNUM;
+	if(Split_identifyMode(p, hint) == QR_MODE_KANJI) return SPLIT_KANJI;
+	return SPLIT_BYTE;
 }
 
-static int Split_eat8(const char *string, QRinput *input, QRencodeMode hint)
+#define Split_classLength(__cls__) (((__cls__) == SPLIT_KANJI) ? 2 : 1)
+
+/**
+ * Find the segmentation of the fewest bits. For every character and every
+ * mode, the cheapest way to end there in that mode either continues the
+ * previous segment of the same mode or closes the cheapest segment and opens
+ * a new one. trace[k] keeps the mode of the preceding character of each of
+ * the four choices (2 bits each) and is rewritten to the chosen mode of
+ * character k.
+ * @return number of bits of the segmentation, or -1 if the available modes
+ *         cannot carry the string.
+ */
+static int Split_optimize(const char *string, int chars, const int head[SPLIT_MODES], QRencodeMode hint, unsigned char *trace)
 {
-	const char *p, *q;
-	QRencodeMode mode;
-	int ret;
-	int run;
-	int dif;
-	int la, ln, l8;
-	int swcost;
-
-	la = QRspec_lengthIndicator(QR_MODE_AN, input->version);
-	ln = QRspec_lengthIndicator(QR_MODE_NUM, input->version);
-	l8 = QRspec_lengthIndicator(QR_MODE_8, input->version);
+	int costs[4][SPLIT_MODES], heads[SPLIT_MODES];
+	int cost[SPLIT_MODES], next[SPLIT_MODES];
+	int k, m, pm, cls, c, sw, swm, stay, move;
+	unsigned char packed;
+	const char *p;
 
-	p = string + 1;
-	while(*p != '\0') {
-		mode = Split_identifyMode(p, hint);
-		if(mode == QR_MODE_KANJI) {
-			break;
+	for(m = 0; m < SPLIT_MODES; m++) {
+		heads[m] = (head[m] < 0) ? SPLIT_INF : head[m];
+		cost[m] = heads[m];
+		for(cls = 0; cls < 4; cls++) {
+			costs[cls][m] = (head[m] < 0) ? SPLIT_INF : Split_charCosts[cls][m];
 		}
-		if(mode == QR_MODE_NUM) {
-			q = p;
-			while(isdigit(*q)) {
-				q++;
-			}
-			if(Split_identifyMode(q, hint) == QR_MODE_8) {
-				swcost = 4 + l8;
-			} else {
-				swcost = 0;
-			}
-			dif = QRinput_estimateBitsMode8((int)(p - string)) /* + 4 + l8 */
-				+ QRinput_estimateBitsModeNum((int)(q - p)) + 4 + ln
-				+ swcost
-				- QRinput_estimateBitsMode8((int)(q - string)) /* - 4 - l8 */;
-			if(dif < 0) {
-				break;
-			}
-			p = q;
-		} else if(mode == QR_MODE_AN) {
-			q = p;
-			while(isalnum(*q)) {
-				q++;
+	}
+	p = string;
+	for(k = 0; k < chars; k++) {
+		cls = Split_charClass(p, hint);
+		sw = SPLIT_INF;
+		swm = QR_MODE_8;
+		for(pm = 0; pm < SPLIT_MODES; pm++) {
+			c = SPLIT_CEIL(cost[pm]);
+			if(c < sw) {
+				sw = c;
+				swm = pm;
 			}
-			if(Split_identifyMode(q, hint) == QR_MODE_8) {
-				swcost = 4 + l8;
+		}
+		packed = 0;
+		/* Unreachable states saturate at SPLIT_INF. */
+		for(m = 0; m < SPLIT_MODES; m++) {
+			c = costs[cls][m];
+			stay = cost[m] + c;
+			move = sw + heads[m] + c;
+			if(move < stay) {
+				next[m] = (move < SPLIT_INF) ? move : SPLIT_INF;
+				packed |= (unsigned char)(swm << (m * 2));
 			} else {
-				swcost = 0;
-			}
-			dif = QRinput_estimateBitsMode8((int)(p - string)) /* + 4 + l8 */
-				+ QRinput_estimateBitsModeAn((int)(q - p)) + 4 + la
-				+ swcost
-				- QRinput_estimateBitsMode8((int)(q - string)) /* - 4 - l8 */;
-			if(dif < 0) {
-				break;
+				next[m] = (stay < SPLIT_INF) ? stay : SPLIT_INF;
+				packed |= (unsigned char)(m << (m * 2));
 			}
-			p = q;
-		} else {
-			p++;
 		}
+		trace[k] = packed;
+		memcpy(cost, next, sizeof(cost));
+		p += Split_classLength(cls);
 	}
 
-	run = (int)(p - string);
-	ret = QRinput_append(input, QR_MODE_8, run, (unsigned char *)string);
-	if(ret < 0) return -1;
+	/* 8-bit mode wins a tie, but only a reachable state can win. */
+	m = (cost[QR_MODE_8] < SPLIT_INF) ? QR_MODE_8 : -1;
+	for(pm = 0; pm < SPLIT_MODES; pm++) {
+		if(cost[pm] < SPLIT_INF && (m < 0 || SPLIT_CEIL(cost[pm]) < SPLIT_CEIL(cost[m]))) {
+			m = pm;
+		}
+	}
+	if(m < 0) return -1;
+	c = SPLIT_CEIL(cost[m]) / SPLIT_UNIT;
+	for(k = chars - 1; k >= 0; k--) {
+		pm = (trace[k] >> (m * 2)) & 3;
+		trace[k] = (unsigned char)m;
+		m = pm;
+	}
 
-	return run;
+	return c;
 }
 
 static int Split_splitString(const char *string, QRinput *input,
 		QRencodeMode hint)
 {
-	int length;
-	QRencodeMode mode;
+	/* The first version of each range of the length indicators. */
+	static const int versionClass[4] = {1, 10, 27, QRSPEC_VERSION_MAX + 1};
+	int head[SPLIT_MODES];
+	unsigned char *trace;
+	const char *p, *q;
+	int chars, bits, least, version, cls, i, k;
+
+	/* Count the characters and the bits they take in their cheapest
+	 * modes, a lower bound of any segmentation. */
+	chars = 0;
+	least = 0;
+	for(p = string; *p != '\0'; p += Split_classLength(cls)) {
+		cls = Split_charClass(p, hint);
+		least += (cls == SPLIT_DIGIT) ? 20 : (cls == SPLIT_ALNUM) ? 33 : (cls == SPLIT_BYTE) ? 48 : 78;
+		chars++;
+	}
+	trace = (unsigned char *)QRalloc_malloc((size_t)chars);
+	if(trace == NULL) return -1;
+
+	if(input->mqr || input->version > 0) {
+		Split_initHeads(head, input->version, input->mqr, hint);
+		if(Split_optimize(string, chars, head, hint, trace) < 0) {
+			QRalloc_free(trace);
+			errno = ERANGE;
+			return -1;
+		}
+	} else {
+		/* Automatic version: the optimum of a range is valid only if
+		 * its bits also fit into a version of that range. The optimum
+		 * never shrinks in a later range, so ranges that cannot hold
+		 * the bits found so far are skipped. */
+		version = QRspec_getMinimumVersion((least / SPLIT_UNIT + 7) / 8, input->level);
+		for(i = 0; i < 2 && version >= versionClass[i + 1]; i++);
+		for(;;) {
+			Split_initHeads(head, versionClass[i], 0, hint);
+			bits = Split_optimize(string, chars, head, hint, trace);
+			version = QRspec_getMinimumVersion((bits + 7) / 8, input->level);
+			if(version < versionClass[i + 1] || i == 2) break;
+			while(i < 2 && version >= versionClass[i + 1]) i++;
+		}
+	}
 
-	while(*string != '\0') {
-		mode = Split_identifyMode(string, hint);
-		if(mode == QR_MODE_NUM) {
-			length = Split_eatNum(string, input, hint);
-		} else if(mode == QR_MODE_AN) {
-			length = Split_eatAn(string, input, hint);
-		} else if(mode == QR_MODE_KANJI && hint == QR_MODE_KANJI) {
-			length = Split_eatKanji(string, input, hint);
-		} else {
-			length = Split_eat8(string, input, hint);
+	p = string;
+	k = 0;
+	while(k < chars) {
+		q = p;
+		for(i = k; i < chars && trace[i] == trace[k]; i++) {
+			q += Split_classLength(Split_charClass(q, hint));
+		}
+		if(QRinput_append(input, (QRencodeMode)trace[k], (int)(q - p), (unsigned char *)p) < 0) {
+			QRalloc_free(trace);
+			return -1;
 		}
-		if(length == 0) break;
-		if(length < 0) return -1;
-		string += length;
+		p = q;
+		k = i;
 	}
+	QRalloc_free(trace);
 
 	return 0;
 }
@@ -314,7 +310,7 @@ int Split_splitStringToQRinput(const char *string, QRinput *input,
 		newstr = dupAndToUpper(string, hint);
 		if(newstr == NULL) return -1;
 		ret = Split_splitString(newstr, input, hint);
-		free(newstr);
+		QRalloc_free(newstr);
 	} else {
 		ret = Split_splitString(string, input, hint);
 	}
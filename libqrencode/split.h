@@ -32,6 +32,9 @@
 
 /**
  * Split the input string (null terminated) into QRinput.
+ * The string is split into the segmentation of the fewest bits for the
+ * version of input. If its version is 0, the range of versions that share
+ * the same length indicators is chosen by the size of the result.
  * @param string input string
  * @param hint give QR_MODE_KANJI if the input string contains Kanji character encoded in Shift-JIS. If not, give QR_MODE_8.
  * @param casesensitive 0 for case-insensitive encoding (all alphabet characters are replaced to UPPER-CASE CHARACTERS.
@@ -5,7 +5,6 @@
  */
 
 #include <string.h>
-#include <time.h>
 
 #include "pico/stdlib.h"
 #include "pico/cyw43_arch.h"
@@ -14,18 +13,61 @@
 #include "lwip/pbuf.h"
 #include "lwip/udp.h"
 
+#include "ntp_client.h"
+
 typedef struct NTP_T_
 {
     ip_addr_t ntp_server_address;
     struct udp_pcb *ntp_pcb;
     int dns_result, ntp_result; // 0: waiting, 1: success, -1: fail
-    uint32_t unix_time;
+
+    // 1 回の問い合わせの 4 つの時刻. t1, t4 は time_us_64, t2, t3 はサーバーの時刻 (1970 年からの us)
+    uint64_t t1, t4;
+    int64_t t2, t3;
+
+    ntp_state_t state;
+    absolute_time_t deadline;
+    absolute_time_t sample_deadline;
+    int sample;        // 何回目の問い合わせか
+    ntp_result_t best; // これまでで最も遅延の小さい結果
+    bool warm;         // 接続済みかつ全サーバーのアドレスがキャッシュにある状態で始めたか
+    bool use_bssid;    // キャッシュした BSSID で接続中
 } NTP_T;
 
-#define NTP_SERVER "pool.ntp.org"
+#define NTP_SERVER_COUNT 2 // ntp_servers の数
+
+// 接続先 BSSID と名前解決の結果のキャッシュ. 再同期を UDP の 1 往復で済ませるために使う
+typedef struct
+{
+    uint8_t bssid[6];
+    bool has_bssid;
+    uint32_t server_addr[NTP_SERVER_COUNT];   // IPv4 (ネットワークバイトオーダー)
+    uint64_t server_expire[NTP_SERVER_COUNT]; // time_us_64 での有効期限. 0 なら無効
+} ntp_cache_t;
+
 #define NTP_MSG_LEN 48
 #define NTP_PORT 123
 #define NTP_DELTA 2208988800 // seconds between 1 Jan 1900 and 1 Jan 1970
+#define NTP_TIMEZONE_S (9 * 60 * 60) // JST
+#define NTP_SAMPLES 4                // 問い合わせ回数. 遅延が最小のものを採用する
+#define NTP_SAMPLE_TIMEOUT_MS 1000   // 1 回の問い合わせの待ち時間
+#define NTP_ACCEPT_DELAY_US 20000    // 再同期ではこれ以下の遅延の応答が得られた時点で打ち切る
+#define NTP_DNS_TTL_S (24 * 60 * 60) // lwIP は DNS レコードの TTL を返さないので固定の有効期間を使う
+#define NTP_CACHE_MAGIC 0x4E
+
+// 問い合わせごとに順番に使う
+static const char *ntp_servers[NTP_SERVER_COUNT] = {"0.pool.ntp.org", "1.pool.ntp.org"};
+
+static NTP_T ntp;
+static ntp_cache_t ntp_cache;
+
+// NTP タイムスタンプ (32 bit 秒 + 32 bit 小数) を 1970 年からの us にする
+static int64_t ntp_timestamp_to_us(const uint8_t *buf)
+{
+    uint32_t seconds = (uint32_t)buf[0] << 24 | buf[1] << 16 | buf[2] << 8 | buf[3];
+    uint32_t fraction = (uint32_t)buf[4] << 24 | buf[5] << 16 | buf[6] << 8 | buf[7];
+    return ((int64_t)seconds - NTP_DELTA) * 1000000 + (int64_t)(((uint64_t)fraction * 1000000) >> 32);
+}
 
 // Make an NTP request
 static void ntp_request(NTP_T *state)
@@ -39,6 +81,10 @@ static void ntp_request(NTP_T *state)
     uint8_t *req = (uint8_t *)p->payload;
     memset(req, 0, NTP_MSG_LEN);
     req[0] = 0x1b;
+    // 送信時刻 t1 を transmit timestamp に入れておく. サーバーは originate timestamp にそのまま返すので, 応答の照合に使う
+    state->t1 = time_us_64();
+    for (int i = 0; i < 8; i++)
+        req[40 + i] = state->t1 >> (56 - i * 8);
     udp_sendto(state->ntp_pcb, p, &state->ntp_server_address, NTP_PORT);
     pbuf_free(p);
     cyw43_arch_lwip_end();
@@ -65,27 +111,72 @@ static void ntp_dns_found(const char *hostname, const ip_addr_t *ipaddr, void *a
 static void ntp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
 {
     NTP_T *state = (NTP_T *)arg;
+    uint64_t t4 = time_us_64();
     uint8_t mode = pbuf_get_at(p, 0) & 0x7;
     uint8_t stratum = pbuf_get_at(p, 1);
 
     // Check the result
-    if (ip_addr_cmp(addr, &state->ntp_server_address) && port == NTP_PORT && p->tot_len == NTP_MSG_LEN &&
-        mode == 0x4 && stratum != 0)
+    if (!ip_addr_cmp(addr, &state->ntp_server_address) || port != NTP_PORT)
     {
-        uint8_t seconds_buf[4] = {0};
-        pbuf_copy_partial(p, seconds_buf, sizeof(seconds_buf), 40);
-        uint32_t ntp_time = seconds_buf[0] << 24 | seconds_buf[1] << 16 | seconds_buf[2] << 8 | seconds_buf[3];
-        state->unix_time = ntp_time - NTP_DELTA;
-        state->ntp_result = 1;
+        // サーバーを交互に使うので, 前の標本で問い合わせたサーバーからの遅れた応答もここに来る. 無視する
+        printf("ntp response from another server\n");
+    }
+    else if (p->tot_len == NTP_MSG_LEN && mode == 0x4 && stratum != 0)
+    {
+        uint8_t buf[24];
+        pbuf_copy_partial(p, buf, sizeof(buf), 24); // originate, receive, transmit
+        uint64_t origin = 0;
+        for (int i = 0; i < 8; i++)
+            origin = origin << 8 | buf[i];
+        if (origin == state->t1 && state->ntp_result == 0)
+        {
+            state->t2 = ntp_timestamp_to_us(buf + 8);
+            state->t3 = ntp_timestamp_to_us(buf + 16);
+            state->t4 = t4;
+            state->ntp_result = 1;
+        }
+        else
+        {
+            printf("stale ntp response\n"); // 前の問い合わせへの遅れた応答. 無視する
+        }
     }
     else
     {
-        state->ntp_result = -1;
+        // 問い合わせたサーバーからの壊れた応答だけを失敗にする
+        if (state->ntp_result == 0)
+            state->ntp_result = -1;
         printf("invalid ntp response\n");
     }
     pbuf_free(p);
 }
 
+// キャッシュにある index 番目のサーバーのアドレス. 期限切れなら false
+static bool ntp_cache_lookup(int index, ip_addr_t *addr)
+{
+    uint64_t expire = ntp_cache.server_expire[index];
+    if (expire == 0 || time_us_64() >= expire)
+        return false;
+    if (addr)
+        ip_addr_set_ip4_u32(addr, ntp_cache.server_addr[index]);
+    return true;
+}
+
+// 応答のあったサーバーのアドレスを覚える. キャッシュから使った場合は期限を延ばさない
+static void ntp_cache_store(int index, const ip_addr_t *addr)
+{
+    if (!IP_IS_V4(addr) || ntp_cache_lookup(index, NULL))
+        return;
+    ntp_cache.server_addr[index] = ip4_addr_get_u32(ip_2_ip4(addr));
+    ntp_cache.server_expire[index] = time_us_64() + (uint64_t)NTP_DNS_TTL_S * 1000000;
+}
+
+static int ntp_connect(NTP_T *state)
+{
+    if (state->use_bssid)
+        return cyw43_arch_wifi_connect_bssid_async(WIFI_SSID, ntp_cache.bssid, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
+    return cyw43_arch_wifi_connect_async(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK);
+}
+
 void ntp_init()
 {
     if (cyw43_arch_init())
@@ -93,85 +184,249 @@ void ntp_init()
         printf("failed to cyw43_arch_init\n");
     }
     cyw43_arch_enable_sta_mode();
+    ntp.state = NTP_IDLE;
+}
+
+static void ntp_finish(NTP_T *state, ntp_state_t result)
+{
+    if (state->ntp_pcb)
+    {
+        cyw43_arch_lwip_begin();
+        udp_remove(state->ntp_pcb);
+        cyw43_arch_lwip_end();
+        state->ntp_pcb = NULL;
+    }
+    state->state = result;
 }
 
-// Wifiに接続し, NTPサーバーから時刻を取得する. 成功した場合に true を返す. 結果は引数の result に格納される.
-bool ntp_get_time(datetime_t *result, uint32_t timeout_ms)
+// 同期を開始する. 実際の処理は ntp_sync_poll を呼ぶたびに少しずつ進む
+void ntp_sync_start(uint32_t timeout_ms)
 {
-    absolute_time_t deadline = make_timeout_time_ms(timeout_ms);
+    if (ntp.state != NTP_IDLE && ntp.state != NTP_DONE && ntp.state != NTP_FAILED)
+        return;
 
-    if (cyw43_arch_wifi_connect_timeout_ms(WIFI_SSID, WIFI_PASSWORD, CYW43_AUTH_WPA2_AES_PSK, timeout_ms))
+    ntp.deadline = make_timeout_time_ms(timeout_ms);
+    ntp.ntp_pcb = NULL;
+    ntp.sample = 0;
+    ntp.best.samples = 0;
+    ntp.use_bssid = false;
+    ntp.state = NTP_CONNECTING;
+
+    bool linked = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA) == CYW43_LINK_UP;
+    ntp.warm = linked;
+    for (int i = 0; i < NTP_SERVER_COUNT; i++)
+        ntp.warm = ntp.warm && ntp_cache_lookup(i, NULL);
+    if (linked)
+        return; // 接続は維持しているので次の ntp_sync_poll で問い合わせに進む
+
+    ntp.use_bssid = ntp_cache.has_bssid;
+    if (ntp_connect(&ntp))
     {
         printf("failed to connect Wifi\n");
-        return false;
+        ntp.state = NTP_FAILED;
     }
+}
+
+// 次の問い合わせのためにサーバーの名前解決を始める. キャッシュが有効なら DNS は使わない
+static void ntp_resolve(NTP_T *state)
+{
+    int index = state->sample % NTP_SERVER_COUNT;
+    const char *server = ntp_servers[index];
+    state->dns_result = 0;
+    state->ntp_result = 0;
+    state->sample_deadline = make_timeout_time_ms(NTP_SAMPLE_TIMEOUT_MS);
+    state->state = NTP_RESOLVING;
 
-    NTP_T state;
-    state.dns_result = 0;
-    state.ntp_result = 0;
-    state.ntp_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
-    if (!state.ntp_pcb)
+    if (ntp_cache_lookup(index, &state->ntp_server_address))
     {
-        printf("failed to create pcb\n");
-        return false;
+        state->dns_result = 1;
+        return;
     }
 
     cyw43_arch_lwip_begin();
-    int err = dns_gethostbyname(NTP_SERVER, &state.ntp_server_address, ntp_dns_found, &state);
+    int err = dns_gethostbyname(server, &state->ntp_server_address, ntp_dns_found, state);
     cyw43_arch_lwip_end();
 
-    if (err == ERR_INPROGRESS)
-    {
-        // DNS 待機
-        while (state.dns_result == 0 && absolute_time_diff_us(get_absolute_time(), deadline) > 0)
-        {
-            cyw43_arch_poll();
-            sleep_ms(1);
-        }
-    }
+    if (err == ERR_OK)
+        state->dns_result = 1; // キャッシュ済み
+    else if (err != ERR_INPROGRESS)
+        state->dns_result = -1;
+}
+
+// 1 回の問い合わせを終える. 規定回数に達したら結果を確定する
+static void ntp_next_sample(NTP_T *state)
+{
+    state->sample++;
+    bool enough = state->warm && state->best.samples > 0 && state->best.delay_us <= NTP_ACCEPT_DELAY_US;
+    if (state->sample < NTP_SAMPLES && !enough)
+        ntp_resolve(state);
     else
-    {
-        printf("invalid DNS response.\n");
-        goto FAIL;
-    }
+        ntp_finish(state, state->best.samples > 0 ? NTP_DONE : NTP_FAILED);
+}
 
-    if (state.dns_result != 1)
+// t1..t4 から時計のずれと往復遅延を求め, 遅延が最小であれば採用する
+static void ntp_add_sample(NTP_T *state)
+{
+    int64_t t1 = (int64_t)state->t1;
+    int64_t t4 = (int64_t)state->t4;
+    int64_t offset = ((state->t2 - t1) + (state->t3 - t4)) / 2;
+    int64_t delay = (t4 - t1) - (state->t3 - state->t2);
+    if (delay < 0)
+        delay = 0;
+    printf("ntp sample %d: delay %ld us\n", state->sample, (long)delay);
+
+    if (state->best.samples == 0 || delay < state->best.delay_us)
     {
-        printf("failed to get response from DNS.\n");
-        goto FAIL;
+        state->best.offset_us = offset + (int64_t)NTP_TIMEZONE_S * 1000000;
+        state->best.delay_us = (int32_t)delay;
     }
+    state->best.samples++;
+}
 
-    udp_recv(state.ntp_pcb, ntp_recv, &state);
-    ntp_request(&state);
+// メインループから毎回呼ぶ. ブロックせずに 1 段階ずつ進め, 現在の状態を返す.
+// NTP_DONE を返したときは result に結果が入る. NTP_DONE / NTP_FAILED は一度だけ返し, その後は NTP_IDLE になる.
+ntp_state_t ntp_sync_poll(ntp_result_t *result)
+{
+    cyw43_arch_poll();
 
-    // NTP 待機
-    while (state.ntp_result == 0 && absolute_time_diff_us(get_absolute_time(), deadline) > 0)
+    ntp_state_t state = ntp.state;
+    if (state == NTP_IDLE)
+        return state;
+    if (state == NTP_DONE || state == NTP_FAILED)
     {
-        cyw43_arch_poll();
-        sleep_ms(1); // これがないと動かない!
+        if (state == NTP_DONE)
+            *result = ntp.best;
+        ntp.state = NTP_IDLE;
+        return state;
     }
 
-    if (state.ntp_result != 1)
+    if (absolute_time_diff_us(get_absolute_time(), ntp.deadline) <= 0)
+    {
+        printf("ntp sync timed out\n");
+        ntp_finish(&ntp, ntp.best.samples > 0 ? NTP_DONE : NTP_FAILED);
+        return ntp.state;
+    }
+    if (state != NTP_CONNECTING && absolute_time_diff_us(get_absolute_time(), ntp.sample_deadline) <= 0)
     {
-        printf("failed to get response from NTP.\n");
-        goto FAIL;
+        printf("ntp sample %d timed out\n", ntp.sample);
+        ntp_cache.server_expire[ntp.sample % NTP_SERVER_COUNT] = 0;
+        ntp_next_sample(&ntp);
+        return ntp.state;
     }
 
-    time_t jst_time = state.unix_time + 9 * 60 * 60;
-    struct tm *tm = gmtime(&jst_time);
+    switch (state)
+    {
+    case NTP_CONNECTING:
+    {
+        int status = cyw43_tcpip_link_status(&cyw43_state, CYW43_ITF_STA);
+        if (status == CYW43_LINK_UP)
+        {
+            if (!ntp.warm)
+                ntp_cache.has_bssid = cyw43_wifi_get_bssid(&cyw43_state, ntp_cache.bssid) == 0;
+            ntp.ntp_pcb = udp_new_ip_type(IPADDR_TYPE_ANY);
+            if (!ntp.ntp_pcb)
+            {
+                printf("failed to create pcb\n");
+                ntp_finish(&ntp, NTP_FAILED);
+                break;
+            }
+            udp_recv(ntp.ntp_pcb, ntp_recv, &ntp);
+            ntp_resolve(&ntp);
+        }
+        else if (status < 0 && ntp.use_bssid)
+        {
+            // AP が変わったなどで BSSID 指定の接続に失敗した. SSID だけで接続し直す
+            printf("failed to connect cached BSSID\n");
+            ntp_cache.has_bssid = false;
+            ntp.use_bssid = false;
+            if (ntp_connect(&ntp))
+                ntp_finish(&ntp, NTP_FAILED);
+        }
+        else if (status < 0)
+        {
+            printf("failed to connect Wifi\n");
+            ntp_finish(&ntp, NTP_FAILED);
+        }
+        break;
+    }
+    case NTP_RESOLVING:
+        if (ntp.dns_result == 1)
+        {
+            ntp_request(&ntp);
+            ntp.state = NTP_REQUESTING;
+        }
+        else if (ntp.dns_result == -1)
+        {
+            printf("failed to get response from DNS.\n");
+            ntp_next_sample(&ntp);
+        }
+        break;
+    case NTP_REQUESTING:
+        if (ntp.ntp_result == 1)
+        {
+            ntp_cache_store(ntp.sample % NTP_SERVER_COUNT, &ntp.ntp_server_address);
+            ntp_add_sample(&ntp);
+            ntp_next_sample(&ntp);
+        }
+        else if (ntp.ntp_result == -1)
+        {
+            printf("failed to get response from NTP.\n");
+            ntp_cache.server_expire[ntp.sample % NTP_SERVER_COUNT] = 0;
+            ntp_next_sample(&ntp);
+        }
+        break;
+    default:
+        break;
+    }
+    return ntp.state;
+}
 
-    result->year = tm->tm_year + 1900;
-    result->month = tm->tm_mon + 1;
-    result->day = tm->tm_mday;
-    result->hour = tm->tm_hour;
-    result->min = tm->tm_min;
-    result->sec = tm->tm_sec;
-    result->dotw = tm->tm_wday; // 0 = Sunday
+// キャッシュを NTP_CACHE_BYTES バイトに書き出す. now_s は現在時刻 (1970 年からの秒). 再起動後も使えるよう期限は時刻で持つ
+void ntp_cache_save(uint8_t *buf, int64_t now_s)
+{
+    memset(buf, 0, NTP_CACHE_BYTES);
+    buf[0] = NTP_CACHE_MAGIC;
+    if (ntp_cache.has_bssid)
+    {
+        buf[1] = 1;
+        memcpy(buf + 2, ntp_cache.bssid, 6);
+    }
+    uint64_t now_us = time_us_64();
+    for (int i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        uint8_t *p = buf + 8 + i * 8;
+        uint32_t expire = 0;
+        if (ntp_cache_lookup(i, NULL))
+            expire = (uint32_t)(now_s + (int64_t)((ntp_cache.server_expire[i] - now_us) / 1000000));
+        memcpy(p, &ntp_cache.server_addr[i], 4);
+        for (int j = 0; j < 4; j++)
+            p[4 + j] = expire >> (24 - j * 8);
+    }
+    uint8_t sum = 0;
+    for (int i = 0; i < NTP_CACHE_BYTES - 1; i++)
+        sum += buf[i];
+    buf[NTP_CACHE_BYTES - 1] = sum;
+}
 
-    udp_remove(state.ntp_pcb);
-    return true;
+// ntp_cache_save で書き出したキャッシュを読み込む. 壊れていれば何もしない
+void ntp_cache_load(const uint8_t *buf, int64_t now_s)
+{
+    uint8_t sum = 0;
+    for (int i = 0; i < NTP_CACHE_BYTES - 1; i++)
+        sum += buf[i];
+    if (buf[0] != NTP_CACHE_MAGIC || buf[NTP_CACHE_BYTES - 1] != sum)
+        return;
 
-FAIL:
-    udp_remove(state.ntp_pcb);
-    return false;
+    ntp_cache.has_bssid = buf[1] == 1;
+    memcpy(ntp_cache.bssid, buf + 2, 6);
+    uint64_t now_us = time_us_64();
+    for (int i = 0; i < NTP_SERVER_COUNT; i++)
+    {
+        const uint8_t *p = buf + 8 + i * 8;
+        uint32_t expire = (uint32_t)p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7];
+        memcpy(&ntp_cache.server_addr[i], p, 4);
+        ntp_cache.server_expire[i] = 0;
+        if (expire > now_s && expire - now_s <= NTP_DNS_TTL_S)
+            ntp_cache.server_expire[i] = now_us + (uint64_t)(expire - now_s) * 1000000;
+    }
 }
@@ -1,7 +1,29 @@
 #ifndef NTP_CLIENT
 #define NTP_CLIENT
 
+typedef enum
+{
+    NTP_IDLE,
+    NTP_CONNECTING, // Wifi 接続中
+    NTP_RESOLVING,  // DNS 問い合わせ中
+    NTP_REQUESTING, // NTP 応答待ち
+    NTP_DONE,       // 取得完了. 呼び出し側で時刻を反映する
+    NTP_FAILED,
+} ntp_state_t;
+
+typedef struct
+{
+    int64_t offset_us; // JST の 1970 年からの us と time_us_64 の差. 現在時刻は time_us_64() + offset_us
+    int32_t delay_us;  // 採用した問い合わせの往復遅延. 誤差は最大でこの半分
+    int samples;       // 応答が得られた問い合わせの数
+} ntp_result_t;
+
+#define NTP_CACHE_BYTES 25 // ntp_cache_save の大きさ. DS1302 の RAM に収まる
+
 void ntp_init();
-bool ntp_get_time(datetime_t *result, uint32_t timeout_ms);
+void ntp_sync_start(uint32_t timeout_ms);
+ntp_state_t ntp_sync_poll(ntp_result_t *result);
+void ntp_cache_save(uint8_t *buf, int64_t now_s);
+void ntp_cache_load(const uint8_t *buf, int64_t now_s);
 
 #endif
@@ -0,0 +1,156 @@
+// BitStream のベンチマーク. 1 ビットを 1 バイトに入れていた以前の BitStream と, 今のビットを詰めた BitStream で
+// v1-40 の 8 ビットモードのデータ (モード, 文字数, データ, 終端, 埋め草) を組み立てて, バイト列にするまでの時間を比べる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "qrencode.h"
+#include "qrspec.h"
+#include "bitstream.h"
+
+// 以前の BitStream (1 ビット 1 バイト)
+typedef struct
+{
+    size_t length, datasize;
+    unsigned char *data;
+} old_stream_t;
+
+static int old_reserve(old_stream_t *s, size_t bits)
+{
+    while (s->datasize - s->length < bits)
+    {
+        unsigned char *data = realloc(s->data, s->datasize * 2);
+        if (data == NULL)
+            return -1;
+        s->data = data;
+        s->datasize *= 2;
+    }
+    return 0;
+}
+
+static int old_append_num(old_stream_t *s, size_t bits, unsigned int num)
+{
+    if (old_reserve(s, bits) < 0)
+        return -1;
+    for (unsigned int mask = 1U << (bits - 1); mask; mask >>= 1)
+        s->data[s->length++] = (num & mask) ? 1 : 0;
+    return 0;
+}
+
+static int old_append_bytes(old_stream_t *s, size_t size, const unsigned char *data)
+{
+    if (old_reserve(s, size * 8) < 0)
+        return -1;
+    for (size_t i = 0; i < size; i++)
+        for (unsigned char mask = 0x80; mask; mask >>= 1)
+            s->data[s->length++] = (data[i] & mask) ? 1 : 0;
+    return 0;
+}
+
+static unsigned char *old_to_byte(old_stream_t *s)
+{
+    unsigned char *out = malloc((s->length + 7) / 8);
+    if (out == NULL)
+        return NULL;
+    const unsigned char *p = s->data;
+    for (size_t i = 0; i < s->length / 8; i++)
+    {
+        unsigned char v = 0;
+        for (int j = 0; j < 8; j++)
+            v = (unsigned char)(v << 1 | *p++);
+        out[i] = v;
+    }
+    return out; // 長さはいつも 8 の倍数にしている
+}
+
+static unsigned char *old_build(int version, QRecLevel level, int len, const unsigned char *data)
+{
+    old_stream_t s = {0, 128, malloc(128)};
+    int words = QRspec_getDataLength(version, level);
+    unsigned char *out = NULL;
+
+    if (s.data == NULL)
+        return NULL;
+    if (old_append_num(&s, 4, 4) == 0 && old_append_num(&s, QRspec_lengthIndicator(QR_MODE_8, version), len) == 0 && old_append_bytes(&s, len, data) == 0 && old_append_num(&s, 4, 0) == 0)
+    {
+        int ok = 1;
+        if (s.length % 8)
+            ok = old_append_num(&s, 8 - s.length % 8, 0) == 0;
+        for (int i = 0; ok && (int)s.length < words * 8; i++)
+            ok = old_append_num(&s, 8, i & 1 ? 0x11 : 0xec) == 0;
+        if (ok)
+            out = old_to_byte(&s);
+    }
+    free(s.data);
+    return out;
+}
+
+static unsigned char *new_build(int version, QRecLevel level, int len, unsigned char *data)
+{
+    BitStream *s = BitStream_new();
+    int words = QRspec_getDataLength(version, level);
+    unsigned char *out = NULL;
+
+    if (s == NULL)
+        return NULL;
+    if (BitStream_appendNum(s, 4, 4) == 0 && BitStream_appendNum(s, QRspec_lengthIndicator(QR_MODE_8, version), len) == 0 && BitStream_appendBytes(s, len, data) == 0 && BitStream_appendNum(s, 4, 0) == 0)
+    {
+        int ok = 1;
+        if (s->length % 8)
+            ok = BitStream_appendNum(s, 8 - s->length % 8, 0) == 0;
+        for (int i = 0; ok && (int)s->length < words * 8; i++)
+            ok = BitStream_appendNum(s, 8, i & 1 ? 0x11 : 0xec) == 0;
+        if (ok)
+            out = BitStream_toByte(s);
+    }
+    BitStream_free(s);
+    return out;
+}
+
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec * 1e-3;
+}
+
+int main(void)
+{
+    static unsigned char data[3000];
+    const QRecLevel level = QR_ECLEVEL_M;
+    double old_total = 0, new_total = 0;
+    int mismatches = 0;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)rand();
+
+    printf("version  bytes  old us  new us  speedup\n");
+    for (int version = 1; version <= QRSPEC_VERSION_MAX; version++)
+    {
+        int len = (QRspec_getDataLength(version, level) * 8 - 4 - QRspec_lengthIndicator(QR_MODE_8, version)) / 8;
+        int iters = 200000 / len + 1;
+        unsigned char *a = old_build(version, level, len, data), *b = new_build(version, level, len, data);
+
+        if (a == NULL || b == NULL || memcmp(a, b, QRspec_getDataLength(version, level)) != 0)
+            mismatches++;
+        free(a);
+        free(b);
+
+        double t0 = now_us();
+        for (int i = 0; i < iters; i++)
+            free(old_build(version, level, len, data));
+        double t1 = now_us();
+        for (int i = 0; i < iters; i++)
+            free(new_build(version, level, len, data));
+        double t2 = now_us();
+
+        double old_us = (t1 - t0) / iters, new_us = (t2 - t1) / iters;
+        old_total += old_us;
+        new_total += new_us;
+        if (version <= 2 || version % 5 == 0)
+            printf("%7d  %5d  %6.2f  %6.2f  %6.1fx\n", version, len, old_us, new_us, old_us / new_us);
+    }
+    printf("v1-40 total: old %.1f us, new %.1f us (%.1fx), %d mismatches\n", old_total, new_total, old_total / new_total, mismatches);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,121 @@
+// マトリクスから TM1640 のチャネルデータへの変換のベンチマーク.
+// 今の 4x4 バイト転置の変換 (display_convert_matrix_to_array) と, 以前の 1 画素ずつ pos_table を引く変換を
+// 乱数の画面で比べる. 結果が同じことも確かめる. ホストでの計測なので RP2040 での比とは違う
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "display.h"
+
+#define FRAMES 64
+#define ROUNDS 2000
+
+// 以前の変換. 画面は 1 画素 1 要素で, pos_table が画素ごとのチャネルとビットを持つ
+typedef struct
+{
+    int ch;
+    uint64_t bit;
+} pos_t;
+
+static pos_t pos_table[32][32];
+
+static void old_init(void)
+{
+    for (int i = 0; i < 32; i++)
+    {
+        for (int j = 0; j < 32; j++)
+        {
+            int ch = (i / 8) + (3 - (j / 8)) * 4;
+            int row = i % 8;
+            int col = 7 - (j % 8);
+            pos_table[i][j] = (pos_t){ch, 1ull << (row * 8 + col)};
+        }
+    }
+}
+
+static void old_convert(const Color_t matrix[32][32], uint64_t array[TM1640_CHANNELS][2])
+{
+    for (int i = 0; i < TM1640_CHANNELS; i++)
+    {
+        array[i][0] = 0;
+        array[i][1] = 0;
+    }
+
+    for (int i = 0; i < 32; i++)
+    {
+        for (int j = 0; j < 32; j++)
+        {
+            int ch = pos_table[i][j].ch;
+            uint64_t bit = pos_table[i][j].bit;
+
+            if (matrix[i][j] & RED)
+                array[ch][0] |= bit;
+            if (matrix[i][j] & GREEN)
+                array[ch][1] |= bit;
+        }
+    }
+}
+
+static double now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+static uint64_t now_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+int main(void)
+{
+    static framebuffer_t fbs[FRAMES];
+    static Color_t matrices[FRAMES][32][32];
+    static uint64_t arrays[FRAMES][TM1640_CHANNELS][2], ref[TM1640_CHANNELS][2];
+    int mismatches = 0;
+
+    old_init();
+    srand(1);
+    for (int f = 0; f < FRAMES; f++)
+    {
+        for (int y = 0; y < 32; y++)
+            for (int x = 0; x < 32; x++)
+                framebuffer_set_pixel(&fbs[f], x, y, (Color_t)(rand() % 4));
+        for (int y = 0; y < 32; y++)
+            for (int x = 0; x < 32; x++)
+                matrices[f][y][x] = framebuffer_get_pixel(&fbs[f], x, y);
+
+        old_convert(matrices[f], ref);
+        display_convert_matrix_to_array(&fbs[f], arrays[f]);
+        if (memcmp(ref, arrays[f], sizeof(ref)) != 0)
+            mismatches++;
+    }
+
+    double t0 = now_ns();
+    uint64_t c0 = now_cycles();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int f = 0; f < FRAMES; f++)
+            old_convert(matrices[f], arrays[f]);
+    uint64_t c1 = now_cycles();
+    double t1 = now_ns();
+    for (int r = 0; r < ROUNDS; r++)
+        for (int f = 0; f < FRAMES; f++)
+            display_convert_matrix_to_array(&fbs[f], arrays[f]);
+    uint64_t c2 = now_cycles();
+    double t2 = now_ns();
+
+    double frames = (double)FRAMES * ROUNDS;
+    printf("convert matrix to array, per frame (%d frames):\n", FRAMES * ROUNDS);
+    printf("  pos_table  %7.1f ns  %7.0f cycles\n", (t1 - t0) / frames, (double)(c1 - c0) / frames);
+    printf("  swar       %7.1f ns  %7.0f cycles\n", (t2 - t1) / frames, (double)(c2 - c1) / frames);
+    printf("  speedup    %7.1fx, %d / %d frames differ\n", (t1 - t0) / (t2 - t1), mismatches, FRAMES);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,73 @@
+// フレームへの符号語の配置のベンチマーク. 版ごとの配置表 (placement map) で書き込む今の方法と,
+// 以前の FrameFiller でフレームをジグザグにたどる方法を v1-40 で比べる. どちらも同じフレームになることも確かめる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "qrencode.h"
+#include "qrencode_inner.h"
+#include "qrinput.h"
+#include "qrspec.h"
+#include "qralloc.h"
+
+static double now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e6 + t.tv_nsec * 1e-3;
+}
+
+// iters 回フレームを作って捨てる. 1 回あたりの時間 (us) を返す
+static double time_fill(QRRawCode *raw, int noPlacement, int iters)
+{
+    double t0 = now_us();
+    for (int i = 0; i < iters; i++)
+        QRalloc_free(QRraw_fillFrame(raw, noPlacement));
+    return (now_us() - t0) / iters;
+}
+
+int main(void)
+{
+    static unsigned char data[3000];
+    const QRecLevel level = QR_ECLEVEL_M;
+    double map_total = 0, filler_total = 0;
+    int mismatches = 0;
+
+    srand(1);
+    for (size_t i = 0; i < sizeof(data); i++)
+        data[i] = (unsigned char)rand();
+
+    printf("version  width  filler us  map us  speedup\n");
+    for (int version = 1; version <= QRSPEC_VERSION_MAX; version++)
+    {
+        int width = QRspec_getWidth(version);
+        int len = (QRspec_getDataLength(version, level) * 8 - 4 - QRspec_lengthIndicator(QR_MODE_8, version)) / 8;
+        QRinput *input = QRinput_new2(version, level);
+        QRRawCode *raw = NULL;
+
+        if (input == NULL || QRinput_append(input, QR_MODE_8, len, data) < 0 || (raw = QRraw_new(input)) == NULL)
+        {
+            printf("v%d: cannot make the raw code\n", version);
+            QRinput_free(input);
+            return 1;
+        }
+
+        unsigned char *a = QRraw_fillFrame(raw, 1), *b = QRraw_fillFrame(raw, 0);
+        if (a == NULL || b == NULL || memcmp(a, b, (size_t)(width * width)) != 0)
+            mismatches++;
+        QRalloc_free(a);
+        QRalloc_free(b);
+
+        int iters = 2000000 / (width * width) + 1;
+        double filler_us = time_fill(raw, 1, iters), map_us = time_fill(raw, 0, iters);
+        filler_total += filler_us;
+        map_total += map_us;
+        if (version <= 2 || version % 5 == 0)
+            printf("%7d  %5d  %9.2f  %6.2f  %6.1fx\n", version, width, filler_us, map_us, filler_us / map_us);
+
+        QRraw_free(raw);
+        QRinput_free(input);
+    }
+    printf("v1-40 total: filler %.1f us, map %.1f us (%.1fx), %d mismatches\n", filler_total, map_total, filler_total / map_total, mismatches);
+    return mismatches ? 1 : 0;
+}
@@ -0,0 +1,120 @@
+// 入力の分割のベンチマーク. 以前の貪欲な分割 (split_greedy.c) と, 今のビット数が最小になる分割で
+// 4 種類のコーパスを分割し, 版を自動で選んだときのビット数, 版, 分割にかかった時間を比べる
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "qrencode.h"
+#include "qrinput.h"
+#include "qrspec.h"
+#include "split.h"
+
+int SplitGreedy_splitStringToQRinput(const char *string, QRinput *input, QRencodeMode hint, int casesensitive);
+
+typedef int splitter_t(const char *string, QRinput *input, QRencodeMode hint, int casesensitive);
+
+enum { CORPUS_MIXED, CORPUS_URL, CORPUS_NUMERIC, CORPUS_SJIS, CORPORA };
+
+static const char *const corpus_names[CORPORA] = {"mixed", "url", "numeric", "sjis"};
+
+// 英数字と記号の混じった文字列, 数字の多い URL, ほぼ数字, Shift_JIS の漢字と数字
+static void make_string(char *buf, int len, int corpus)
+{
+    static const char url[] = "https://example.com/path?id=";
+    int i = 0;
+
+    if (corpus == CORPUS_URL)
+    {
+        i = len < (int)sizeof(url) - 1 ? len : (int)sizeof(url) - 1;
+        memcpy(buf, url, (size_t)i);
+    }
+    while (i < len)
+    {
+        int r = rand() % 100;
+        switch (corpus)
+        {
+        case CORPUS_MIXED:
+            buf[i++] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ $%*+-./:abcxyz!#"[rand() % 53];
+            break;
+        case CORPUS_URL:
+            buf[i++] = r < 60 ? (char)('0' + rand() % 10) : "ABCDEFabcdef/-_.&="[rand() % 18];
+            break;
+        case CORPUS_NUMERIC:
+            buf[i++] = r < 85 ? (char)('0' + rand() % 10) : "ABC-: "[rand() % 6];
+            break;
+        default:
+            if (r < 50 && i + 1 < len)
+            {
+                buf[i++] = (char)(0x88 + rand() % 8);
+                buf[i++] = (char)(0x40 + rand() % 60);
+            }
+            else
+            {
+                buf[i++] = r < 80 ? (char)('0' + rand() % 10) : "()/ :"[rand() % 5];
+            }
+            break;
+        }
+    }
+    buf[len] = '\0';
+}
+
+// 分割して, 収まる最小の版とそのビット数を返す. 分割が 40 版に収まらなければ -1
+static int split_bits(splitter_t *split, const char *string, QRencodeMode hint, int *version, double *seconds)
+{
+    QRinput *input = QRinput_new2(0, QR_ECLEVEL_L);
+    int bits = -1;
+
+    if (input == NULL)
+        return -1;
+    clock_t start = clock();
+    int ret = split(string, input, hint, 1);
+    *seconds += (double)(clock() - start) / CLOCKS_PER_SEC;
+    if (ret == 0)
+    {
+        *version = QRinput_estimateVersion(input);
+        if (*version >= 1 && *version <= QRSPEC_VERSION_MAX)
+            bits = QRinput_estimateBitStreamSize(input, *version);
+    }
+    QRinput_free(input);
+    return bits;
+}
+
+int main(void)
+{
+    static char string[3000];
+    int worse = 0;
+
+    srand(7);
+    printf("corpus   strings  greedy bits   dp bits  saved  smaller version  greedy ms  dp ms\n");
+    for (int corpus = 0; corpus < CORPORA; corpus++)
+    {
+        QRencodeMode hint = corpus == CORPUS_SJIS ? QR_MODE_KANJI : QR_MODE_8;
+        long greedy_bits = 0, dp_bits = 0;
+        double greedy_s = 0, dp_s = 0;
+        int strings = 0, smaller = 0;
+
+        for (int t = 0; t < 3000; t++)
+        {
+            // 10 本に 1 本は 2900 文字までの長い文字列にする
+            int len = 1 + rand() % (t % 10 == 0 ? 2900 : 200);
+            int greedy_version = 0, dp_version = 0;
+            make_string(string, len, corpus);
+
+            int gb = split_bits(SplitGreedy_splitStringToQRinput, string, hint, &greedy_version, &greedy_s);
+            int db = split_bits(Split_splitStringToQRinput, string, hint, &dp_version, &dp_s);
+            if (gb < 0 || db < 0)
+                continue;
+            strings++;
+            greedy_bits += gb;
+            dp_bits += db;
+            if (dp_version < greedy_version)
+                smaller++;
+            if (dp_version > greedy_version || (dp_version == greedy_version && db > gb))
+                worse++;
+        }
+        printf("%-8s %7d  %11ld  %8ld  %4.1f%%  %15d  %9.1f  %5.1f\n", corpus_names[corpus], strings, greedy_bits, dp_bits,
+               100.0 * (double)(greedy_bits - dp_bits) / (double)greedy_bits, smaller, greedy_s * 1000, dp_s * 1000);
+    }
+    printf("%d strings took more bits or a larger version than the greedy split\n", worse);
+    return worse ? 1 : 0;
+}
@@ -0,0 +1,107 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "pico/stdlib.h"
+#include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
+#include "gpio_mock.h"
+
+uint32_t gpio_mock_pins = 0;
+void (*gpio_mock_on_change)(uint32_t old_pins, uint32_t new_pins) = NULL;
+bool (*gpio_mock_on_read)(unsigned int gpio) = NULL;
+uint32_t gpio_mock_trace[GPIO_MOCK_TRACE_MAX];
+int gpio_mock_trace_len = -1;
+
+static struct repeating_timer *timer = NULL;
+static repeating_timer_callback_t timer_callback = NULL;
+
+static void set_pins(uint32_t pins)
+{
+    uint32_t old = gpio_mock_pins;
+    gpio_mock_pins = pins;
+    if (gpio_mock_on_change && old != pins)
+        gpio_mock_on_change(old, pins);
+}
+
+static void record(void)
+{
+    if (gpio_mock_trace_len < 0)
+        return;
+    if (gpio_mock_trace_len >= GPIO_MOCK_TRACE_MAX)
+    {
+        fprintf(stderr, "gpio_mock: trace overflow\n");
+        exit(1);
+    }
+    gpio_mock_trace[gpio_mock_trace_len++] = gpio_mock_pins;
+}
+
+void gpio_mock_reset_trace(void)
+{
+    gpio_mock_trace_len = 0;
+}
+
+void gpio_init(unsigned int gpio)
+{
+}
+
+void gpio_set_dir(unsigned int gpio, bool out)
+{
+}
+
+void gpio_put(unsigned int gpio, bool value)
+{
+    set_pins(value ? gpio_mock_pins | (1u << gpio) : gpio_mock_pins & ~(1u << gpio));
+}
+
+void gpio_put_masked(uint32_t mask, uint32_t value)
+{
+    set_pins((gpio_mock_pins & ~mask) | (value & mask));
+}
+
+bool gpio_get(unsigned int gpio)
+{
+    if (gpio_mock_on_read)
+        return gpio_mock_on_read(gpio);
+    return (gpio_mock_pins >> gpio) & 1;
+}
+
+void sleep_us(uint64_t us)
+{
+    record();
+}
+
+void busy_wait_us_32(uint32_t delay_us)
+{
+    record();
+}
+
+uint32_t save_and_disable_interrupts(void)
+{
+    return 0;
+}
+
+void restore_interrupts(uint32_t status)
+{
+}
+
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, struct repeating_timer *out)
+{
+    out->user_data = user_data;
+    timer = out;
+    timer_callback = callback;
+    return true;
+}
+
+int gpio_mock_run_timer(void)
+{
+    int calls = 0;
+    while (timer)
+    {
+        calls++;
+        // 割り込みの間隔ごとの状態を記録する
+        record();
+        if (!timer_callback(timer))
+            timer = NULL;
+    }
+    return calls;
+}
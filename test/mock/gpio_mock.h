@@ -0,0 +1,23 @@
+#ifndef GPIO_MOCK
+#define GPIO_MOCK
+#include <stdint.h>
+#include <stdbool.h>
+
+// 全 GPIO の出力レベル. ビット位置が GPIO 番号
+extern uint32_t gpio_mock_pins;
+
+// 出力が変わるたびに呼ばれる (NULL 可). 接続したデバイスのモデルを置く
+extern void (*gpio_mock_on_change)(uint32_t old_pins, uint32_t new_pins);
+// gpio_get で読むデバイス側の出力 (NULL なら出力レベルを返す)
+extern bool (*gpio_mock_on_read)(unsigned int gpio);
+
+// 待ち (sleep_us / busy_wait_us_32) ごとのピンの状態. 波形の比較に使う.
+// gpio_mock_reset_trace を呼ぶと記録を始める (それまでは gpio_mock_trace_len = -1)
+#define GPIO_MOCK_TRACE_MAX 8192
+extern uint32_t gpio_mock_trace[GPIO_MOCK_TRACE_MAX];
+extern int gpio_mock_trace_len;
+void gpio_mock_reset_trace(void);
+
+// add_repeating_timer_us で登録されたコールバックを false を返すまで呼ぶ. 呼んだ回数を返す
+int gpio_mock_run_timer(void);
+#endif
@@ -0,0 +1,14 @@
+#ifndef MOCK_HARDWARE_GPIO
+#define MOCK_HARDWARE_GPIO
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GPIO_IN false
+#define GPIO_OUT true
+
+void gpio_init(unsigned int gpio);
+void gpio_set_dir(unsigned int gpio, bool out);
+void gpio_put(unsigned int gpio, bool value);
+void gpio_put_masked(uint32_t mask, uint32_t value);
+bool gpio_get(unsigned int gpio);
+#endif
@@ -0,0 +1,7 @@
+#ifndef MOCK_HARDWARE_SYNC
+#define MOCK_HARDWARE_SYNC
+#include <stdint.h>
+
+uint32_t save_and_disable_interrupts(void);
+void restore_interrupts(uint32_t status);
+#endif
@@ -0,0 +1,6 @@
+#ifndef MOCK_HARDWARE_TIMER
+#define MOCK_HARDWARE_TIMER
+#include <stdint.h>
+
+void busy_wait_us_32(uint32_t delay_us);
+#endif
@@ -0,0 +1,30 @@
+#ifndef MOCK_PICO_STDLIB
+#define MOCK_PICO_STDLIB
+// ホストでドライバを試すための pico/stdlib.h の代わり. 使う分だけ宣言する
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef unsigned int uint;
+
+typedef struct
+{
+    int16_t year;
+    int8_t month, day, dotw, hour, min, sec;
+} datetime_t;
+
+struct repeating_timer
+{
+    void *user_data;
+};
+typedef bool (*repeating_timer_callback_t)(struct repeating_timer *rt);
+
+void sleep_us(uint64_t us);
+bool add_repeating_timer_us(int64_t delay_us, repeating_timer_callback_t callback, void *user_data, struct repeating_timer *out);
+
+static inline void tight_loop_contents(void)
+{
+}
+
+#include "hardware/gpio.h"
+#endif
@@ -0,0 +1,318 @@
+// ds1302.c のホスト上のテスト. GPIO の先に DS1302 のプロトコルのモデルをつなぐ.
+// - バースト書き込み / 読み出しがレジスタと RAM に正しく届くこと
+// - 読み出し中に秒が繰り上がっても, 日時が食い違わないこと (以前の 1 レジスタずつの読み出しと比べる)
+// - 日時の読み出しが 1 回の CE で済むこと
+#include <stdio.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "gpio_mock.h"
+#include "ds1302.h"
+
+#define PIN_CLK 10
+#define PIN_DIO 11
+#define PIN_CE 12
+
+int get_reg(ds1302_t *dev, int reg);
+
+// DS1302 のモデル. 時計レジスタ (秒, 分, 時, 日, 月, 曜日, 年, WP), トリクル充電, RAM
+typedef struct
+{
+    uint8_t clock[8];
+    uint8_t user[8]; // CE の立ち上がりで時計レジスタを写す読み出し用のバッファ
+    uint8_t burst[8]; // クロックバースト書き込みの途中のデータ. 8 バイト揃ったら CE の立ち下がりで反映する
+    uint8_t trickle;
+    uint8_t ram[DS1302_RAM_SIZE];
+
+    int cmd; // -1: コマンド待ち
+    int bits, index;
+    uint8_t shift;
+    bool reading, out;
+
+    long transactions; // CE の回数
+    long clk_edges;    // CE 中の CLK の立ち上がり
+    long tick_at;      // この回数の CLK の立ち上がりで 1 秒進める (-1 なら進めない)
+    int errors;
+} chip_t;
+
+static chip_t chip;
+
+static int bcd(int v)
+{
+    return (v / 10) * 16 + v % 10;
+}
+
+static int unbcd(int v)
+{
+    return (v / 16) * 10 + v % 16;
+}
+
+static int days_in_month(int year, int month)
+{
+    static const int days[12] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return days[month - 1] + (month == 2 && year % 4 == 0);
+}
+
+// 内部の時計を 1 秒進める
+static void chip_tick(void)
+{
+    int sec = unbcd(chip.clock[0]), min = unbcd(chip.clock[1]), hour = unbcd(chip.clock[2]);
+    int date = unbcd(chip.clock[3]), month = unbcd(chip.clock[4]), dotw = unbcd(chip.clock[5]), year = unbcd(chip.clock[6]);
+
+    if (++sec == 60)
+    {
+        sec = 0;
+        if (++min == 60)
+        {
+            min = 0;
+            if (++hour == 24)
+            {
+                hour = 0;
+                dotw = dotw % 7 + 1;
+                if (++date > days_in_month(year, month))
+                {
+                    date = 1;
+                    if (++month > 12)
+                    {
+                        month = 1;
+                        year = (year + 1) % 100;
+                    }
+                }
+            }
+        }
+    }
+    chip.clock[0] = bcd(sec);
+    chip.clock[1] = bcd(min);
+    chip.clock[2] = bcd(hour);
+    chip.clock[3] = bcd(date);
+    chip.clock[4] = bcd(month);
+    chip.clock[5] = bcd(dotw);
+    chip.clock[6] = bcd(year);
+}
+
+static bool chip_burst(void)
+{
+    return ((chip.cmd >> 1) & 0x1F) == 0x1F;
+}
+
+static bool chip_ram(void)
+{
+    return chip.cmd & 0x40;
+}
+
+static uint8_t chip_read(void)
+{
+    int addr = chip_burst() ? chip.index : (chip.cmd >> 1) & 0x1F;
+    if (chip_ram())
+        return addr < DS1302_RAM_SIZE ? chip.ram[addr] : 0;
+    if (addr < 8)
+        return chip.user[addr];
+    return addr == 8 ? chip.trickle : 0;
+}
+
+static void chip_write(uint8_t data)
+{
+    int addr = chip_burst() ? chip.index : (chip.cmd >> 1) & 0x1F;
+    bool protect = chip.clock[7] & 0x80;
+
+    if (chip_ram())
+    {
+        if (!protect && addr < DS1302_RAM_SIZE)
+            chip.ram[addr] = data;
+    }
+    else if (chip_burst())
+    {
+        if (addr < 8)
+            chip.burst[addr] = data;
+    }
+    else if (addr == 7)
+    {
+        chip.clock[7] = data & 0x80;
+    }
+    else if (!protect)
+    {
+        if (addr < 7)
+            chip.clock[addr] = data;
+        else if (addr == 8)
+            chip.trickle = data;
+    }
+}
+
+static void chip_on_change(uint32_t old_pins, uint32_t new_pins)
+{
+    bool ce_old = (old_pins >> PIN_CE) & 1, ce = (new_pins >> PIN_CE) & 1;
+    bool clk_old = (old_pins >> PIN_CLK) & 1, clk = (new_pins >> PIN_CLK) & 1;
+    bool dio = (new_pins >> PIN_DIO) & 1;
+
+    if (!ce_old && ce)
+    {
+        chip.transactions++;
+        chip.cmd = -1;
+        chip.bits = 0;
+        chip.index = 0;
+        chip.reading = false;
+        memcpy(chip.user, chip.clock, sizeof(chip.user));
+        return;
+    }
+    if (ce_old && !ce)
+    {
+        // クロックバースト書き込みは 8 バイトすべてが届いたときだけ反映される
+        if (chip.cmd >= 0 && !(chip.cmd & 1) && !chip_ram() && chip_burst() && chip.index >= 8 && !(chip.clock[7] & 0x80))
+            memcpy(chip.clock, chip.burst, sizeof(chip.clock));
+        return;
+    }
+    if (!ce)
+        return;
+
+    if (!clk_old && clk)
+    {
+        if (++chip.clk_edges == chip.tick_at)
+            chip_tick();
+        if (chip.reading)
+            return;
+        // 立ち上がりで LSB から取り込む
+        chip.shift = (chip.shift >> 1) | (dio << 7);
+        if (++chip.bits < 8)
+            return;
+        chip.bits = 0;
+        if (chip.cmd < 0)
+        {
+            chip.cmd = chip.shift;
+            if (!(chip.cmd & 0x80))
+                chip.errors++;
+            chip.reading = chip.cmd & 1;
+        }
+        else
+        {
+            chip_write(chip.shift);
+            chip.index++;
+        }
+    }
+    else if (clk_old && !clk && chip.reading)
+    {
+        // 立ち下がりで次のビットを出す
+        if (chip.bits == 0)
+            chip.shift = chip_read();
+        chip.out = (chip.shift >> chip.bits) & 1;
+        if (++chip.bits == 8)
+        {
+            chip.bits = 0;
+            chip.index++;
+        }
+    }
+}
+
+static bool chip_on_read(unsigned int gpio)
+{
+    return gpio == PIN_DIO ? chip.out : (gpio_mock_pins >> gpio) & 1;
+}
+
+// 以前の実装. 1 レジスタずつ CE を切り替えて読む
+static datetime_t ref_get_datetime(ds1302_t *dev)
+{
+    datetime_t res;
+    res.sec = unbcd(get_reg(dev, 0x80));
+    res.min = unbcd(get_reg(dev, 0x82));
+    res.hour = unbcd(get_reg(dev, 0x84));
+    res.day = unbcd(get_reg(dev, 0x86));
+    res.month = unbcd(get_reg(dev, 0x88));
+    res.dotw = unbcd(get_reg(dev, 0x8A));
+    res.year = 2000 + unbcd(get_reg(dev, 0x8C));
+    return res;
+}
+
+static bool same_datetime(datetime_t a, datetime_t b)
+{
+    return a.year == b.year && a.month == b.month && a.day == b.day && a.dotw == b.dotw &&
+           a.hour == b.hour && a.min == b.min && a.sec == b.sec;
+}
+
+static int test_set_and_get(ds1302_t *dev)
+{
+    int failures = 0;
+    datetime_t t = {.year = 2026, .month = 10, .day = 17, .dotw = 6, .hour = 12, .min = 34, .sec = 56};
+
+    chip.clock[7] = 0x80; // 書き込み禁止から始める
+    ds1302_set_datetime(dev, t);
+    const uint8_t expected[8] = {0x56, 0x34, 0x12, 0x17, 0x10, 0x06, 0x26, 0x00};
+    if (memcmp(chip.clock, expected, sizeof(expected)) != 0 || chip.trickle != 0xA5)
+        failures++;
+
+    chip.transactions = 0;
+    datetime_t r = ds1302_get_datetime(dev);
+    if (!same_datetime(r, t) || chip.transactions != 1)
+        failures++;
+    if (ds1302_get_seconds(dev) != 56)
+        failures++;
+
+    printf("set/get datetime: %d failures, %ld CE for a read\n", failures, chip.transactions - 1);
+    return failures;
+}
+
+// 読み出しの途中の各クロックで秒を繰り上げる
+static int test_rollover(ds1302_t *dev)
+{
+    const datetime_t before = {.year = 2026, .month = 12, .day = 31, .dotw = 4, .hour = 23, .min = 59, .sec = 59};
+    const datetime_t after = {.year = 2027, .month = 1, .day = 1, .dotw = 5, .hour = 0, .min = 0, .sec = 0};
+    int torn = 0, ref_torn = 0, cases = 0;
+
+    for (long at = 1;; at++)
+    {
+        ds1302_set_datetime(dev, before);
+        chip.clk_edges = 0;
+        chip.tick_at = at;
+        datetime_t r = ds1302_get_datetime(dev);
+        long edges = chip.clk_edges;
+        if (!same_datetime(r, before) && !same_datetime(r, after))
+            torn++;
+
+        ds1302_set_datetime(dev, before);
+        chip.clk_edges = 0;
+        r = ref_get_datetime(dev);
+        if (!same_datetime(r, before) && !same_datetime(r, after))
+            ref_torn++;
+
+        cases++;
+        if (at > edges && at > chip.clk_edges)
+            break;
+    }
+    chip.tick_at = -1;
+    printf("rollover during read: %d / %d torn (per-register read: %d torn)\n", torn, cases, ref_torn);
+    return torn;
+}
+
+static int test_ram(ds1302_t *dev)
+{
+    uint8_t data[DS1302_RAM_SIZE], back[DS1302_RAM_SIZE];
+    int failures = 0;
+
+    for (int i = 0; i < DS1302_RAM_SIZE; i++)
+        data[i] = (uint8_t)(i * 37 + 11);
+    ds1302_write_ram(dev, data, DS1302_RAM_SIZE);
+    if (memcmp(chip.ram, data, sizeof(data)) != 0)
+        failures++;
+
+    memset(back, 0, sizeof(back));
+    ds1302_read_ram(dev, back, 5);
+    if (memcmp(back, data, 5) != 0 || back[5] != 0)
+        failures++;
+    ds1302_read_ram(dev, back, DS1302_RAM_SIZE);
+    if (memcmp(back, data, sizeof(data)) != 0)
+        failures++;
+
+    printf("ram burst: %d failures\n", failures);
+    return failures;
+}
+
+int main(void)
+{
+    ds1302_t dev = {.pin_clk = PIN_CLK, .pin_dio = PIN_DIO, .pin_ce = PIN_CE};
+
+    chip.tick_at = -1;
+    gpio_mock_on_change = chip_on_change;
+    gpio_mock_on_read = chip_on_read;
+    ds1302_init(&dev);
+
+    int failures = test_set_and_get(&dev) + test_rollover(&dev) + test_ram(&dev) + chip.errors;
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+// libqrencode のホスト上のテスト. WITH_TESTS でビルドしたライブラリのテスト用の関数を呼ぶ.
+// - 表引きの RS 符号化が以前の符号化と同じ ECC を作ること (SSSE3 版とスカラー版の両方のビルドで実行する)
+// - ビットを詰めた BitStream が 1 ビット 1 バイトの参照と同じビット列を作ること
+// - ビットを詰めた行と列でのマスクの評価が, 1 モジュール 1 バイトでの評価と同じ失点になること
+// - 枝刈り, 前回のマスクから試す順序, 並列のマスク探索が全部評価する探索と同じシンボルを作ること.
+//   Mask_getSearchStats() で 1 マスクあたりに評価した行と列の数も表示する
+// - Micro QR の版が以前の貪欲な分割 (split_greedy.c) より大きくならないこと. "2", "U", "W" は M2 のまま
+// - ワークスペースを渡した符号化 (QRcode_encodeStringStatic) がヒープを使わず, 同じシンボルになること
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "qrencode.h"
+#include "qrencode_inner.h"
+#include "qrspec.h"
+#include "mqrspec.h"
+#include "bitstream.h"
+#include "rsecc.h"
+#include "mask.h"
+#include "qralloc.h"
+#include "qrinput.h"
+
+int SplitGreedy_splitStringToQRinput(const char *string, QRinput *input, QRencodeMode hint, int casesensitive);
+
+static const char *const level_names[] = {"L", "M", "Q", "H"};
+
+// 8 ビットモード 1 セグメントでちょうど version, level に収まる長さ
+static int max_8bit_length(int version, QRecLevel level)
+{
+    int bits = QRspec_getDataLength(version, level) * 8 - 4 - QRspec_lengthIndicator(QR_MODE_8, version);
+    return bits / 8;
+}
+
+static int test_rsecc(void)
+{
+#if defined(__SSSE3__)
+    const char *build = "SSSE3";
+#else
+    const char *build = "scalar";
+#endif
+    int failures = RSECC_test();
+    printf("rsecc (%s): %d cases differ from the reference encoder\n", build, failures);
+    return failures != 0;
+}
+
+static int test_bitstream(void)
+{
+    int failures = BitStream_test(1, 200);
+    printf("bitstream: %d / 200 rounds differ from the bit-per-byte reference\n", failures);
+    return failures;
+}
+
+// v1-40 の機能パターンに乱数のデータを入れたフレームで, 8 つのマスクの失点を 2 つの評価で比べる.
+// 黒の割合を変えて N4 の失点も出るようにし, 縞のフレームで N1 と N3 の長い連も作る
+static int test_mask_demerit(void)
+{
+    static const int black_percent[] = {50, 15, 85, -1};
+    int failures = 0, cases = 0;
+
+    srand(2);
+    for (int version = 1; version <= QRSPEC_VERSION_MAX; version++)
+    {
+        int width = QRspec_getWidth(version);
+        for (int f = 0; f < (int)(sizeof(black_percent) / sizeof(black_percent[0])); f++)
+        {
+            QRecLevel level = (QRecLevel)((version + f) % 4);
+            unsigned char *frame = QRspec_newFrame(version);
+            if (frame == NULL)
+                return failures + 1;
+            for (int i = 0; i < width * width; i++)
+            {
+                if (frame[i] & 0x80)
+                    continue;
+                int bit = black_percent[f] < 0 ? (i / 7 + i / width) % 3 == 0 : rand() % 100 < black_percent[f];
+                frame[i] = (unsigned char)(0x02 | bit);
+            }
+            for (int mask = 0; mask < 8; mask++)
+            {
+                int ref = Mask_demeritReference(width, frame, mask, level);
+                int packed = Mask_demeritPacked(width, frame, mask, level);
+                cases++;
+                if (ref < 0 || ref != packed)
+                {
+                    printf("  v%d-%s frame %d mask %d: reference %d, packed %d\n", version, level_names[level], f, mask, ref, packed);
+                    failures++;
+                }
+            }
+            QRalloc_free(frame);
+        }
+    }
+    printf("mask demerit: %d / %d cases differ between packed and reference\n", failures, cases);
+    return failures;
+}
+
+// 呼び出したスレッドでジョブを順に実行するランナー
+static void serial_runner(void (*func)(void *), void **args, int n, void *data)
+{
+    for (int i = 0; i < n; i++)
+        func(args[i]);
+}
+
+// 時計の表示のように末尾だけが変わる文字列を続けて符号化する.
+// 探索の方法ごとに, 評価した行と列の数の 1 マスクあたりの平均と全部評価したときとの比を出す
+static int test_mask_search(void)
+{
+    enum { STRINGS = 8, MODES = 4 };
+    static const char *const names[MODES] = {"exhaustive", "prune", "prune+order", "prune, 3 jobs"};
+    static const int flags[MODES] = {0, QR_MASKSEARCH_PRUNE, QR_MASKSEARCH_PRUNE | QR_MASKSEARCH_ORDER, QR_MASKSEARCH_PRUNE};
+    long lines[MODES] = {0}, full[MODES] = {0};
+    int masks[MODES] = {0};
+    int failures = 0;
+    char string[3000];
+
+    srand(3);
+    for (int version = 1; version <= QRSPEC_VERSION_MAX; version++)
+    {
+        QRcode *ref[STRINGS] = {NULL};
+        int len = max_8bit_length(version, QR_ECLEVEL_M);
+
+        for (int i = 0; i < len; i++)
+            string[i] = (char)('a' + rand() % 26);
+        string[len] = '\0';
+        for (int mode = 0; mode < MODES; mode++)
+        {
+            QRcode_setMaskSearch(flags[mode]);
+            if (mode == 3)
+                QRcode_setParallel(3, 0, serial_runner, NULL);
+            Mask_resetSearchStats();
+            for (int n = 0; n < STRINGS; n++)
+            {
+                snprintf(string + len - 2, 3, "%02d", n * 7);
+                QRcode *code = QRcode_encodeString(string, version, QR_ECLEVEL_M, QR_MODE_8, 1);
+                if (code == NULL)
+                {
+                    failures++;
+                    continue;
+                }
+                full[mode] += code->width * 2 * 8;
+                if (mode == 0)
+                {
+                    ref[n] = code;
+                    continue;
+                }
+                if (ref[n] == NULL || code->width != ref[n]->width || memcmp(code->data, ref[n]->data, (size_t)(code->width * code->width)) != 0)
+                {
+                    printf("  v%d string %d: %s chose another symbol\n", version, n, names[mode]);
+                    failures++;
+                }
+                QRcode_free(code);
+            }
+            int m;
+            long l;
+            Mask_getSearchStats(&m, &l);
+            masks[mode] += m;
+            lines[mode] += l;
+            QRcode_setParallel(1, 0, serial_runner, NULL);
+        }
+        for (int n = 0; n < STRINGS; n++)
+            QRcode_free(ref[n]);
+    }
+    QRcode_setMaskSearch(QR_MASKSEARCH_PRUNE);
+
+    // 全部評価する探索は行と列をすべて数えているはず
+    if (lines[0] != full[0])
+        failures++;
+    printf("mask search: %d failures, rows and columns scored per mask (v1-40, level M)\n", failures);
+    for (int mode = 0; mode < MODES; mode++)
+        printf("  %-14s %6.1f (%3.0f%%)\n", names[mode], (double)lines[mode] / masks[mode], 100.0 * lines[mode] / full[mode]);
+    return failures;
+}
+
+// QRcode_encodeStringMQR() と同じように M1 から順に, 以前の分割で収まる最小の版を探す. 収まらなければ 0
+static int greedy_mqr_version(const char *string, QRecLevel level, int casesensitive)
+{
+    for (int version = 1; version <= MQRSPEC_VERSION_MAX; version++)
+    {
+        QRinput *input = QRinput_newMQR(version, level);
+        if (input == NULL)
+            continue;
+        QRcode *code = NULL;
+        if (SplitGreedy_splitStringToQRinput(string, input, QR_MODE_8, casesensitive) == 0)
+            code = QRcode_encodeInput(input);
+        QRinput_free(input);
+        if (code != NULL)
+        {
+            QRcode_free(code);
+            return version;
+        }
+    }
+    return 0;
+}
+
+static int mqr_version(const char *string, QRecLevel level, int casesensitive)
+{
+    QRcode *code = QRcode_encodeStringMQR(string, 0, level, QR_MODE_8, casesensitive);
+    int version = code != NULL ? code->version : 0;
+    QRcode_free(code);
+    return version;
+}
+
+// 決まった文字列は以前と同じ版, 乱数の文字列は以前より大きくならないこと
+static int test_mqr_versions(void)
+{
+    static const char *const fixed[] = {"2", "U", "W", "12345", "HELLO", "A1", "a"};
+    static const char chars[] = "0123456789ABCDEFXYZ $%*+-./:abcxyz!#";
+    char string[40];
+    int failures = 0, cases = 0, smaller = 0;
+
+    for (int i = 0; i < (int)(sizeof(fixed) / sizeof(fixed[0])); i++)
+    {
+        for (int level = QR_ECLEVEL_L; level <= QR_ECLEVEL_Q; level++)
+        {
+            int old = greedy_mqr_version(fixed[i], level, 1), now = mqr_version(fixed[i], level, 1);
+            cases++;
+            if (now != old)
+            {
+                printf("  \"%s\" %s: M%d, greedy M%d\n", fixed[i], level_names[level], now, old);
+                failures++;
+            }
+        }
+    }
+
+    srand(4);
+    for (int t = 0; t < 3000; t++)
+    {
+        int len = 1 + rand() % 24;
+        QRecLevel level = (QRecLevel)(t % 3);
+        int casesensitive = t / 3 % 2;
+        for (int i = 0; i < len; i++)
+            string[i] = t % 4 == 0 ? chars[rand() % 10] : chars[rand() % (int)(sizeof(chars) - 1)];
+        string[len] = '\0';
+
+        int old = greedy_mqr_version(string, level, casesensitive), now = mqr_version(string, level, casesensitive);
+        cases++;
+        if (old != 0 && (now == 0 || now > old))
+        {
+            printf("  \"%s\" %s: M%d, greedy M%d\n", string, level_names[level], now, old);
+            failures++;
+        }
+        else if (now != 0 && (old == 0 || now < old))
+        {
+            smaller++;
+        }
+    }
+    printf("micro qr versions: %d / %d strings need a larger version than the greedy split (or differ from it for the fixed ones), %d a smaller one\n", failures, cases, smaller);
+    return failures;
+}
+
+// 8 ビットモードだけの文字列と, 数字や英数字が混じって分割される文字列の 2 通りを v1-40, L/M/Q/H で試す
+static int test_static(void)
+{
+    static const char mixed[] = "0123456789ABCDEFGHIJ:-abcdef";
+    char string[3000];
+    int failures = 0;
+
+    srand(1);
+    for (int version = 1; version <= QRSPEC_VERSION_MAX; version++)
+    {
+        for (int level = QR_ECLEVEL_L; level <= QR_ECLEVEL_H; level++)
+        {
+            int len = max_8bit_length(version, level);
+            for (int pattern = 0; pattern < 2; pattern++)
+            {
+                for (int i = 0; i < len; i++)
+                    string[i] = pattern == 0 ? 'a' + i % 26 : mixed[rand() % (int)(sizeof(mixed) - 1)];
+                string[len] = '\0';
+
+                int count = QRcode_testStatic(string, version, level);
+                if (count != 0)
+                {
+                    printf("  v%d-%s pattern %d: %d\n", version, level_names[level], pattern, count);
+                    failures++;
+                }
+            }
+        }
+    }
+    printf("static encoding: %d / %d symbols failed or used the heap\n", failures, QRSPEC_VERSION_MAX * 4 * 2);
+    return failures;
+}
+
+int main(void)
+{
+    int failures = test_rsecc() + test_bitstream() + test_mask_demerit() + test_mask_search() + test_mqr_versions() + test_static();
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
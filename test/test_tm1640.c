@@ -0,0 +1,267 @@
+// tm1640.c のホスト上のテスト. GPIO をモックに置き換えて波形を調べる.
+// - 全グリッドの送信が, 1 ピンずつ gpio_put していた以前の実装と待ちごとのピンの状態まで一致すること
+// - ブロッキング送信と非同期送信 (差分送信を含む) の後で, バスを解読した TM1640 の表示 RAM がフレームと一致すること
+// - 送信のバイト数の統計が, 実際にバスに流れたバイト数と一致すること
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pico/stdlib.h"
+#include "gpio_mock.h"
+#include "tm1640.h"
+
+#define PIN_CLK 16
+#define FRAMES 500
+
+static const uint pin_dios[TM1640_CHANNELS] = {3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12};
+
+// 以前の実装. 全チャネルの DIO を 1 ピンずつ出力する
+static void ref_delay(void)
+{
+    sleep_us(10);
+}
+
+static void ref_put_dios(const tm1640_t *dev, int bit)
+{
+    for (int ch = 0; ch < TM1640_CHANNELS; ch++)
+        gpio_put(dev->pin_dios[ch], bit);
+}
+
+static void ref_start(const tm1640_t *dev)
+{
+    ref_put_dios(dev, 0);
+    ref_delay();
+    gpio_put(dev->pin_clk, 0);
+    ref_delay();
+}
+
+static void ref_stop(const tm1640_t *dev)
+{
+    ref_put_dios(dev, 0);
+    ref_delay();
+    gpio_put(dev->pin_clk, 1);
+    ref_delay();
+    ref_put_dios(dev, 1);
+    ref_delay();
+}
+
+static void ref_clock(const tm1640_t *dev)
+{
+    ref_delay();
+    gpio_put(dev->pin_clk, 1);
+    ref_delay();
+    gpio_put(dev->pin_clk, 0);
+    ref_delay();
+}
+
+static void ref_write_byte(const tm1640_t *dev, uint8_t data)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        ref_put_dios(dev, (data >> i) & 1);
+        ref_clock(dev);
+    }
+}
+
+static void ref_write_ints(const tm1640_t *dev, const uint64_t data[16][2])
+{
+    ref_start(dev);
+    ref_write_byte(dev, 0x40);
+    ref_stop(dev);
+    ref_start(dev);
+    ref_write_byte(dev, 0xC0);
+    for (int color = 0; color < 2; color++)
+    {
+        for (int i = 0; i < 64; i++)
+        {
+            for (int ch = 0; ch < TM1640_CHANNELS; ch++)
+                gpio_put(dev->pin_dios[ch], (data[ch][color] >> i) & 1);
+            ref_clock(dev);
+        }
+    }
+    ref_stop(dev);
+}
+
+// TM1640 のモデル. チャネルごとにバスを解読して表示 RAM に書き込む
+typedef struct
+{
+    bool in_packet, first, fixed;
+    int bits, addr;
+    uint8_t byte;
+    long bytes; // 受け取ったバイト数 (コマンドを含む)
+    uint8_t ram[TM1640_GRIDS];
+} chip_t;
+
+static chip_t chips[TM1640_CHANNELS];
+static int protocol_errors;
+
+static void chip_byte(chip_t *c, uint8_t b)
+{
+    c->bytes++;
+    if (c->first)
+    {
+        c->first = false;
+        if ((b & 0xC0) == 0x40)
+            c->fixed = b & 0x04;
+        else if ((b & 0xC0) == 0xC0)
+            c->addr = b & 0x0F;
+        return;
+    }
+    c->ram[c->addr] = b;
+    if (!c->fixed)
+        c->addr = (c->addr + 1) & 0x0F;
+}
+
+static void chip_on_change(uint32_t old_pins, uint32_t new_pins)
+{
+    bool clk_old = (old_pins >> PIN_CLK) & 1;
+    bool clk_new = (new_pins >> PIN_CLK) & 1;
+
+    for (int ch = 0; ch < TM1640_CHANNELS; ch++)
+    {
+        chip_t *c = &chips[ch];
+        bool dio_old = (old_pins >> pin_dios[ch]) & 1;
+        bool dio_new = (new_pins >> pin_dios[ch]) & 1;
+
+        if (clk_old && clk_new && dio_old && !dio_new)
+        {
+            // start
+            if (c->in_packet)
+                protocol_errors++;
+            c->in_packet = true;
+            c->first = true;
+            c->bits = 0;
+        }
+        else if (clk_old && clk_new && !dio_old && dio_new)
+        {
+            // stop. 直前の CLK の立ち上がりも 1 ビットと数えるので端数は 1 ビットになる
+            if (c->in_packet && c->bits != 1)
+                protocol_errors++;
+            c->in_packet = false;
+        }
+        else if (!clk_old && clk_new && c->in_packet)
+        {
+            // CLK の立ち上がりで LSB から読む
+            c->byte = (c->byte >> 1) | (dio_new << 7);
+            if (++c->bits == 8)
+            {
+                c->bits = 0;
+                chip_byte(c, c->byte);
+            }
+        }
+    }
+}
+
+static int check_panel(const uint64_t data[16][2])
+{
+    for (int ch = 0; ch < TM1640_CHANNELS; ch++)
+    {
+        for (int grid = 0; grid < TM1640_GRIDS; grid++)
+        {
+            uint8_t expected = (data[ch][grid / 8] >> ((grid % 8) * 8)) & 0xFF;
+            if (chips[ch].ram[grid] != expected)
+                return 1;
+        }
+    }
+    return 0;
+}
+
+static void random_changes(uint64_t data[16][2], int n)
+{
+    for (int i = 0; i < n; i++)
+        data[rand() % TM1640_CHANNELS][rand() % 2] ^= 1ull << (rand() % 64);
+}
+
+static void init_dev(tm1640_t *dev, const uint64_t data[16][2])
+{
+    memset(dev, 0, sizeof(*dev));
+    dev->pin_clk = PIN_CLK;
+    memcpy(dev->pin_dios, pin_dios, sizeof(pin_dios));
+    dev->brightness = 7;
+    tm1640_init(dev, data);
+}
+
+// 全グリッドの送信を以前の実装と比べる
+static int test_full_frame_waveform(void)
+{
+    static tm1640_t dev;
+    static uint32_t expected[GPIO_MOCK_TRACE_MAX];
+    uint64_t data[16][2] = {{0}};
+    int failures = 0;
+
+    gpio_mock_on_change = NULL;
+    init_dev(&dev, data);
+    for (int f = 0; f < FRAMES; f++)
+    {
+        for (int ch = 0; ch < TM1640_CHANNELS; ch++)
+            for (int color = 0; color < 2; color++)
+                data[ch][color] = ((uint64_t)rand() << 40) ^ ((uint64_t)rand() << 20) ^ (uint64_t)rand();
+
+        gpio_mock_reset_trace();
+        ref_write_ints(&dev, data);
+        int n = gpio_mock_trace_len;
+        memcpy(expected, gpio_mock_trace, sizeof(uint32_t) * n);
+
+        tm1640_invalidate(&dev);
+        gpio_mock_reset_trace();
+        tm1640_write_ints(&dev, data);
+        if (gpio_mock_trace_len != n || memcmp(expected, gpio_mock_trace, sizeof(uint32_t) * n) != 0)
+            failures++;
+    }
+    printf("full frame waveform: %d / %d frames differ\n", failures, FRAMES);
+    return failures;
+}
+
+// 差分送信と非同期送信の結果をパネルのモデルで確かめる
+static int test_panel_updates(void)
+{
+    static tm1640_t dev;
+    uint64_t data[16][2] = {{0}};
+    int failures = 0, irqs = 0;
+
+    memset(chips, 0, sizeof(chips));
+    protocol_errors = 0;
+    gpio_mock_on_change = chip_on_change;
+    init_dev(&dev, data);
+    failures += check_panel(data);
+    chips[0].bytes = 0;
+    dev.bytes_sent = 0;
+    dev.bytes_saved = 0;
+
+    for (int f = 0; f < FRAMES; f++)
+    {
+        random_changes(data, rand() % 24);
+        gpio_mock_reset_trace();
+        switch (f % 3)
+        {
+        case 0:
+            tm1640_write_ints(&dev, data);
+            break;
+        case 1:
+            tm1640_submit(&dev, data);
+            irqs += gpio_mock_run_timer();
+            break;
+        default:
+            // 送信中に次のフレームが来たら, 待機中のフレームは置き換えられる
+            tm1640_submit(&dev, data);
+            random_changes(data, 4);
+            tm1640_submit(&dev, data);
+            random_changes(data, 4);
+            tm1640_submit(&dev, data);
+            irqs += gpio_mock_run_timer();
+            break;
+        }
+        failures += check_panel(data);
+    }
+    gpio_mock_on_change = NULL;
+    printf("panel updates: %d / %d frames differ, %d protocol errors, %d irqs, %lu bytes sent (%ld on the bus), %lu saved\n",
+           failures, FRAMES, protocol_errors, irqs, (unsigned long)dev.bytes_sent, chips[0].bytes, (unsigned long)dev.bytes_saved);
+    return failures + protocol_errors + (dev.bytes_sent != chips[0].bytes);
+}
+
+int main(void)
+{
+    srand(1);
+    int failures = test_full_frame_waveform() + test_panel_updates();
+    printf("%s\n", failures ? "FAILED" : "OK");
+    return failures ? 1 : 0;
+}
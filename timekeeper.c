@@ -0,0 +1,200 @@
+#include <stdint.h>
+#include <time.h>
+#include "pico/stdlib.h"
+#include "hardware/sync.h"
+#include "ds1302.h"
+#include "timekeeper.h"
+
+#define TIMEKEEPER_POLL_US 1000        // 同期中に DS1302 の秒を読む間隔. 位相誤差の分解能になる
+#define TIMEKEEPER_RESYNC_TIMEOUT_US 1500000
+#define TIMEKEEPER_WRITE_SLACK_US 200 // 秒の境界からこれ以上遅れたら DS1302 への書き込みは次の境界に回す
+
+// 1970/1/1 からの日数 (proleptic Gregorian)
+int64_t days_from_civil(int y, int m, int d)
+{
+    y -= m <= 2;
+    int64_t era = (y >= 0 ? y : y - 399) / 400;
+    int64_t yoe = y - era * 400;
+    int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+int64_t datetime_to_seconds(const datetime_t *dt)
+{
+    return days_from_civil(dt->year, dt->month, dt->day) * 86400 + dt->hour * 3600 + dt->min * 60 + dt->sec;
+}
+
+void seconds_to_datetime(int64_t seconds, datetime_t *dt)
+{
+    time_t t = (time_t)seconds;
+    struct tm *tm = gmtime(&t);
+
+    dt->year = tm->tm_year + 1900;
+    dt->month = tm->tm_mon + 1;
+    dt->day = tm->tm_mday;
+    dt->hour = tm->tm_hour;
+    dt->min = tm->tm_min;
+    dt->sec = tm->tm_sec;
+    dt->dotw = tm->tm_wday; // 0 = Sunday
+}
+
+// time_us_64 で us の時点の時刻 (秒) と, その秒が始まった時点
+int64_t timekeeper_seconds_at(const timekeeper_t *tk, uint64_t us, uint64_t *boundary)
+{
+    uint64_t elapsed = us - tk->_base_us;
+    if (us < tk->_base_us)
+        elapsed = 0;
+    uint64_t n = elapsed / 1000000;
+    if (boundary)
+        *boundary = tk->_base_us + n * 1000000;
+    return tk->_base_time + (int64_t)n;
+}
+
+alarm_id_t timekeeper_schedule(timekeeper_t *tk);
+
+// 基準を置き換え, 秒の割り込みを新しい境界に掛け直す. 古い位相の割り込みが残ると 1 秒に 2 回進む
+void timekeeper_set_base(timekeeper_t *tk, int64_t time, uint64_t us)
+{
+    uint32_t irq = save_and_disable_interrupts();
+    if (tk->_alarm > 0)
+        cancel_alarm(tk->_alarm);
+    tk->_base_time = time;
+    tk->_base_us = us;
+    tk->_alarm = timekeeper_schedule(tk);
+    restore_interrupts(irq);
+}
+
+int64_t timekeeper_alarm_callback(alarm_id_t id, void *user_data)
+{
+    timekeeper_t *tk = (timekeeper_t *)user_data;
+    if (tk->on_second)
+        tk->on_second();
+    tk->_alarm = timekeeper_schedule(tk);
+    return 0;
+}
+
+// 次の秒の境界に割り込みを設定する
+alarm_id_t timekeeper_schedule(timekeeper_t *tk)
+{
+    uint64_t boundary;
+    timekeeper_seconds_at(tk, time_us_64(), &boundary);
+    return add_alarm_at(from_us_since_boot(boundary + 1000000), timekeeper_alarm_callback, tk, true);
+}
+
+// DS1302 の秒の繰り上がりを待って, その瞬間を秒の境界にする同期を始める
+void timekeeper_resync(timekeeper_t *tk)
+{
+    tk->_last_sec = ds1302_get_seconds(tk->rtc);
+    tk->_resync_state = 1;
+    tk->_next_poll_us = time_us_64() + TIMEKEEPER_POLL_US;
+    tk->_resync_deadline_us = time_us_64() + TIMEKEEPER_RESYNC_TIMEOUT_US;
+}
+
+void timekeeper_init(timekeeper_t *tk)
+{
+    tk->synced = false;
+    tk->_rtc_write_us = 0;
+    tk->phase_error_us = 0;
+    tk->_alarm = 0;
+
+    // 境界に合わせるまでは読んだ時点を秒の始まりとみなす
+    datetime_t dt = ds1302_get_datetime(tk->rtc);
+    timekeeper_set_base(tk, datetime_to_seconds(&dt), time_us_64());
+    timekeeper_resync(tk);
+}
+
+// メインループから呼ぶ. 同期中であれば DS1302 の秒を読み, 繰り上がりを検出したら基準を合わせる
+void timekeeper_poll(timekeeper_t *tk)
+{
+    uint64_t now = time_us_64();
+
+    if (tk->_rtc_write_us)
+    {
+        // 書き込み待ちの間は DS1302 が古い時刻のままなので読まない
+        if (now + TIMEKEEPER_POLL_US < tk->_rtc_write_us)
+            return;
+        while (now > tk->_rtc_write_us + TIMEKEEPER_WRITE_SLACK_US)
+            tk->_rtc_write_us += 1000000;
+        if (now + TIMEKEEPER_POLL_US < tk->_rtc_write_us)
+            return;
+
+        busy_wait_until(from_us_since_boot(tk->_rtc_write_us));
+        datetime_t dt;
+        seconds_to_datetime(timekeeper_seconds_at(tk, tk->_rtc_write_us, NULL), &dt);
+        ds1302_set_datetime(tk->rtc, dt);
+        tk->_rtc_write_us = 0;
+        tk->_resync_state = 0;
+        tk->_next_poll_us = now + (uint64_t)tk->resync_interval_s * 1000000;
+        return;
+    }
+
+    if (tk->_resync_state == 0)
+    {
+        if (now >= tk->_next_poll_us)
+            timekeeper_resync(tk);
+        return;
+    }
+    if (now < tk->_next_poll_us)
+        return;
+    tk->_next_poll_us = now + TIMEKEEPER_POLL_US;
+
+    int sec = ds1302_get_seconds(tk->rtc);
+    if (sec == tk->_last_sec)
+    {
+        if (now >= tk->_resync_deadline_us)
+        {
+            // 秒が進まない (発振停止など). 次の機会にやり直す
+            tk->_resync_state = 0;
+            tk->_next_poll_us = now + (uint64_t)tk->resync_interval_s * 1000000;
+        }
+        return;
+    }
+
+    datetime_t dt = ds1302_get_datetime(tk->rtc);
+    int64_t time = datetime_to_seconds(&dt);
+    if (tk->synced)
+    {
+        // この時計での time 秒の境界と, DS1302 の繰り上がりを検出した時点の差
+        int64_t boundary = (int64_t)tk->_base_us + (time - tk->_base_time) * 1000000;
+        tk->phase_error_us = (int32_t)((int64_t)now - boundary);
+    }
+    timekeeper_set_base(tk, time, now);
+    tk->synced = true;
+    tk->_resync_state = 0;
+    tk->_next_poll_us = now + (uint64_t)tk->resync_interval_s * 1000000;
+}
+
+// 現在時刻 (1970 年からの秒)
+int64_t timekeeper_get_time(timekeeper_t *tk)
+{
+    uint32_t irq = save_and_disable_interrupts();
+    int64_t seconds = timekeeper_seconds_at(tk, time_us_64(), NULL);
+    restore_interrupts(irq);
+    return seconds;
+}
+
+void timekeeper_get_datetime(timekeeper_t *tk, datetime_t *dt)
+{
+    seconds_to_datetime(timekeeper_get_time(tk), dt);
+}
+
+// 外部の正確な時刻 (現在時刻 = time_us_64() + offset_us, 1970 年からの us) に合わせる.
+// DS1302 には次の秒の境界ちょうどに timekeeper_poll から書き込む. 合わせる前の時刻とのずれ (us) を返す
+int64_t timekeeper_set_offset(timekeeper_t *tk, int64_t offset_us)
+{
+    uint64_t now = time_us_64();
+    uint32_t irq = save_and_disable_interrupts();
+    uint64_t boundary;
+    int64_t old_time = timekeeper_seconds_at(tk, now, &boundary);
+    restore_interrupts(irq);
+    int64_t old_us = old_time * 1000000 + (int64_t)(now - boundary);
+
+    int64_t new_us = (int64_t)now + offset_us;
+    int64_t sub = new_us % 1000000;
+    timekeeper_set_base(tk, new_us / 1000000, now - (uint64_t)sub);
+    tk->synced = true;
+    tk->_resync_state = 0;
+    tk->_rtc_write_us = now - (uint64_t)sub + 1000000;
+    return new_us - old_us;
+}
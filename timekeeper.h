@@ -0,0 +1,33 @@
+#ifndef TIMEKEEPER
+#define TIMEKEEPER
+#include "pico/stdlib.h"
+#include "ds1302.h"
+
+// RP2040 のタイマーで時刻を進め, DS1302 とは起動時と一定間隔ごとにだけ同期する時計
+typedef struct
+{
+    ds1302_t *rtc;
+    uint32_t resync_interval_s; // DS1302 から読み直す間隔
+    void (*on_second)(void);    // 秒が変わった瞬間にタイマー割り込みから呼ばれる (NULL 可)
+
+    bool synced;            // 一度でも DS1302 の秒の境界に合わせたか
+    int32_t phase_error_us; // 直近の同期で測ったずれ. 正ならこの時計の秒の境界が DS1302 より早い
+
+    int64_t _base_time;    // _base_us に始まった秒 (1970 年からの秒数)
+    uint64_t _base_us;     // time_us_64 での秒の境界
+    int _resync_state;     // 0: 待機, 1: DS1302 の秒の繰り上がり待ち
+    int _last_sec;
+    uint64_t _next_poll_us;
+    uint64_t _resync_deadline_us;
+    uint64_t _rtc_write_us; // DS1302 へ書き込む秒の境界 (0: なし)
+    alarm_id_t _alarm;      // 次の秒の境界の割り込み (0: なし)
+} timekeeper_t;
+
+void timekeeper_init(timekeeper_t *tk);
+void timekeeper_poll(timekeeper_t *tk);
+int64_t timekeeper_get_time(timekeeper_t *tk);
+void timekeeper_get_datetime(timekeeper_t *tk, datetime_t *dt);
+void timekeeper_resync(timekeeper_t *tk);
+int64_t timekeeper_set_offset(timekeeper_t *tk, int64_t offset_us);
+
+#endif
@@ -1,23 +1,33 @@
 #include "pico/stdlib.h"
 #include "hardware/gpio.h"
+#include "hardware/sync.h"
+#include "hardware/timer.h"
 #include <stdint.h>
+#include <string.h>
 #include "tm1640.h"
 
 #define TM1640_CMD1 0x40   // data command
+#define TM1640_FIXED 0x04  // 0x04 fixed address mode
 #define TM1640_CMD2 0xC0   // address command
 #define TM1640_CMD3 0x80   // display control command
 #define TM1640_DSP_ON 0x08 // 0x08 display on
 #define TM1640_DELAY_US 10 // 10us delay between clk/dio pulses
+#define TM1640_CLK_HIGH_US 1 // 非同期送信で CLK を High にしておく時間. DIO の準備は 1 周期 (TM1640_DELAY_US) 取る
 
 void tm1640_delay()
 {
     sleep_us(TM1640_DELAY_US);
 }
 
+// 全チャネルの DIO を 1 回の書き込みで出力する. levels は GPIO 番号のビット位置に並べたもの
+void tm1640_put_dios(const tm1640_t *dev, uint32_t levels)
+{
+    gpio_put_masked(dev->_dio_mask, levels);
+}
+
 void tm1640_start(const tm1640_t *dev)
 {
-    for (int i = 0; i < TM1640_CHANNELS; i++)
-        gpio_put(dev->pin_dios[i], 0);
+    tm1640_put_dios(dev, 0);
     tm1640_delay();
     gpio_put(dev->pin_clk, 0);
     tm1640_delay();
@@ -25,40 +35,35 @@ void tm1640_start(const tm1640_t *dev)
 
 void tm1640_stop(const tm1640_t *dev)
 {
-    for (int i = 0; i < TM1640_CHANNELS; i++)
-        gpio_put(dev->pin_dios[i], 0);
+    tm1640_put_dios(dev, 0);
     tm1640_delay();
     gpio_put(dev->pin_clk, 1);
     tm1640_delay();
-    for (int i = 0; i < TM1640_CHANNELS; i++)
-        gpio_put(dev->pin_dios[i], 1);
+    tm1640_put_dios(dev, UINT32_MAX);
+    tm1640_delay();
+}
+
+// DIO を出力してから CLK を 1 パルス送る
+void tm1640_clock_word(const tm1640_t *dev, uint32_t mask, uint32_t word)
+{
+    gpio_put_masked(mask, word);
+    tm1640_delay();
+    gpio_put(dev->pin_clk, 1);
+    tm1640_delay();
+    gpio_put(dev->pin_clk, 0);
     tm1640_delay();
 }
 
+// 全チャネルに同じバイトを送る
 void tm1640_write_byte(const tm1640_t *dev, uint8_t data)
 {
+    uint32_t mask = dev->_dio_mask;
     for (int i = 0; i < 8; i++)
     {
-        int bit = (data >> i) & 1;
-        for (int ch = 0; ch < TM1640_CHANNELS; ch++)
-        {
-            gpio_put(dev->pin_dios[ch], bit);
-        }
-        tm1640_delay();
-        gpio_put(dev->pin_clk, 1);
-        tm1640_delay();
-        gpio_put(dev->pin_clk, 0);
-        tm1640_delay();
+        tm1640_clock_word(dev, mask, ((data >> i) & 1) ? mask : 0);
     }
 }
 
-void tm1640_write_data_cmd(const tm1640_t *dev)
-{
-    tm1640_start(dev);
-    tm1640_write_byte(dev, TM1640_CMD1);
-    tm1640_stop(dev);
-}
-
 void tm1640_write_dsp_ctrl(const tm1640_t *dev)
 {
     tm1640_start(dev);
@@ -67,49 +72,324 @@ void tm1640_write_dsp_ctrl(const tm1640_t *dev)
 }
 
 // brightness: 0 - 7
-void tm1640_init(const tm1640_t *dev, const uint64_t data[16][2])
+void tm1640_init(tm1640_t *dev, const uint64_t data[16][2])
 {
     gpio_init(dev->pin_clk);
     gpio_set_dir(dev->pin_clk, GPIO_OUT);
     gpio_put(dev->pin_clk, 1);
 
+    // 全チャネルの DIO ピンをまとめた GPIO マスク. 割り込みの中で毎回作らないよう一度だけ求める
+    dev->_dio_mask = 0;
     for (int i = 0; i < TM1640_CHANNELS; i++)
     {
         gpio_init(dev->pin_dios[i]);
         gpio_set_dir(dev->pin_dios[i], GPIO_OUT);
         gpio_put(dev->pin_dios[i], 1);
+        dev->_dio_mask |= 1u << dev->pin_dios[i];
     }
 
+    dev->frames = 0;
+    dev->bytes_sent = 0;
+    dev->bytes_saved = 0;
+    dev->_front = 0;
+    dev->_busy = false;
+    dev->_pending = false;
+    tm1640_invalidate(dev);
     tm1640_write_ints(dev, data);
     tm1640_write_dsp_ctrl(dev);
 }
 
-// data: 16ch x 2color. Each color 64bit = 8row x 8col. Little endian.
-void tm1640_write_ints(const tm1640_t *dev, const uint64_t data[16][2])
+// 16ch x 2color のデータを, クロックごとに全チャネルの DIO レベルを並べたワード列に変換する.
+// words[color * 64 + row * 8 + col] の各ビットは GPIO 番号に対応する.
+void tm1640_build_words(const tm1640_t *dev, const uint64_t data[16][2], uint32_t words[TM1640_FRAME_CLOCKS])
 {
-    tm1640_write_data_cmd(dev);
-    tm1640_start(dev);
-    tm1640_write_byte(dev, TM1640_CMD2); // Start address
+    memset(words, 0, sizeof(uint32_t) * TM1640_FRAME_CLOCKS);
 
-    for (int color = 0; color < 2; color++)
+    for (int ch = 0; ch < TM1640_CHANNELS; ch++)
     {
-        for (int row = 0; row < 8; row++)
+        uint32_t pin_bit = 1u << dev->pin_dios[ch];
+        for (int color = 0; color < 2; color++)
         {
-            for (int col = 0; col < 8; col++)
+            // 64bit 演算を避けるため 32bit ずつ処理する
+            uint32_t lo = (uint32_t)data[ch][color];
+            uint32_t hi = (uint32_t)(data[ch][color] >> 32);
+            uint32_t *w = &words[color * 64];
+            for (int i = 0; i < 32; i++)
             {
-                for (int ch = 0; ch < TM1640_CHANNELS; ch++)
-                {
-                    int bit = (data[ch][color] >> (row * 8 + col)) & 1;
-                    gpio_put(dev->pin_dios[ch], bit);
-                }
-                tm1640_delay();
-                gpio_put(dev->pin_clk, 1);
-                tm1640_delay();
-                gpio_put(dev->pin_clk, 0);
-                tm1640_delay();
+                if ((lo >> i) & 1)
+                    w[i] |= pin_bit;
+                if ((hi >> i) & 1)
+                    w[32 + i] |= pin_bit;
             }
         }
     }
+}
 
-    tm1640_stop(dev);
+// 次回の送信で全グリッドを送り直す
+void tm1640_invalidate(tm1640_t *dev)
+{
+    dev->_valid = false;
+}
+
+// base を表示しているパネルと比べて変化したグリッドのビットを立てる
+uint32_t tm1640_dirty_grids(const tm1640_t *dev, const uint32_t base[TM1640_FRAME_CLOCKS], const uint32_t words[TM1640_FRAME_CLOCKS])
+{
+    if (!dev->_valid)
+        return (1u << TM1640_GRIDS) - 1;
+
+    uint32_t dirty = 0;
+    for (int grid = 0; grid < TM1640_GRIDS; grid++)
+    {
+        for (int i = grid * 8; i < grid * 8 + 8; i++)
+        {
+            if (words[i] != base[i])
+            {
+                dirty |= 1u << grid;
+                break;
+            }
+        }
+    }
+    return dirty;
+}
+
+// start から stop までの 1 パケットを開始する
+uint32_t *tm1640_plan_begin(tm1640_plan_t *plan)
+{
+    int used = 0;
+    for (int i = 0; i < plan->n_packets; i++)
+        used += plan->lens[i];
+    plan->lens[plan->n_packets++] = 0;
+    return &plan->words[used];
+}
+
+// 全チャネルに同じバイトを送るクロックを追加する
+uint32_t *tm1640_plan_byte(tm1640_plan_t *plan, uint32_t *w, uint32_t mask, uint8_t data)
+{
+    for (int i = 0; i < 8; i++)
+        *w++ = ((data >> i) & 1) ? mask : 0;
+    plan->lens[plan->n_packets - 1] += 8;
+    return w;
+}
+
+// グリッドのデータのクロックを追加する
+uint32_t *tm1640_plan_grids(tm1640_plan_t *plan, uint32_t *w, const uint32_t words[TM1640_FRAME_CLOCKS], int grid, int n)
+{
+    memcpy(w, &words[grid * 8], sizeof(uint32_t) * 8 * n);
+    plan->lens[plan->n_packets - 1] += 8 * n;
+    return w + 8 * n;
+}
+
+// base を表示しているパネルを words にする送信手順を作る.
+// 変化したグリッドが少なければ固定アドレスモードで, 多ければ自動インクリメントで全グリッドを送る.
+void tm1640_build_plan(tm1640_t *dev, const uint32_t base[TM1640_FRAME_CLOCKS], const uint32_t words[TM1640_FRAME_CLOCKS], tm1640_plan_t *plan)
+{
+    uint32_t mask = dev->_dio_mask;
+    uint32_t dirty = tm1640_dirty_grids(dev, base, words);
+    int n = 0;
+    for (uint32_t d = dirty; d != 0; d &= d - 1)
+        n++;
+
+    // 1 チップあたりのバイト数: 全送信はデータコマンド + アドレス + 16 グリッド,
+    // 差分送信はデータコマンド + (アドレス + 1 グリッド) x n
+    const int full_bytes = 2 + TM1640_GRIDS;
+    int fixed_bytes = n == 0 ? 0 : 1 + 2 * n;
+
+    plan->n_packets = 0;
+    if (fixed_bytes < full_bytes)
+    {
+        if (n > 0)
+        {
+            uint32_t *w = tm1640_plan_begin(plan);
+            tm1640_plan_byte(plan, w, mask, TM1640_CMD1 | TM1640_FIXED);
+            for (int grid = 0; grid < TM1640_GRIDS; grid++)
+            {
+                if (!((dirty >> grid) & 1))
+                    continue;
+                w = tm1640_plan_begin(plan);
+                w = tm1640_plan_byte(plan, w, mask, TM1640_CMD2 | grid);
+                tm1640_plan_grids(plan, w, words, grid, 1);
+            }
+        }
+        plan->bytes_sent = fixed_bytes;
+        plan->bytes_saved = full_bytes - fixed_bytes;
+    }
+    else
+    {
+        uint32_t *w = tm1640_plan_begin(plan);
+        tm1640_plan_byte(plan, w, mask, TM1640_CMD1);
+        w = tm1640_plan_begin(plan);
+        w = tm1640_plan_byte(plan, w, mask, TM1640_CMD2); // Start address
+        tm1640_plan_grids(plan, w, words, 0, TM1640_GRIDS);
+        plan->bytes_sent = full_bytes;
+        plan->bytes_saved = 0;
+    }
+    dev->_valid = true;
+}
+
+// 送信手順を送り始めるときに統計に加える
+void tm1640_count_plan(tm1640_t *dev, const tm1640_plan_t *plan)
+{
+    dev->frames++;
+    dev->bytes_sent += plan->bytes_sent;
+    dev->bytes_saved += plan->bytes_saved;
+}
+
+// 送信手順をその場で (ブロッキングで) 実行する
+void tm1640_run_plan(const tm1640_t *dev, const tm1640_plan_t *plan)
+{
+    uint32_t mask = dev->_dio_mask;
+    const uint32_t *w = plan->words;
+
+    for (int p = 0; p < plan->n_packets; p++)
+    {
+        tm1640_start(dev);
+        for (int i = 0; i < plan->lens[p]; i++)
+            tm1640_clock_word(dev, mask, *w++);
+        tm1640_stop(dev);
+    }
+}
+
+bool tm1640_busy(const tm1640_t *dev)
+{
+    return dev->_busy;
+}
+
+// 非同期送信の各段階. 割り込みは 1 クロックに 1 回で, CLK のパルスと次の DIO の出力をまとめて行う.
+// DIO は CLK が Low の間に変え, 次の割り込みの立ち上がりまで 1 周期保つ
+enum
+{
+    PH_START_DIO,
+    PH_START_CLK,
+    PH_CLOCK,
+    PH_STOP_CLK,
+    PH_STOP_END,
+};
+
+void tm1640_begin_async(tm1640_t *dev)
+{
+    dev->_packet = 0;
+    dev->_clock = 0;
+    dev->_phase = PH_START_DIO;
+    dev->_next_word = dev->_plans[dev->_front].words;
+}
+
+// TM1640_DELAY_US ごとに呼ばれ, 送信を 1 段階進める
+bool tm1640_timer_callback(struct repeating_timer *t)
+{
+    tm1640_t *dev = (tm1640_t *)t->user_data;
+    const tm1640_plan_t *plan = &dev->_plans[dev->_front];
+
+    switch (dev->_phase)
+    {
+    case PH_START_DIO:
+        tm1640_put_dios(dev, 0);
+        dev->_phase = PH_START_CLK;
+        break;
+    case PH_START_CLK:
+        gpio_put(dev->pin_clk, 0);
+        if (dev->_clock < plan->lens[dev->_packet])
+        {
+            tm1640_put_dios(dev, *dev->_next_word++);
+            dev->_phase = PH_CLOCK;
+        }
+        else
+        {
+            dev->_phase = PH_STOP_CLK; // DIO は start で Low のまま
+        }
+        break;
+    case PH_CLOCK:
+        gpio_put(dev->pin_clk, 1);
+        busy_wait_us_32(TM1640_CLK_HIGH_US);
+        gpio_put(dev->pin_clk, 0);
+        if (++dev->_clock < plan->lens[dev->_packet])
+        {
+            tm1640_put_dios(dev, *dev->_next_word++);
+        }
+        else
+        {
+            tm1640_put_dios(dev, 0); // stop の準備
+            dev->_phase = PH_STOP_CLK;
+        }
+        break;
+    case PH_STOP_CLK:
+        gpio_put(dev->pin_clk, 1);
+        dev->_phase = PH_STOP_END;
+        break;
+    case PH_STOP_END:
+        tm1640_put_dios(dev, UINT32_MAX);
+        dev->_clock = 0;
+        dev->_phase = PH_START_DIO;
+        if (++dev->_packet < plan->n_packets)
+            break;
+
+        // フレーム完了. 待機中のフレームがあれば続けて送る
+        if (dev->on_done)
+            dev->on_done(dev);
+        if (dev->_pending)
+        {
+            dev->_pending = false;
+            dev->_front = 1 - dev->_front;
+            tm1640_count_plan(dev, &dev->_plans[dev->_front]);
+            tm1640_begin_async(dev);
+            if (dev->_plans[dev->_front].n_packets > 0)
+                break;
+        }
+        dev->_busy = false;
+        return false;
+    }
+    return true;
+}
+
+// data: 16ch x 2color. Each color 64bit = 8row x 8col. Little endian.
+// 非同期送信を開始してすぐに戻る. 送信中であれば, 今のフレームの送信後に送る
+// (まだ送り始めていないフレームは新しいフレームで置き換える).
+void tm1640_submit(tm1640_t *dev, const uint64_t data[16][2])
+{
+    uint32_t words[TM1640_FRAME_CLOCKS];
+    tm1640_build_words(dev, data, words);
+
+    // 待機中のフレームを取り消してから, 送信中のフレームを基準に差分を作る
+    uint32_t irq = save_and_disable_interrupts();
+    dev->_pending = false;
+    restore_interrupts(irq);
+
+    int back = 1 - dev->_front;
+    tm1640_build_plan(dev, dev->_words[dev->_front], words, &dev->_plans[back]);
+    memcpy(dev->_words[back], words, sizeof(words));
+
+    irq = save_and_disable_interrupts();
+    if (dev->_busy)
+    {
+        dev->_pending = true;
+    }
+    else
+    {
+        dev->_front = back;
+        tm1640_count_plan(dev, &dev->_plans[back]);
+        if (dev->_plans[back].n_packets > 0)
+        {
+            dev->_busy = true;
+            tm1640_begin_async(dev);
+            add_repeating_timer_us(-TM1640_DELAY_US, tm1640_timer_callback, dev, &dev->_timer);
+        }
+    }
+    restore_interrupts(irq);
+}
+
+// data: 16ch x 2color. Each color 64bit = 8row x 8col. Little endian.
+// 前回から変化したグリッドだけを, 送信が終わるまでブロックして送る.
+void tm1640_write_ints(tm1640_t *dev, const uint64_t data[16][2])
+{
+    while (dev->_busy)
+        tight_loop_contents();
+
+    uint32_t words[TM1640_FRAME_CLOCKS];
+    tm1640_build_words(dev, data, words);
+
+    int back = 1 - dev->_front;
+    tm1640_build_plan(dev, dev->_words[dev->_front], words, &dev->_plans[back]);
+    memcpy(dev->_words[back], words, sizeof(words));
+    tm1640_count_plan(dev, &dev->_plans[back]);
+    tm1640_run_plan(dev, &dev->_plans[back]);
+    dev->_front = back;
 }
@@ -1,17 +1,60 @@
 #ifndef TM1640
 #define TM1640
+#include "pico/stdlib.h"
 #include "hardware/gpio.h"
 
 #define TM1640_CHANNELS 16
+#define TM1640_FRAME_CLOCKS 128 // 2color x 8row x 8col
+#define TM1640_GRIDS 16          // 1 グリッド = 1 アドレス = 8 クロック
+
+// 1 フレームの送信手順. start/stop で区切られたパケットの並びで, 各クロックの DIO レベルを持つ.
+// 最大はデータコマンド (8) + アドレス (8) + 全グリッド (128) クロック.
+#define TM1640_PLAN_CLOCKS (8 + 8 + TM1640_FRAME_CLOCKS)
+#define TM1640_PLAN_PACKETS (1 + TM1640_GRIDS)
 
 typedef struct
+{
+    uint32_t words[TM1640_PLAN_CLOCKS];
+    uint8_t lens[TM1640_PLAN_PACKETS];
+    int n_packets;
+    uint8_t bytes_sent, bytes_saved; // 送り始めたときに tm1640_t の統計に加える
+} tm1640_plan_t;
+
+typedef struct tm1640
 {
     uint pin_clk;
     uint pin_dios[TM1640_CHANNELS];
     uint brightness;
+
+    // 非同期送信の完了時にタイマー割り込みから呼ばれる (NULL 可)
+    void (*on_done)(struct tm1640 *dev);
+
+    // 差分送信の統計. 実際に送り始めたフレームだけを数える (送る前に置き換えられたフレームは数えない).
+    // バイト数は 1 チップあたりのバス上のバイト数 (コマンドを含む)
+    uint32_t frames;
+    uint32_t bytes_sent;
+    uint32_t bytes_saved;
+
+    // ダブルバッファ. _words[i] は _plans[i] を送り終えたときのパネルの内容
+    tm1640_plan_t _plans[2];
+    uint32_t _words[2][TM1640_FRAME_CLOCKS];
+    bool _valid;
+    volatile int _front; // 送信中 (または最後に送信した) スロット
+    volatile bool _busy, _pending;
+
+    uint32_t _dio_mask; // 全チャネルの DIO ピン. tm1640_init で求める
+
+    // 割り込み側の状態
+    struct repeating_timer _timer;
+    int _packet, _clock, _phase;
+    const uint32_t *_next_word;
 } tm1640_t;
 
-void tm1640_init(const tm1640_t *dev, const uint64_t data[16][2]);
-void tm1640_write_ints(const tm1640_t *dev, const uint64_t data[16][2]);
+void tm1640_init(tm1640_t *dev, const uint64_t data[16][2]);
+void tm1640_write_ints(tm1640_t *dev, const uint64_t data[16][2]);
+void tm1640_submit(tm1640_t *dev, const uint64_t data[16][2]);
+bool tm1640_busy(const tm1640_t *dev);
+void tm1640_invalidate(tm1640_t *dev);
+void tm1640_build_words(const tm1640_t *dev, const uint64_t data[16][2], uint32_t words[TM1640_FRAME_CLOCKS]);
 
-#endif
\ No newline at end of file
+#endif